@@ -1,5 +1,6 @@
 ﻿using System;
 using System.Collections.Generic;
+using System.IO;
 using System.Text;
 
 namespace ESP8266DebugPackage
@@ -52,15 +53,67 @@ namespace ESP8266DebugPackage
             0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
         };
 
-        public static uint Update(uint crc, byte[] data, int size)
+        //Slicing-by-8 tables: table k (at offset k * 256) advances the CRC over a byte followed by k zero bytes.
+        //This allows processing 8 input bytes per iteration with independent lookups.
+        static readonly uint[] _SliceTables = BuildSliceTables();
+
+        static uint[] BuildSliceTables()
         {
+            uint[] tables = new uint[8 * 256];
+            Array.Copy(crc32_tab, tables, 256);
+            for (int k = 1; k < 8; k++)
+                for (int n = 0; n < 256; n++)
+                {
+                    uint prev = tables[(k - 1) * 256 + n];
+                    tables[k * 256 + n] = (prev >> 8) ^ crc32_tab[prev & 0xFF];
+                }
+            return tables;
+        }
+
+        public static uint Update(uint crc, byte[] data, int size) => Update(crc, data, 0, size);
+
+        public static uint Update(uint crc, ArraySegment<byte> data) => Update(crc, data.Array, data.Offset, data.Count);
+
+        public static uint Update(uint crc, byte[] data, int offset, int size)
+        {
+            if (offset < 0 || size < 0 || offset + size > data.Length)
+                throw new ArgumentOutOfRangeException(nameof(size));
+
+            uint[] t = _SliceTables;
+            int i = offset, end = offset + size;
             crc = crc ^ ~0U;
 
-            for (int i = 0; i < size; i++)
+            for (; i + 8 <= end; i += 8)
+            {
+                uint lo = crc ^ (data[i] | ((uint)data[i + 1] << 8) | ((uint)data[i + 2] << 16) | ((uint)data[i + 3] << 24));
+                uint hi = data[i + 4] | ((uint)data[i + 5] << 8) | ((uint)data[i + 6] << 16) | ((uint)data[i + 7] << 24);
+
+                crc = t[7 * 256 + (lo & 0xFF)] ^ t[6 * 256 + ((lo >> 8) & 0xFF)] ^ t[5 * 256 + ((lo >> 16) & 0xFF)] ^ t[4 * 256 + (lo >> 24)] ^
+                      t[3 * 256 + (hi & 0xFF)] ^ t[2 * 256 + ((hi >> 8) & 0xFF)] ^ t[1 * 256 + ((hi >> 16) & 0xFF)] ^ t[hi >> 24];
+            }
+
+            for (; i < end; i++)
                 crc = crc32_tab[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
 
             return crc ^ ~0U;
         }
+
+        //Reads exactly 'count' bytes from the current stream position and updates the CRC with them
+        public static uint Update(uint crc, Stream stream, long count)
+        {
+            byte[] buf = new byte[(int)Math.Min(count, 0x10000)];
+            while (count > 0)
+            {
+                int todo = (int)Math.Min(buf.Length, count);
+                int done = stream.Read(buf, 0, todo);
+                if (done <= 0)
+                    throw new EndOfStreamException("Unexpected end of stream while computing CRC32");
+
+                crc = Update(crc, buf, 0, done);
+                count -= done;
+            }
+            return crc;
+        }
     }
 
 }
\ No newline at end of file
@@ -65,40 +65,93 @@ namespace ESP8266DebugPackage
             SHT_NOBITS = 8,
         }
 
-        public static object ConvertByteArrayToStruct(byte[] array, Type type, int offset)
+        const int ELFHeaderSize = 52;
+        const int SectionHeaderSize = 40;
+        public const int SymbolSize = 16;
+
+        //The structures below are decoded directly from the file buffer. This avoids the per-structure
+        //reflection and unmanaged allocations done by Marshal.PtrToStructure().
+        Elf32_Ehdr ParseELFHeader()
         {
-            IntPtr buffer = Marshal.AllocHGlobal(Marshal.SizeOf(type));
-            Marshal.Copy(array, offset, buffer, Marshal.SizeOf(type));
-            object obj = Marshal.PtrToStructure(buffer, type);
-            Marshal.FreeHGlobal(buffer);
-            return obj;
+            if (_Data.Length < ELFHeaderSize)
+                throw new Exception($"Invalid ELF file ({_PathHint}): file too short");
+
+            byte[] signature = new byte[16];
+            Buffer.BlockCopy(_Data, 0, signature, 0, signature.Length);
+
+            return new Elf32_Ehdr
+            {
+                Signature = signature,
+                e_type = BitConverter.ToUInt16(_Data, 16),
+                e_machine = BitConverter.ToUInt16(_Data, 18),
+                e_version = BitConverter.ToUInt32(_Data, 20),
+                e_entry = BitConverter.ToUInt32(_Data, 24),
+                e_phoff = BitConverter.ToUInt32(_Data, 28),
+                e_shoff = BitConverter.ToUInt32(_Data, 32),
+                e_flags = BitConverter.ToUInt32(_Data, 36),
+                e_ehsize = BitConverter.ToUInt16(_Data, 40),
+                e_phentsize = BitConverter.ToUInt16(_Data, 42),
+                e_phnum = BitConverter.ToUInt16(_Data, 44),
+                e_shentsize = BitConverter.ToUInt16(_Data, 46),
+                e_shnum = BitConverter.ToUInt16(_Data, 48),
+                e_shstrndx = BitConverter.ToUInt16(_Data, 50),
+            };
         }
 
-        protected _Type ReadStruct<_Type>(int offsetInFile)
+        Elf32_Shdr ParseSectionHeader(long offsetInFile)
         {
-            _File.Seek(offsetInFile, SeekOrigin.Begin);
-            byte[] data = new byte[Marshal.SizeOf(typeof(_Type))];
-            _File.Read(data, 0, data.Length);
-            return (_Type)ConvertByteArrayToStruct(data, typeof(_Type), 0);
+            if (offsetInFile < 0 || offsetInFile + SectionHeaderSize > _Data.Length)
+                throw new Exception($"Invalid ELF file ({_PathHint}): section header outside the file");
+
+            int off = (int)offsetInFile;
+            return new Elf32_Shdr
+            {
+                sh_name = BitConverter.ToUInt32(_Data, off),
+                sh_type = BitConverter.ToUInt32(_Data, off + 4),
+                sh_flags = BitConverter.ToUInt32(_Data, off + 8),
+                sh_addr = BitConverter.ToUInt32(_Data, off + 12),
+                sh_offset = BitConverter.ToUInt32(_Data, off + 16),
+                sh_size = BitConverter.ToUInt32(_Data, off + 20),
+                sh_link = BitConverter.ToUInt32(_Data, off + 24),
+                sh_info = BitConverter.ToUInt32(_Data, off + 28),
+                sh_addralign = BitConverter.ToUInt32(_Data, off + 32),
+                sh_entsize = BitConverter.ToUInt32(_Data, off + 36),
+            };
         }
 
-        byte[] LoadSection(Elf32_Shdr sectionHeader)
+        static elf32_sym ParseSymbol(byte[] data, int offset)
         {
-            return LoadSection((int)sectionHeader.sh_offset, (int)sectionHeader.sh_size);
+            return new elf32_sym
+            {
+                st_name = BitConverter.ToUInt32(data, offset),
+                st_value = BitConverter.ToUInt32(data, offset + 4),
+                st_size = BitConverter.ToUInt32(data, offset + 8),
+                st_info = data[offset + 12],
+                st_other = data[offset + 13],
+                st_shndx = BitConverter.ToUInt16(data, offset + 14),
+            };
         }
 
-        byte[] LoadSection(int offset, int size)
+        ArraySegment<byte> GetView(long offset, long size)
         {
-            if (size + offset > _File.Length)
+            if (offset < 0 || size < 0 || size + offset > _Data.Length)
                 throw new Exception("Invalid string size/offset");
 
-            byte[] data = new byte[size];
-            _File.Seek((int)offset, SeekOrigin.Begin);
-            _File.Read(data, 0, size);
-            return data;
+            return new ArraySegment<byte>(_Data, (int)offset, (int)size);
         }
 
-        Stream _File;
+        static string ReadNullTerminatedString(ArraySegment<byte> table, uint offset)
+        {
+            int start = table.Offset + (int)offset, end = table.Offset + table.Count, eidx;
+            for (eidx = start; eidx < end; eidx++)
+                if (table.Array[eidx] == 0)
+                    break;
+
+            return Encoding.ASCII.GetString(table.Array, start, eidx - start);
+        }
+
+        //The entire file is kept in memory, so section contents can be returned as views into it without copying
+        readonly byte[] _Data;
 
         Elf32_Ehdr _CachedHeader;
 
@@ -108,7 +161,7 @@ namespace ESP8266DebugPackage
             {
                 if (_CachedHeader == null)
                 {
-                    var hdr = ReadStruct<Elf32_Ehdr>(0);
+                    var hdr = ParseELFHeader();
                     if (hdr.Signature[0] != 0x7F || hdr.Signature[1] != 'E' || hdr.Signature[2] != 'L' || hdr.Signature[3] != 'F')
                         throw new Exception($"Invalid ELF file ({_PathHint}): mismatching signature");
                     _CachedHeader = hdr;
@@ -117,26 +170,38 @@ namespace ESP8266DebugPackage
             }
         }
 
-        byte[] _CachedStringTable;
+        ArraySegment<byte>? _CachedStringTableView;
 
-        public byte[] StringTable
+        ArraySegment<byte> StringTableView
         {
             get
             {
-                if (_CachedStringTable == null)
+                if (_CachedStringTableView == null)
                 {
                     var hdr = ELFHeader;
-                    if (hdr.e_shoff + hdr.e_shentsize * hdr.e_shnum > _File.Length)
+                    if (hdr.e_shoff + hdr.e_shentsize * hdr.e_shnum > _Data.Length)
                         throw new Exception($"Invalid ELF file ({_PathHint}): inconsistent string table");
                     if (hdr.e_shstrndx >= hdr.e_shnum)
                         throw new Exception($"Invalid ELF file ({_PathHint}): string table too long");
 
-                    var hdrStrings = ReadStruct<Elf32_Shdr>((int)(hdr.e_shoff + hdr.e_shstrndx * hdr.e_shentsize));
+                    var hdrStrings = ParseSectionHeader(hdr.e_shoff + hdr.e_shstrndx * hdr.e_shentsize);
                     if (hdrStrings.sh_type != (short)SectionType.SHT_STRTAB)
                         throw new Exception($"Invalid ELF file ({_PathHint}): unexpected string table section type");
 
-                    _CachedStringTable = LoadSection(hdrStrings);
+                    _CachedStringTableView = GetView(hdrStrings.sh_offset, hdrStrings.sh_size);
                 }
+                return _CachedStringTableView.Value;
+            }
+        }
+
+        byte[] _CachedStringTable;
+
+        public byte[] StringTable
+        {
+            get
+            {
+                if (_CachedStringTable == null)
+                    _CachedStringTable = CopyView(StringTableView);
                 return _CachedStringTable;
             }
         }
@@ -146,18 +211,27 @@ namespace ESP8266DebugPackage
         public ELFFile(string fileName)
         {
             _PathHint = fileName;
-            _File = new BufferedStream(File.Open(fileName, FileMode.Open, FileAccess.Read, FileShare.ReadWrite), 1024 * 1024);
+            using (var fs = File.Open(fileName, FileMode.Open, FileAccess.Read, FileShare.ReadWrite))
+            {
+                _Data = new byte[fs.Length];
+                int done = 0;
+                while (done < _Data.Length)
+                {
+                    int chunk = fs.Read(_Data, done, _Data.Length - done);
+                    if (chunk <= 0)
+                        throw new IOException($"Failed to read {fileName}");
+                    done += chunk;
+                }
+            }
         }
 
         public ELFFile(byte[] data)
         {
-            _File = new MemoryStream(data);
+            _Data = data;
         }
 
         public virtual void Dispose()
         {
-            if (_File != null)
-                _File.Dispose();
         }
 
         public class ParsedSection
@@ -209,10 +283,10 @@ namespace ESP8266DebugPackage
         {
             List<ParsedSection> result = new List<ParsedSection>();
             var hdr = ELFHeader;
-            var strings = StringTable;
+            var strings = StringTableView;
             for (int i = 0; i < hdr.e_shnum; i++)
             {
-                var shdr = ReadStruct<Elf32_Shdr>((int)(hdr.e_shoff + i * hdr.e_shentsize));
+                var shdr = ParseSectionHeader(hdr.e_shoff + i * hdr.e_shentsize);
 
                 ParsedSection section = new ParsedSection
                 {
@@ -224,12 +298,10 @@ namespace ESP8266DebugPackage
                     PresentInMemory = (shdr.sh_flags & 2) != 0,
                 };
 
-                int eidx;
-                for (eidx = (int)shdr.sh_name; eidx < strings.Length; eidx++)
-                    if (strings[eidx] == 0)
-                        break;
+                if (shdr.sh_name > strings.Count)
+                    throw new Exception($"Invalid ELF file ({_PathHint}): section name outside the string table");
 
-                section.SectionName = Encoding.ASCII.GetString(strings, (int)shdr.sh_name, eidx - (int)shdr.sh_name);
+                section.SectionName = ReadNullTerminatedString(strings, shdr.sh_name);
                 result.Add(section);
             }
             return result;
@@ -268,19 +340,32 @@ namespace ESP8266DebugPackage
             return null;
         }
 
+        static byte[] CopyView(ArraySegment<byte> view)
+        {
+            byte[] data = new byte[view.Count];
+            Buffer.BlockCopy(view.Array, view.Offset, data, 0, view.Count);
+            return data;
+        }
+
+        //Returns the section contents without copying them. The returned view references the internal file buffer and must not be modified.
+        public ArraySegment<byte> GetSectionView(ParsedSection section)
+        {
+            return GetView(section.OffsetInFile, section.Size);
+        }
+
         public byte[] LoadSection(ParsedSection section)
         {
             if (section == null)
                 return null;
-            return LoadSection((int)section.OffsetInFile, (int)section.Size);
+            return CopyView(GetSectionView(section));
         }
 
         public elf32_sym[] LoadSymbolTable(int offset, int symbolCount)
         {
+            var view = GetView(offset, (long)symbolCount * SymbolSize);
             elf32_sym[] data = new elf32_sym[symbolCount];
-            int symSize = Marshal.SizeOf(typeof(elf32_sym));
             for (int i = 0; i < symbolCount; i++)
-                data[i] = ReadStruct<elf32_sym>(offset + i * symSize);
+                data[i] = ParseSymbol(view.Array, view.Offset + i * SymbolSize);
             return data;
         }
 
@@ -299,40 +384,40 @@ namespace ESP8266DebugPackage
         public List<ParsedELFSymbol> LoadAllSymbols()
         {
             List<ParsedELFSymbol> symbols = new List<ParsedELFSymbol>();
-            byte[] symbolTable = LoadSection(FindSectionByName(".symtab"));
-            byte[] stringTable = LoadSection(FindSectionByName(".strtab"));
+            var symbolSection = FindSectionByName(".symtab");
+            var stringSection = FindSectionByName(".strtab");
 
-            if (symbolTable == null || stringTable == null)
+            if (symbolSection == null || stringSection == null)
                 return symbols;
 
+            var symbolTable = GetSectionView(symbolSection);
+            var stringTable = GetSectionView(stringSection);
+            byte[] data = symbolTable.Array;
+
             bool isARM = ELFHeader.e_machine == 40;
 
-            int structSize = Marshal.SizeOf(typeof(elf32_sym));
-            int symbolCount = symbolTable.Length / structSize;
+            int symbolCount = symbolTable.Count / SymbolSize;
+            symbols.Capacity = symbolCount;
             for (int i = 0; i < symbolCount; i++)
             {
-                elf32_sym rawSym = (elf32_sym)ConvertByteArrayToStruct(symbolTable, typeof(elf32_sym), i * structSize);
-                if (rawSym.st_value == 0)
+                //Only the fields used below are decoded to avoid creating an elf32_sym object per symbol
+                int off = symbolTable.Offset + i * SymbolSize;
+                uint st_name = BitConverter.ToUInt32(data, off);
+                uint st_value = BitConverter.ToUInt32(data, off + 4);
+                if (st_value == 0)
                     continue;
 
-                string symbolName = null;
-                if (rawSym.st_name != 0 && rawSym.st_name < stringTable.Length)
-                {
-                    int eidx = 0;
-                    for (eidx = (int)rawSym.st_name; eidx < stringTable.Length; eidx++)
-                        if (stringTable[eidx] == 0)
-                            break;
-
-                    symbolName = Encoding.ASCII.GetString(stringTable, (int)rawSym.st_name, eidx - (int)rawSym.st_name);
-                }
+                if (st_name == 0 || st_name >= stringTable.Count || stringTable.Array[stringTable.Offset + st_name] == '$')
+                    continue;
 
-                if (string.IsNullOrEmpty(symbolName) || symbolName[0] == '$')
+                string symbolName = ReadNullTerminatedString(stringTable, st_name);
+                if (symbolName.Length == 0)
                     continue;
 
                 if (isARM)
-                    rawSym.st_value &= ~1U; //On ARM the LSB of the address is used to denote arm/thumb mode
+                    st_value &= ~1U; //On ARM the LSB of the address is used to denote arm/thumb mode
 
-                symbols.Add(new ParsedELFSymbol { Address = rawSym.st_value, Name = symbolName, Size = rawSym.st_size });
+                symbols.Add(new ParsedELFSymbol { Address = st_value, Name = symbolName, Size = BitConverter.ToUInt32(data, off + 8) });
             }
 
             return symbols;
@@ -26,7 +26,8 @@ namespace ESP8266DebugPackage
         {
             public string Hint;
             public uint Address;
-            public byte[] Data;
+            public ArraySegment<byte> Data;     //Normally references the ELF file buffer directly
+            public int PaddedSize;              //If larger than Data.Count, the segment is padded with zeroes when saved
 
             const uint IROM_MAP_START = 0x400d0000;
             const uint IROM_MAP_END = 0x40400000;
@@ -47,11 +48,27 @@ namespace ESP8266DebugPackage
                 return $"{Hint} @0x{Address:x8}";
             }
 
+            public int Size => Math.Max(Data.Count, PaddedSize);
+
             public void Save(Stream stream)
             {
                 stream.Write(BitConverter.GetBytes(Address), 0, 4);
-                stream.Write(BitConverter.GetBytes(Data.Length), 0, 4);
-                stream.Write(Data, 0, Data.Length);
+                stream.Write(BitConverter.GetBytes(Size), 0, 4);
+                if (Data.Count > 0)
+                    stream.Write(Data.Array, Data.Offset, Data.Count);
+                WriteZeroes(stream, Size - Data.Count);
+            }
+        }
+
+        static readonly byte[] ZeroBlock = new byte[4096];
+
+        static void WriteZeroes(Stream stream, long count)
+        {
+            while (count > 0)
+            {
+                int todo = (int)Math.Min(count, ZeroBlock.Length);
+                stream.Write(ZeroBlock, 0, todo);
+                count -= todo;
             }
         }
 
@@ -172,10 +189,12 @@ namespace ESP8266DebugPackage
             public byte[] BuildRawHeader(int segmentCount) => new byte[] { 0xe9, (byte)segmentCount, (byte)Mode, (byte)(((byte)Size << 4) | (byte)Frequency) };
         }
 
-        static void UpdateChecksum(ref byte checksum, byte[] data)
+        //Padding bytes are zero and do not affect the checksum
+        static void UpdateChecksum(ref byte checksum, ArraySegment<byte> data)
         {
-            foreach (var b in data)
-                checksum ^= b;
+            byte[] array = data.Array;
+            for (int i = data.Offset, end = data.Offset + data.Count; i < end; i++)
+                checksum ^= array[i];
         }
 
         public IESPxxImageHeader Header;
@@ -228,7 +247,7 @@ namespace ESP8266DebugPackage
                             pad_len += IROM_ALIGN;
                         if (pad_len > 0)
                         {
-                            var paddingSegment = new Segment { Address = 0, Data = new byte[pad_len], Hint = "padding" };
+                            var paddingSegment = new Segment { Address = 0, PaddedSize = (int)pad_len, Hint = "padding" };
                             paddingSegmentCount++;
                             paddingSegment.Save(stream);
                         }
@@ -248,7 +267,7 @@ namespace ESP8266DebugPackage
             }
 
             int alignment = (int)(15 - ((stream.Position - offBase) % 16));
-            stream.Write(new byte[alignment], 0, alignment);
+            WriteZeroes(stream, alignment);
             stream.WriteByte(checksum);
 
             if (ESP32Mode)
@@ -261,16 +280,7 @@ namespace ESP8266DebugPackage
             {
                 long endOff = stream.Position;
                 stream.Position = offBase;
-                byte[] buf = new byte[0x10000];
-                uint crc32 = 0;
-                while (stream.Position < endOff)
-                {
-                    int todo = Math.Min(buf.Length, (int)(endOff - stream.Position));
-                    if (stream.Read(buf, 0, todo) != todo)
-                        throw new IOException("Failed to read data from the generated image");
-
-                    crc32 = CRC32.Update(crc32, buf, todo);
-                }
+                uint crc32 = CRC32.Update(0, stream, endOff - offBase);
 
                 uint fixedCRC = 0;
                 if (((int)crc32) < 0)
@@ -325,11 +335,8 @@ namespace ESP8266DebugPackage
 
                 if (!ramSectionsOnly || (sec.VirtualAddress < SPIFLASHBase))
                 {
-                    var segment = new Segment { Address = sec.VirtualAddress, Data = file.LoadSection(sec), Hint = sec.SectionName };
-                    int align = ((segment.Data.Length + 3) & ~3) - segment.Data.Length;
-                    if (align > 0)
-                        Array.Resize(ref segment.Data, segment.Data.Length + align);
-                    image.Segments.Add(segment);
+                    var data = file.GetSectionView(sec);
+                    image.Segments.Add(new Segment { Address = sec.VirtualAddress, Data = data, PaddedSize = (data.Count + 3) & ~3, Hint = sec.SectionName });
                 }
             }
         }
@@ -356,10 +363,8 @@ namespace ESP8266DebugPackage
             if (flashSections.Length != 1)
                 throw new Exception($"Unexpected count of SPI FLASH sections: {flashSections.Length}. Cannot detect image type");
 
-            int newSize = ((flashSections[0].Data.Length + 15) & ~15);
-            Array.Resize(ref flashSections[0].Data, newSize);
-
-            image.Segments.Add(new Segment { Address = 0, Data = flashSections[0].Data });
+            var data = flashSections[0].Data;
+            image.Segments.Add(new Segment { Address = 0, Data = data, PaddedSize = (data.Count + 15) & ~15 });
             image.BootloaderImageOffset = flashSections[0].OffsetInFLASH - BootloaderImageHeaderSize;
             image.AppNumber = (byte)appNumber;
 
@@ -371,7 +376,7 @@ namespace ESP8266DebugPackage
         public struct SPIFLASHSection
         {
             public ulong OffsetInFLASH;
-            public byte[] Data;
+            public ArraySegment<byte> Data;     //References the ELF file buffer. Use Data.Array/Data.Offset/Data.Count to write it out.
         }
 
         public static SPIFLASHSection[] GetFLASHSections(ELFFile file)
@@ -380,7 +385,7 @@ namespace ESP8266DebugPackage
             foreach (var sec in file.AllSections)
             {
                 if (sec.VirtualAddress >= SPIFLASHBase && sec.VirtualAddress < SPIFLASHLimit)
-                    sections.Add(new SPIFLASHSection { OffsetInFLASH = sec.VirtualAddress - SPIFLASHBase, Data = file.LoadSection(sec) });
+                    sections.Add(new SPIFLASHSection { OffsetInFLASH = sec.VirtualAddress - SPIFLASHBase, Data = file.GetSectionView(sec) });
             }
             return sections.ToArray();
         }
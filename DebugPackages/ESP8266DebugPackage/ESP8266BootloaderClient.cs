@@ -33,32 +33,95 @@ namespace ESP8266DebugPackage
             ESP_SYNC = 0x08,
             ESP_WRITE_REG = 0x09,
             ESP_READ_REG = 0x0a,
+            ESP_CHANGE_BAUDRATE = 0x0f,
+            ESP_FLASH_DEFL_BEGIN = 0x10,
+            ESP_FLASH_DEFL_DATA = 0x11,
+            ESP_FLASH_DEFL_END = 0x12,
         }
 
         const int ESP_FLASH_BLOCK = 0x400;
+        const int CommandHeaderSize = 8;
+        const int DataBlockHeaderSize = 16;
 
-        KeyValuePair<int, byte[]> RunCommand(Command op, byte[] data = null, int chk = 0)
+        //The ESP8266 and ESP32 ROMs only accept 1KB blocks. The esptool stub accepts larger ones (e.g. 16KB), saving a round-trip per block.
+        public int FLASHBlockSize { get; set; } = ESP_FLASH_BLOCK;
+
+        //SLIP frames are encoded directly into this buffer. It is only reallocated if a larger block size is requested.
+        byte[] _TxBuffer = new byte[2 * (CommandHeaderSize + DataBlockHeaderSize + ESP_FLASH_BLOCK) + 2];
+        int _TxLength;
+
+        void BeginPacket(Command op, int payloadLength, int chk)
         {
-            if (op != Command.ESP_NO_COMMAND)
+            int worstCaseSize = 2 * (CommandHeaderSize + payloadLength) + 2;
+            if (_TxBuffer.Length < worstCaseSize)
+                _TxBuffer = new byte[worstCaseSize];
+
+            _TxBuffer[0] = 0xc0;
+            _TxLength = 1;
+            AppendEscaped((byte)0);
+            AppendEscaped((byte)op);
+            AppendEscaped((byte)payloadLength);
+            AppendEscaped((byte)(payloadLength >> 8));
+            AppendEscaped((uint)chk);
+        }
+
+        void AppendEscaped(byte b)
+        {
+            if (b == 0xdb)
             {
-                byte[] cmdBlock = new byte[8 + ((data == null) ? 0 : data.Length)];
-                cmdBlock[0] = 0;
-                cmdBlock[1] = (byte)op;
-                BitConverter.GetBytes((ushort)((data == null) ? 0 : data.Length)).CopyTo(cmdBlock, 2);
-                BitConverter.GetBytes(chk).CopyTo(cmdBlock, 4);
-                if (data != null)
-                    data.CopyTo(cmdBlock, 8);
+                _TxBuffer[_TxLength++] = 0xdb;
+                _TxBuffer[_TxLength++] = 0xdd;
+            }
+            else if (b == 0xc0)
+            {
+                _TxBuffer[_TxLength++] = 0xdb;
+                _TxBuffer[_TxLength++] = 0xdc;
+            }
+            else
+                _TxBuffer[_TxLength++] = b;
+        }
+
+        void AppendEscaped(uint value)
+        {
+            for (int i = 0; i < 4; i++, value >>= 8)
+                AppendEscaped((byte)value);
+        }
+
+        void AppendEscaped(byte[] data, int offset, int length)
+        {
+            for (int i = 0; i < length; i++)
+                AppendEscaped(data[offset + i]);
+        }
+
+        void SendPacket()
+        {
+            _TxBuffer[_TxLength++] = 0xc0;
 
 #if DEBUG
-                StringBuilder sb = new StringBuilder();
-                foreach (var b in cmdBlock)
-                    sb.AppendFormat("{0:X2}", b);
-                System.Diagnostics.Debug.WriteLine(sb.ToString());
+            StringBuilder sb = new StringBuilder();
+            for (int i = 0; i < Math.Min(_TxLength, 64); i++)
+                sb.AppendFormat("{0:X2}", _TxBuffer[i]);
+            System.Diagnostics.Debug.WriteLine(sb.ToString());
 #endif
 
-                EscapeAndSend(cmdBlock);
+            _Port.Write(_TxBuffer, 0, _TxLength);
+        }
+
+        KeyValuePair<int, byte[]> RunCommand(Command op, byte[] data = null, int chk = 0)
+        {
+            if (op != Command.ESP_NO_COMMAND)
+            {
+                BeginPacket(op, (data == null) ? 0 : data.Length, chk);
+                if (data != null)
+                    AppendEscaped(data, 0, data.Length);
+                SendPacket();
             }
 
+            return ReadReply(op);
+        }
+
+        KeyValuePair<int, byte[]> ReadReply(Command op)
+        {
             byte[] result = new byte[8];
             if (_Port.Read(result, 0, 1) != 1)
                 throw new Exception("Timeout reading reply");
@@ -108,27 +171,10 @@ namespace ESP8266DebugPackage
             return length;
         }
 
-        private void EscapeAndSend(byte[] cmdBlock)
+        //The ESP8266 ROM returns 2 status bytes, the ESP32 ROM returns 4. In both cases the first 2 bytes are the status and the error code.
+        static bool IsSuccessful(KeyValuePair<int, byte[]> result)
         {
-            List<byte> packet = new List<byte> { Capacity = cmdBlock.Length * 2 };
-            packet.Add(0xc0);
-            foreach (var b in cmdBlock)
-            {
-                if (b == 0xdb)
-                {
-                    packet.Add(0xdb);
-                    packet.Add(0xdd);
-                }
-                else if (b == 0xc0)
-                {
-                    packet.Add(0xdb);
-                    packet.Add(0xdc);
-                }
-                else
-                    packet.Add(b);
-            }
-            packet.Add(0xc0);
-            _Port.Write(packet.ToArray(), 0, packet.Count);
+            return (result.Value.Length == 2 || result.Value.Length == 4) && result.Value[0] == 0 && result.Value[1] == 0;
         }
 
         public void Sync()
@@ -202,13 +248,25 @@ namespace ESP8266DebugPackage
             return data;
         }
 
+        //Only supported by the ESP32 ROM and the esptool stub. The ESP8266 ROM detects the baud rate during Sync(), so it should be synchronized at the desired rate instead.
+        //currentBaudRate should be 0 when talking to the ROM and the current baud rate when talking to the stub.
+        public void ChangeBaudRate(int newBaudRate, int currentBaudRate)
+        {
+            var result = RunCommand(Command.ESP_CHANGE_BAUDRATE, PackIntegers(newBaudRate, currentBaudRate));
+            if (!IsSuccessful(result))
+                throw new Exception("Failed to change the baud rate");
+
+            _Port.SetBaudRate(newBaudRate);
+            Thread.Sleep(50);
+            _Port.Purge();
+        }
 
         void StartFLASH(int offset, int sizeInBytes)
         {
-            int numBlocks = (sizeInBytes + ESP_FLASH_BLOCK - 1) / ESP_FLASH_BLOCK;
-            byte[] data = PackIntegers(sizeInBytes, numBlocks, ESP_FLASH_BLOCK, offset);
+            int numBlocks = (sizeInBytes + FLASHBlockSize - 1) / FLASHBlockSize;
+            byte[] data = PackIntegers(sizeInBytes, numBlocks, FLASHBlockSize, offset);
             var result = RunCommand(Command.ESP_FLASH_BEGIN, data);
-            if (result.Value.Length != 2 || result.Value[0] != 0 || result.Value[1] != 0)
+            if (!IsSuccessful(result))
                 throw new Exception("Failed to start FLASH operation");
         }
 
@@ -216,7 +274,7 @@ namespace ESP8266DebugPackage
         {
             byte[] data = PackIntegers(size, blocks, blocksize, offset);
             var result = RunCommand(Command.ESP_MEM_BEGIN, data);
-            if (result.Value.Length != 2 || result.Value[0] != 0 || result.Value[1] != 0)
+            if (!IsSuccessful(result))
                 throw new Exception("Failed to start RAM operation");
         }
 
@@ -224,7 +282,7 @@ namespace ESP8266DebugPackage
         {
             byte[] data = PackIntegers((entry == 0) ? 1 : 0, entry);
             var result = RunCommand(Command.ESP_MEM_END, data);
-            if (result.Value.Length != 2 || result.Value[0] != 0 || result.Value[1] != 0)
+            if (!IsSuccessful(result))
                 throw new Exception("Failed to end RAM operation");
         }
 
@@ -240,7 +298,7 @@ namespace ESP8266DebugPackage
             {
                 byte[] data = PackIntegers(reboot ? 0 : 1);
                 var result = RunCommand(Command.ESP_FLASH_END, data);
-                if (result.Value.Length != 2 || result.Value[0] != 0 || result.Value[1] != 0)
+                if (!IsSuccessful(result))
                     throw new Exception("Failed to finish FLASH operation");
             }
         }
@@ -263,28 +321,82 @@ namespace ESP8266DebugPackage
         public delegate void BlockWrittenHandler(ESP8266BootloaderClient sender, uint address, int blockSize);
         public event BlockWrittenHandler BlockWritten;
 
+        //Sends a data block padded with 0xFF to paddedLength. The block is encoded straight from the source array without intermediate copies.
+        void SendDataBlock(Command op, byte[] data, int offset, int paddedLength, int seq, string errorMessage)
+        {
+            int length = Math.Min(paddedLength, data.Length - offset);
+            int chk = ComputeChecksum(data, offset, length);
+            if (((paddedLength - length) & 1) != 0)
+                chk ^= 0xff;
+
+            BeginPacket(op, DataBlockHeaderSize + paddedLength, chk);
+            AppendEscaped((uint)paddedLength);
+            AppendEscaped((uint)seq);
+            AppendEscaped(0U);
+            AppendEscaped(0U);
+            AppendEscaped(data, offset, length);
+            for (int i = length; i < paddedLength; i++)
+                _TxBuffer[_TxLength++] = 0xff;
+            SendPacket();
+
+            var result = ReadReply(op);
+            if (!IsSuccessful(result))
+                throw new Exception(errorMessage);
+        }
+
         void WriteFLASHBlock(uint baseAddr, byte[] data, int offset, int length, int seq)
         {
-            byte[] packet = PackIntegers(length, seq, 0, 0);
-            int headerLen = packet.Length;
-            Array.Resize(ref packet, headerLen + length);
-            Array.Copy(data, offset, packet, headerLen, Math.Min(length, data.Length - offset));
-            for (int i = headerLen + (data.Length - offset); i < packet.Length; i++)
-                packet[i] = 0xff;
-
-            var result = RunCommand(Command.ESP_FLASH_DATA, packet, ComputeChecksum(packet, headerLen, length));
-            if (result.Value.Length != 2 || result.Value[0] != 0 || result.Value[1] != 0)
-                throw new Exception("Failed to send FLASH contents");
+            SendDataBlock(Command.ESP_FLASH_DATA, data, offset, length, seq, "Failed to send FLASH contents");
             if (BlockWritten != null)
                 BlockWritten(this, (uint)(baseAddr + offset), Math.Min(length, data.Length - offset));
         }
 
         public void ProgramFLASH(uint address, byte[] data)
         {
-            int blockCount = (data.Length + ESP_FLASH_BLOCK - 1) / ESP_FLASH_BLOCK;
-            StartFLASH((int)address, blockCount * ESP_FLASH_BLOCK);
+            int blockSize = FLASHBlockSize;
+            int blockCount = (data.Length + blockSize - 1) / blockSize;
+            StartFLASH((int)address, blockCount * blockSize);
+            for (int seq = 0; seq < blockCount; seq++)
+                WriteFLASHBlock(address, data, seq * blockSize, blockSize, seq);
+        }
+
+        //Sends the data as a zlib stream that is inflated on the target. Only supported by the ESP32 ROM and the esptool stub.
+        //Returns the size of the compressed stream.
+        public int ProgramFLASHCompressed(uint address, byte[] data, bool targetIsStub)
+        {
+            byte[] compressedData = FLASHDataCompressor.Compress(data);
+            int blockSize = FLASHBlockSize;
+            int blockCount = (compressedData.Length + blockSize - 1) / blockSize;
+
+            //The stub erases the FLASH as it goes and expects the exact uncompressed size. The ROM expects the size rounded up to the block size.
+            int writeSize = targetIsStub ? data.Length : ((data.Length + blockSize - 1) / blockSize) * blockSize;
+
+            var result = RunCommand(Command.ESP_FLASH_DEFL_BEGIN, PackIntegers(writeSize, blockCount, blockSize, (int)address));
+            if (!IsSuccessful(result))
+                throw new Exception("Failed to start compressed FLASH operation");
+
+            int reportedSize = 0;
             for (int seq = 0; seq < blockCount; seq++)
-                WriteFLASHBlock(address, data, seq * ESP_FLASH_BLOCK, ESP_FLASH_BLOCK, seq);
+            {
+                int offset = seq * blockSize;
+                int length = Math.Min(blockSize, compressedData.Length - offset);
+                SendDataBlock(Command.ESP_FLASH_DEFL_DATA, compressedData, offset, length, seq, "Failed to send compressed FLASH contents");
+
+                //Progress is reported in terms of the uncompressed data, proportionally to the compressed bytes sent so far.
+                int uncompressedSize = (int)((long)(offset + length) * data.Length / compressedData.Length);
+                if (BlockWritten != null)
+                    BlockWritten(this, (uint)(address + reportedSize), uncompressedSize - reportedSize);
+                reportedSize = uncompressedSize;
+            }
+
+            return compressedData.Length;
+        }
+
+        public void FinishCompressedFLASH(bool reboot)
+        {
+            var result = RunCommand(Command.ESP_FLASH_DEFL_END, PackIntegers(reboot ? 0 : 1));
+            if (!IsSuccessful(result))
+                throw new Exception("Failed to finish compressed FLASH operation");
         }
     }
 }
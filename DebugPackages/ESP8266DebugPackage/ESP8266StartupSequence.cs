@@ -25,6 +25,13 @@ namespace ESP8266DebugPackage
         public string ErrorMessage;
         public bool CanRetry;
 
+        //Called once the step succeeds. The returned steps are executed right away, so they can depend on the values read back from the target.
+        //If the step returns followup steps, its own ProgressWeight is only an estimate and is replaced by the weights of the returned steps.
+        public Func<BSPEngine.ISimpleGDBSession, List<CustomStartStep>> GetFollowupSteps;
+
+        //Called if the step fails. Can read back the details from the target and return a more specific message than ErrorMessage.
+        public Func<BSPEngine.ISimpleGDBSession, string> DescribeFailure;
+
         public CustomStartStep(params string[] commands)
         {
             Commands = commands;
@@ -33,6 +40,8 @@ namespace ESP8266DebugPackage
             ErrorMessage = null;
             CheckResult = false;
             CanRetry = false;
+            GetFollowupSteps = null;
+            DescribeFailure = null;
         }
     }
 
@@ -44,6 +53,41 @@ namespace ESP8266DebugPackage
 
     class ESP8266StartupSequence
     {
+        //Mirrors FLASHCommandType in ESP8266FLASHProg.cpp
+        enum FLASHCommand
+        {
+            Initialize,
+            Erase,
+            Program,
+            ComputeSectorHashes,
+            EraseChip,
+            RunBatch,
+            Verify,
+        }
+
+        //A part of a programmable region. Offset is relative to the start of the region (and its file).
+        struct RegionRange
+        {
+            public ProgrammableRegion Region;
+            public int Offset;
+            public int Size;
+
+            public RegionRange(ProgrammableRegion region, int offset, int size)
+            {
+                Region = region;
+                Offset = offset;
+                Size = size;
+            }
+
+            public static List<RegionRange> WholeRegions(List<ProgrammableRegion> regions)
+            {
+                List<RegionRange> result = new List<RegionRange>();
+                foreach (var region in regions)
+                    result.Add(new RegionRange(region, 0, region.Size));
+                return result;
+            }
+        }
+
         struct ParsedFLASHLoader
         {
             public readonly byte[] Data;
@@ -59,6 +103,16 @@ namespace ESP8266DebugPackage
             public readonly uint pArg2;
             public readonly uint pResult;
 
+            public readonly uint BatchEntries;
+            public readonly int MaxBatchEntries;
+
+            const int BatchEntrySize = 20;
+            const int BatchEntryResultOffset = 16;
+
+            public bool SupportsBatching => MaxBatchEntries > 0;
+
+            public string ResultVariable => string.Format("*((unsigned *)0x{0:x})", pResult);
+
             public ParsedFLASHLoader(string fn)
             {
                 Data = File.ReadAllBytes(fn);
@@ -78,9 +132,29 @@ namespace ESP8266DebugPackage
                 pArg1 = ParameterArea + 4;
                 pArg2 = ParameterArea + 8;
                 pResult = ParameterArea + 12;
+
+                //Newer loaders append the batch command list to the header. It is marked with a separate signature.
+                if (Data.Length >= 36 && BitConverter.ToUInt32(Data, 24) == 0x48435442)
+                {
+                    BatchEntries = BitConverter.ToUInt32(Data, 28);
+                    MaxBatchEntries = BitConverter.ToInt32(Data, 32);
+                }
+                else
+                {
+                    BatchEntries = 0;
+                    MaxBatchEntries = 0;
+                }
             }
 
-            public CustomStartStep QueueInvocation(int cmd, string arg1, string arg2, string dataFile, int dataOffset, int dataSize, bool loadSelf = false, string error = null)
+            string BuildDataUploadCommand(string dataFile, int dataOffset, int dataSize, int bufferOffset)
+            {
+                if (dataFile.Contains(" "))
+                    throw new Exception("Programmed file path cannot contain spaces: " + FullPath);
+
+                return string.Format("restore {0} binary 0x{1:x} 0x{2:x} 0x{3:x}", dataFile.Replace('\\', '/'), DataBuffer + bufferOffset - dataOffset, dataOffset, dataOffset + dataSize);
+            }
+
+            public CustomStartStep QueueInvocation(FLASHCommand cmd, string arg1, string arg2, string dataFile, int dataOffset, int dataSize, bool loadSelf = false, string error = null)
             {
                 List<string> cmds = new List<string>();
 
@@ -92,18 +166,18 @@ namespace ESP8266DebugPackage
                 }
 
                 if (dataFile != null)
-                {
-                    if (dataFile.Contains(" "))
-                        throw new Exception("Programmed file path cannot contain spaces: " + FullPath);
+                    cmds.Add(BuildDataUploadCommand(dataFile, dataOffset, dataSize, 0));
 
-                    cmds.Add(string.Format("restore {0} binary 0x{1:x} 0x{2:x} 0x{3:x}", dataFile.Replace('\\', '/'), DataBuffer - dataOffset, dataOffset, dataOffset + dataSize));
-                }
+                return QueueInvocation(cmds, cmd, arg1, arg2, dataSize, error);
+            }
 
+            CustomStartStep QueueInvocation(List<string> cmds, FLASHCommand cmd, string arg1, string arg2, int progressWeight, string error)
+            {
                 cmds.Add(string.Format("flushregs", EntryPoint));
                 cmds.Add(string.Format("set $epc2=0x{0:x}", EntryPoint));
                 cmds.Add(string.Format("set $ps=0x20", EntryPoint));
                 cmds.Add(string.Format("set $sp=$$DEBUG:INITIAL_STACK_POINTER$$"));
-                cmds.Add(string.Format("set *((unsigned *)0x{0:x})={1}", pCommand, cmd));
+                cmds.Add(string.Format("set *((unsigned *)0x{0:x})={1}", pCommand, (int)cmd));
                 cmds.Add(string.Format("set *((unsigned *)0x{0:x})={1}", pArg1, arg1));
                 cmds.Add(string.Format("set *((unsigned *)0x{0:x})={1}", pArg2, arg2));
                 cmds.Add(string.Format("set *((unsigned *)0x{0:x})={1}", pResult, uint.MaxValue));
@@ -115,16 +189,126 @@ namespace ESP8266DebugPackage
 
                 return new CustomStartStep(cmds.ToArray())
                 {
-                    ResultVariable = string.Format("*((unsigned *)0x{0:x})", pResult),
+                    ResultVariable = ResultVariable,
                     ErrorMessage = error,
-                    ProgressWeight = dataSize,
+                    ProgressWeight = progressWeight,
                     CanRetry = true,
                 };
             }
 
+            struct QueuedBatchEntry
+            {
+                public FLASHCommand Command;
+                public int Address;
+            }
+
+            class PendingBatch
+            {
+                public List<string> Commands = new List<string>();
+                public List<QueuedBatchEntry> Entries = new List<QueuedBatchEntry>();
+                public int BufferOffset;
+                public int ProgressWeight;
+
+                public int EntryCount => Entries.Count;
+
+                public void Reset()
+                {
+                    Commands.Clear();
+                    Entries.Clear();
+                    BufferOffset = ProgressWeight = 0;
+                }
+            }
+
+            void AddBatchEntry(PendingBatch batch, FLASHCommand cmd, int arg1, int arg2, int bufferOffset)
+            {
+                uint pEntry = (uint)(BatchEntries + batch.EntryCount * BatchEntrySize);
+                batch.Commands.Add(string.Format("set *((unsigned *)0x{0:x})={1}", pEntry, (int)cmd));
+                batch.Commands.Add(string.Format("set *((unsigned *)0x{0:x})={1}", pEntry + 4, arg1));
+                batch.Commands.Add(string.Format("set *((unsigned *)0x{0:x})={1}", pEntry + 8, arg2));
+                batch.Commands.Add(string.Format("set *((unsigned *)0x{0:x})={1}", pEntry + 12, bufferOffset));
+                batch.Entries.Add(new QueuedBatchEntry { Command = cmd, Address = arg1 });
+            }
+
+            //The helper stops at the first failed entry and leaves its error code in the Result field.
+            static string DescribeBatchFailure(BSPEngine.ISimpleGDBSession session, uint batchEntries, QueuedBatchEntry[] entries)
+            {
+                for (int i = 0; i < entries.Length; i++)
+                {
+                    string result = session.EvaluateExpression(string.Format("*((int *)0x{0:x})", batchEntries + i * BatchEntrySize + BatchEntryResultOffset));
+                    if (result == "0")
+                        continue;
+
+                    switch (entries[i].Command)
+                    {
+                        case FLASHCommand.Erase:
+                            return string.Format("Failed to erase the FLASH memory at 0x{0:x} (error {1})", entries[i].Address, result);
+                        case FLASHCommand.Program:
+                            return string.Format("Failed to program the FLASH memory at 0x{0:x} (error {1})", entries[i].Address, result);
+                        case FLASHCommand.Verify:
+                            return string.Format("FLASH contents at 0x{0:x} do not match the programmed data (error {1})", entries[i].Address, result);
+                        default:
+                            return string.Format("{0} command failed at 0x{1:x} (error {2})", entries[i].Command, entries[i].Address, result);
+                    }
+                }
+
+                return null;
+            }
+
+            void FlushBatch(List<CustomStartStep> cmds, PendingBatch batch)
+            {
+                if (batch.EntryCount == 0)
+                    return;
+
+                var step = QueueInvocation(new List<string>(batch.Commands), FLASHCommand.RunBatch, batch.EntryCount.ToString(), "0", batch.ProgressWeight, "Failed to program FLASH memory");
+                var entries = batch.Entries.ToArray();
+                uint batchEntries = BatchEntries;
+                step.DescribeFailure = session => DescribeBatchFailure(session, batchEntries, entries);
+                cmds.Add(step);
+                batch.Reset();
+            }
+
+            //Packs erase and program operations for multiple regions into as few helper invocations as the data buffer and the batch list allow.
+            //If verify is set, each programmed block is compared with the FLASH contents while its data is still in the buffer.
+            public void QueueBatchedRegionProgramming(List<CustomStartStep> cmds, List<RegionRange> ranges, bool eraseRanges, bool verify)
+            {
+                PendingBatch batch = new PendingBatch();
+                const int alignment = 4;
+
+                foreach (var range in ranges)
+                {
+                    var region = range.Region;
+                    if (eraseRanges)
+                    {
+                        if (batch.EntryCount >= MaxBatchEntries)
+                            FlushBatch(cmds, batch);
+
+                        AddBatchEntry(batch, FLASHCommand.Erase, region.Offset + range.Offset, range.Size, 0);
+                    }
+
+                    for (int off = range.Offset, end = range.Offset + range.Size; off < end;)
+                    {
+                        if (batch.EntryCount + (verify ? 2 : 1) > MaxBatchEntries || batch.BufferOffset >= DataBufferSize)
+                            FlushBatch(cmds, batch);
+
+                        int todo = Math.Min(end - off, DataBufferSize - batch.BufferOffset);
+                        int alignedTodo = ((todo + alignment - 1) / alignment) * alignment;
+
+                        batch.Commands.Add(BuildDataUploadCommand(region.FileName, off, todo, batch.BufferOffset));
+                        AddBatchEntry(batch, FLASHCommand.Program, region.Offset + off, alignedTodo, batch.BufferOffset);
+                        if (verify)
+                            AddBatchEntry(batch, FLASHCommand.Verify, region.Offset + off, alignedTodo, batch.BufferOffset);
+                        batch.BufferOffset += alignedTodo;
+                        batch.ProgressWeight += todo;
+                        off += todo;
+                    }
+                }
+
+                FlushBatch(cmds, batch);
+            }
+
             public void QueueRegionProgramming(List<CustomStartStep> cmds, ProgrammableRegion region)
             {
-                cmds.Add(QueueInvocation(1, region.Offset.ToString(), region.Size.ToString(), null, 0, 0, false, string.Format("Failed to erase the FLASH region starting at 0x{0:x}", region.Offset)));
+                cmds.Add(QueueInvocation(FLASHCommand.Erase, region.Offset.ToString(), region.Size.ToString(), null, 0, 0, false, string.Format("Failed to erase the FLASH region starting at 0x{0:x}", region.Offset)));
 
                 for (int off = 0; off < region.Size;)
                 {
@@ -132,11 +316,137 @@ namespace ESP8266DebugPackage
                     int alignment = 4;
                     int alignedTodo = ((todo + alignment - 1) / alignment) * alignment;
 
-                    cmds.Add(QueueInvocation(2, (region.Offset + off).ToString(), alignedTodo.ToString(), region.FileName, off, todo, false, string.Format("Failed to program the FLASH region starting at 0x{0:x}, offset 0x{1:x}, size 0x{2:x}", region.Offset, off, todo)));
+                    cmds.Add(QueueInvocation(FLASHCommand.Program, (region.Offset + off).ToString(), alignedTodo.ToString(), region.FileName, off, todo, false, string.Format("Failed to program the FLASH region starting at 0x{0:x}, offset 0x{1:x}, size 0x{2:x}", region.Offset, off, todo)));
                     off += todo;
                 }
             }
         }
+
+        //Reads back the CRC32 of each erase sector covered by the programmed regions and only erases/programs the sectors that differ.
+        class SectorHashChecker
+        {
+            readonly ParsedFLASHLoader _Loader;
+            readonly int _SectorSize;
+            readonly List<ProgrammableRegion> _Regions;
+            readonly bool _Verify;
+
+            //Ranges that need to be programmed, by region index. Regions that could not be checked are programmed entirely.
+            readonly Dictionary<int, List<RegionRange>> _ChangedRanges = new Dictionary<int, List<RegionRange>>();
+
+            static readonly Regex rgMemoryContents = new Regex("contents=\"([0-9a-fA-F]*)\"");
+
+            public SectorHashChecker(ParsedFLASHLoader loader, int sectorSize, List<ProgrammableRegion> regions, bool verify)
+            {
+                _Loader = loader;
+                _SectorSize = sectorSize > 0 ? sectorSize : 4096;   //The helper keeps its default sector size if 0 is specified
+                _Regions = regions;
+                _Verify = verify;
+            }
+
+            public void QueueSteps(List<CustomStartStep> cmds)
+            {
+                int totalSize = 0;
+                for (int i = 0; i < _Regions.Count; i++)
+                {
+                    var region = _Regions[i];
+                    totalSize += region.Size;
+
+                    int sectorCount = (region.Size + _SectorSize - 1) / _SectorSize;
+                    if ((region.Offset % _SectorSize) != 0 || sectorCount * 4 > _Loader.DataBufferSize)
+                        continue;
+
+                    int regionIndex = i;
+                    var step = _Loader.QueueInvocation(FLASHCommand.ComputeSectorHashes, region.Offset.ToString(), region.Size.ToString(), null, 0, 0);
+
+                    //A failed hash computation is not fatal. The region is simply programmed entirely.
+                    step.ResultVariable = null;
+                    step.GetFollowupSteps = session =>
+                    {
+                        _ChangedRanges[regionIndex] = FindChangedRanges(session, region, sectorCount);
+                        return null;
+                    };
+                    cmds.Add(step);
+                }
+
+                cmds.Add(new CustomStartStep(new string[0]) { ProgressWeight = totalSize, GetFollowupSteps = BuildProgrammingSteps });
+            }
+
+            static byte[] ReadTargetMemory(BSPEngine.ISimpleGDBSession session, uint address, int size)
+            {
+                var result = session.RunGDBCommand(string.Format("-data-read-memory-bytes 0x{0:x} {1}", address, size));
+                var m = rgMemoryContents.Match(result.MainStatus ?? "");
+                if (!result.IsDone || !m.Success || m.Groups[1].Length != size * 2)
+                    return null;
+
+                byte[] data = new byte[size];
+                for (int i = 0; i < size; i++)
+                    data[i] = byte.Parse(m.Groups[1].Value.Substring(i * 2, 2), System.Globalization.NumberStyles.HexNumber);
+                return data;
+            }
+
+            List<RegionRange> FindChangedRanges(BSPEngine.ISimpleGDBSession session, ProgrammableRegion region, int sectorCount)
+            {
+                byte[] hashes = null, data = File.ReadAllBytes(region.FileName);
+                if (session.EvaluateExpression(_Loader.ResultVariable) == "0" && data.Length >= region.Size)
+                    hashes = ReadTargetMemory(session, _Loader.DataBuffer, sectorCount * 4);
+
+                List<RegionRange> ranges = new List<RegionRange>();
+                if (hashes == null)
+                {
+                    session.SendInformationalOutput(string.Format("Could not check the FLASH contents at 0x{0:x}. Programming the entire region.", region.Offset));
+                    ranges.Add(new RegionRange(region, 0, region.Size));
+                    return ranges;
+                }
+
+                int runStart = -1;
+                for (int i = 0; i <= sectorCount; i++)
+                {
+                    bool changed = false;
+                    if (i < sectorCount)
+                    {
+                        int offset = i * _SectorSize;
+                        changed = CRC32.Update(0, data, offset, Math.Min(_SectorSize, region.Size - offset)) != BitConverter.ToUInt32(hashes, i * 4);
+                    }
+
+                    if (changed && runStart < 0)
+                        runStart = i;
+                    else if (!changed && runStart >= 0)
+                    {
+                        int offset = runStart * _SectorSize;
+                        ranges.Add(new RegionRange(region, offset, Math.Min(i * _SectorSize, region.Size) - offset));
+                        runStart = -1;
+                    }
+                }
+
+                return ranges;
+            }
+
+            List<CustomStartStep> BuildProgrammingSteps(BSPEngine.ISimpleGDBSession session)
+            {
+                List<RegionRange> ranges = new List<RegionRange>();
+                int totalSize = 0, programmedSize = 0;
+
+                for (int i = 0; i < _Regions.Count; i++)
+                {
+                    totalSize += _Regions[i].Size;
+                    if (_ChangedRanges.TryGetValue(i, out var changedRanges))
+                        ranges.AddRange(changedRanges);
+                    else
+                        ranges.Add(new RegionRange(_Regions[i], 0, _Regions[i].Size));
+                }
+
+                foreach (var r in ranges)
+                    programmedSize += r.Size;
+
+                if (programmedSize < totalSize)
+                    session.SendInformationalOutput(string.Format("Skipping {0}KB of {1}KB that already match the FLASH contents.", (totalSize - programmedSize) / 1024, totalSize / 1024));
+
+                List<CustomStartStep> steps = new List<CustomStartStep>();
+                _Loader.QueueBatchedRegionProgramming(steps, ranges, true, _Verify);
+                return steps;
+            }
+        }
+
         public static CustomStartupSequence BuildSequence(BSPEngine.IDebugStartService service, ESP8266OpenOCDSettings settings, BSPEngine.LiveMemoryLineHandler lineHandler, bool programFLASH, string debugMethodDirectory = null)
         {
             List<CustomStartStep> cmds = new List<CustomStartStep>();
@@ -176,14 +486,33 @@ namespace ESP8266DebugPackage
                     var parsedLoader = new ParsedFLASHLoader(loader);
 
                     cmds.Add(new CustomStartStep("print *((int *)0x60000900)", "set *((int *)0x60000900)=0"));
-                    cmds.Add(parsedLoader.QueueInvocation(0, settings.ProgramSectorSize.ToString(), settings.EraseSectorSize.ToString(), null, 0, 0, true));
+                    cmds.Add(parsedLoader.QueueInvocation(FLASHCommand.Initialize, settings.ProgramSectorSize.ToString(), settings.EraseSectorSize.ToString(), null, 0, 0, true));
 
                     if (settings.FLASHResources != null)
                         foreach (var r in settings.FLASHResources)
                             regions.Add(r.ToProgrammableRegion(service, true));
 
-                    foreach (var region in regions)
-                        parsedLoader.QueueRegionProgramming(cmds, region);
+                    if (parsedLoader.SupportsBatching)
+                    {
+                        if (settings.EraseEntireChip)
+                        {
+                            //Comparing or erasing individual sectors after a chip erase would only waste time
+                            cmds.Add(parsedLoader.QueueInvocation(FLASHCommand.EraseChip, "0", "0", null, 0, 0, false, "Failed to erase the FLASH chip"));
+                            parsedLoader.QueueBatchedRegionProgramming(cmds, RegionRange.WholeRegions(regions), false, settings.VerifyAfterProgramming);
+                        }
+                        else
+                            new SectorHashChecker(parsedLoader, settings.EraseSectorSize, regions, settings.VerifyAfterProgramming).QueueSteps(cmds);
+                    }
+                    else
+                    {
+                        if (settings.EraseEntireChip)
+                            lineHandler?.Invoke("The FLASH loader does not support erasing the entire chip. Only the programmed regions will be erased.", true);
+                        if (settings.VerifyAfterProgramming)
+                            lineHandler?.Invoke("The FLASH loader does not support verifying the programmed data. Skipping verification.", true);
+
+                        foreach (var region in regions)
+                            parsedLoader.QueueRegionProgramming(cmds, region);
+                    }
                 }
 
                 var resetMode = settings.ResetMode;
@@ -360,8 +689,8 @@ namespace ESP8266DebugPackage
                         fn = string.Format("{0}-0x{1:x5}.bin", pathBase, sec.OffsetInFLASH);
                         using (var fs = new FileStream(fn, FileMode.Create, FileAccess.ReadWrite, FileShare.ReadWrite))
                         {
-                            fs.Write(sec.Data, 0, sec.Data.Length);
-                            regions.Add(new ProgrammableRegion { FileName = fn, Offset = (int)sec.OffsetInFLASH, Size = sec.Data.Length });
+                            fs.Write(sec.Data.Array, sec.Data.Offset, sec.Data.Count);
+                            regions.Add(new ProgrammableRegion { FileName = fn, Offset = (int)sec.OffsetInFLASH, Size = sec.Data.Count });
                         }
                     }
                 }
@@ -4,105 +4,343 @@ using System.Collections.Generic;
 using System.IO;
 using System.Net;
 using System.Net.Sockets;
+using System.Security.Cryptography;
 using System.Text;
+using System.Threading;
 
 namespace ESPImageTool
 {
     class OTAServer
     {
-        struct OTAImage
+        class OTAImage
         {
-            public byte[] Data;
+            public byte[] Data;     //Shared between all connections. Must not be modified once built.
             public string File;
+            public string Key;
         }
 
-        public static void ServeOTAFiles(int port, ESP8266BinaryImage.ESP8266ImageHeader hdr, params string[] elfFiles)
+        //Keeps the built OTA images in memory and rebuilds them only when the contents of the corresponding ELF file change.
+        class OTAImageCache
         {
-            TcpListener listener = new TcpListener(port);
-            byte[] buffer = new byte[1024];
-            OTAImage[] images = new OTAImage[2];
+            class SourceFile
+            {
+                public string Path;
+                public DateTime LastWriteTime;
+                public long Length = -1;
+                public string Hash;
+                public int AppMode;
+                public string LastError;
+            }
+
+            readonly ESP8266BinaryImage.ESP8266ImageHeader _Header;
+            readonly List<SourceFile> _Sources = new List<SourceFile>();
+            readonly Dictionary<string, byte[]> _ImagesByHash = new Dictionary<string, byte[]>();
+            readonly OTAImage[] _Images = new OTAImage[2];
+            readonly object _Lock = new object();
+
+            public OTAImageCache(ESP8266BinaryImage.ESP8266ImageHeader hdr, string[] elfFiles)
+            {
+                _Header = hdr;
+                foreach (var fn in elfFiles)
+                    if (fn != null)
+                        _Sources.Add(new SourceFile { Path = fn });
+            }
+
+            static string ComputeHash(byte[] data)
+            {
+                using (var sha = SHA1.Create())
+                    return BitConverter.ToString(sha.ComputeHash(data)).Replace("-", "");
+            }
+
+            byte[] BuildImage(byte[] elfData, string key, int appMode)
+            {
+                byte[] image;
+                if (_ImagesByHash.TryGetValue(key, out image))
+                    return image;
+
+                using (var elfFile = new ELFFile(elfData))
+                {
+                    var img = ESP8266BinaryImage.MakeBootloaderBasedImageFromELFFile(elfFile, _Header, appMode);
+                    using (var ms = new MemoryStream())
+                    {
+                        img.Save(ms);
+                        image = ms.ToArray();
+                    }
+                }
+
+                _ImagesByHash[key] = image;
+                return image;
+            }
+
+            void Refresh(SourceFile src)
+            {
+                var info = new FileInfo(src.Path);
+                if (!info.Exists)
+                    throw new FileNotFoundException(src.Path + " not found");
+
+                if (info.LastWriteTimeUtc == src.LastWriteTime && info.Length == src.Length)
+                    return;
+
+                byte[] elfData = File.ReadAllBytes(src.Path);
+                string hash = ComputeHash(elfData);
+
+                if (hash != src.Hash)
+                {
+                    //Build the new image before touching the cached state, so that a partially written ELF file does not discard the previous image
+                    string status;
+                    int appMode;
+                    using (var elfFile = new ELFFile(elfData))
+                        appMode = ESP8266BinaryImage.DetectAppMode(elfFile, out status);
+
+                    //The image also depends on the slot it is built for, so the app number is a part of the key
+                    string key = hash + ":" + appMode;
+                    byte[] image = (appMode == 0) ? null : BuildImage(elfData, key, appMode);
 
-            foreach (var fn in elfFiles)
-                if (fn != null)
-                    using (var elfFile = new ELFFile(fn))
+                    if (src.AppMode != 0 && _Images[src.AppMode - 1]?.File == src.Path)
+                        _Images[src.AppMode - 1] = null;
+
+                    src.Hash = hash;
+                    src.AppMode = appMode;
+
+                    if (appMode == 0)
+                        Console.WriteLine(src.Path + " is not an OTA ELF file. Skipping...");
+                    else
+                    {
+                        _Images[appMode - 1] = new OTAImage { Data = image, File = src.Path, Key = key };
+                        Console.WriteLine($"Built APP{appMode} image from {Path.GetFileName(src.Path)} ({hash.Substring(0, 8)})");
+                    }
+
+                    RemoveUnusedImages();
+                }
+
+                src.LastWriteTime = info.LastWriteTimeUtc;
+                src.Length = info.Length;
+            }
+
+            //Only the images currently served for each slot are kept, so repeated rebuilds do not accumulate in memory
+            void RemoveUnusedImages()
+            {
+                foreach (var key in new List<string>(_ImagesByHash.Keys))
+                    if (_Images[0]?.Key != key && _Images[1]?.Key != key)
+                        _ImagesByHash.Remove(key);
+            }
+
+            //Checks the ELF files for changes and returns the current image for the given OTA slot (or null if none is available).
+            //If an ELF file cannot be read or parsed (e.g. while it is being rebuilt), the last successfully built image is served instead.
+            public OTAImage GetImage(int otaIndex)
+            {
+                lock (_Lock)
+                {
+                    foreach (var src in _Sources)
                     {
-                        string status;
-                        int appMode = ESP8266BinaryImage.DetectAppMode(elfFile, out status);
-                        if (appMode == 0)
+                        try
                         {
-                            Console.WriteLine(fn + " is not an OTA ELF file. Skipping...");
-                            continue;
+                            Refresh(src);
+                            src.LastError = null;
                         }
-
-                        var img = ESP8266BinaryImage.MakeBootloaderBasedImageFromELFFile(elfFile, hdr, appMode);
-                        using (var ms = new MemoryStream())
+                        catch (Exception ex)
                         {
-                            img.Save(ms);
-                            images[appMode - 1].Data = ms.ToArray();
-                            images[appMode - 1].File = fn;
+                            if (ex.Message != src.LastError)
+                                Console.WriteLine($"Cannot rebuild the OTA image from {Path.GetFileName(src.Path)}: {ex.Message}");
+                            src.LastError = ex.Message;
                         }
                     }
+                    return _Images[otaIndex];
+                }
+            }
+        }
 
+        const int MaxRequestHeaderSize = 8192;
+        const int SendChunkSize = 65536;
 
-            Console.WriteLine($"Ready to serve the following files:");
-            Console.WriteLine($"APP1: {images[0].File ?? "(none)"}");
-            Console.WriteLine($"APP2: {images[1].File ?? "(none)"}");
-            Console.WriteLine($"Waiting for connection on port {port}...");
-            listener.Start();
+        static int FindHeaderEnd(byte[] buffer, int size)
+        {
+            for (int i = 0; i + 3 < size; i++)
+                if (buffer[i] == '\r' && buffer[i + 1] == '\n' && buffer[i + 2] == '\r' && buffer[i + 3] == '\n')
+                    return i;
+            return -1;
+        }
+
+        static string ReadRequestHeader(Socket sock)
+        {
+            byte[] buffer = new byte[MaxRequestHeaderSize];
+            int size = 0;
             for (;;)
             {
-                using (var sock = listener.AcceptSocket())
+                if (size >= buffer.Length)
+                    throw new Exception("HTTP request header too long");
+
+                int done = sock.Receive(buffer, size, buffer.Length - size, SocketFlags.None);
+                if (done <= 0)
+                    throw new Exception("Connection closed before the request was received");
+
+                //The terminator may straddle the previously received chunk
+                int end = FindHeaderEnd(buffer, size + done);
+                size += done;
+                if (end >= 0)
+                    return Encoding.ASCII.GetString(buffer, 0, end);
+            }
+        }
+
+        //Parses a single 'bytes=' range. Returns false if the header is malformed or not supported (e.g. multiple ranges), so it should be ignored.
+        //A well-formed range that lies outside the image is returned with start > end.
+        static bool ParseRange(string value, long totalSize, out long start, out long end)
+        {
+            start = 0;
+            end = totalSize - 1;
+
+            value = value.Trim();
+            if (!value.StartsWith("bytes=", StringComparison.OrdinalIgnoreCase) || value.Contains(","))
+                return false;
+
+            string[] parts = value.Substring(6).Split('-');
+            if (parts.Length != 2)
+                return false;
+
+            string first = parts[0].Trim(), last = parts[1].Trim();
+            if (first == "")
+            {
+                long suffix;
+                if (!long.TryParse(last, out suffix) || suffix < 0)
+                    return false;
+                start = (suffix == 0) ? totalSize : Math.Max(0, totalSize - suffix);
+            }
+            else
+            {
+                if (!long.TryParse(first, out start) || start < 0)
+                    return false;
+                if (last != "" && (!long.TryParse(last, out end) || end < start))
+                    return false;
+                end = Math.Min(end, totalSize - 1);
+            }
+
+            return true;
+        }
+
+        static void SendAll(Socket sock, byte[] data, int offset, int size)
+        {
+            while (size > 0)
+            {
+                int done = sock.Send(data, offset, size, SocketFlags.None);
+                if (done <= 0)
+                    throw new Exception("Connection closed while sending data");
+                offset += done;
+                size -= done;
+            }
+        }
+
+        static void SendReply(Socket sock, string status, params string[] headers)
+        {
+            StringBuilder reply = new StringBuilder();
+            reply.Append("HTTP/1.1 " + status + "\r\n");
+            foreach (var hdr in headers)
+                reply.Append(hdr + "\r\n");
+            reply.Append("Connection: close\r\n\r\n");
+
+            var r = Encoding.ASCII.GetBytes(reply.ToString());
+            SendAll(sock, r, 0, r.Length);
+        }
+
+        static void HandleConnection(Socket sock, OTAImageCache cache)
+        {
+            string remote = (sock.RemoteEndPoint as IPEndPoint)?.Address.ToString();
+            try
+            {
+                using (sock)
                 {
-                    Console.WriteLine($"Incoming connection from {(sock.RemoteEndPoint as IPEndPoint).Address}");
+                    sock.ReceiveTimeout = 10000;
 
-                    StringBuilder requestBuilder = new StringBuilder();
-                    while (!requestBuilder.ToString().Contains("\r\n\r"))
+                    string[] lines = ReadRequestHeader(sock).Split(new[] { "\r\n" }, StringSplitOptions.None);
+                    string[] parts = lines[0].Split(' ');
+                    if (parts.Length < 3)
                     {
-                        int done = sock.Receive(buffer);
-                        requestBuilder.Append(Encoding.UTF8.GetString(buffer, 0, done));
+                        SendReply(sock, "400 Bad Request", "Content-Length: 0");
+                        throw new Exception("Invalid HTTP request: " + lines[0]);
                     }
 
-                    string request = requestBuilder.ToString();
-                    string[] parts = request.Split(' ');
-                    if (parts.Length < 3)
-                        throw new Exception("Invalid HTTP request: " + request);
+                    string method = parts[0], url = parts[1], range = null;
+                    for (int i = 1; i < lines.Length; i++)
+                    {
+                        int idx = lines[i].IndexOf(':');
+                        if (idx > 0 && lines[i].Substring(0, idx).Trim().ToLower() == "range")
+                            range = lines[i].Substring(idx + 1);
+                    }
 
-                    string url = parts[1];
-                    Console.WriteLine("Received request for " + url);
+                    Console.WriteLine($"[{remote}] {method} {url}{(range != null ? " (range:" + range + ")" : "")}");
                     int otaIndex = (url.ToLower().Contains("user2") ? 1 : 0);
-                    if (images[otaIndex].Data == null)
-                        throw new Exception($"No OTA image for app{otaIndex + 1} is provided. Please check your linker scripts.");
-
-                    string reply = string.Format("HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: {0}\r\n\r\n", images[otaIndex].Data.Length);
-                    var r = Encoding.UTF8.GetBytes(reply);
-                    sock.Send(r);
+                    var image = cache.GetImage(otaIndex);
+                    if (image == null)
+                    {
+                        SendReply(sock, "404 Not Found", "Content-Length: 0");
+                        Console.WriteLine($"[{remote}] No OTA image for app{otaIndex + 1} is provided. Please check your linker scripts.");
+                        return;
+                    }
 
-                    if (parts[0] == "GET")
+                    long totalSize = image.Data.Length, start = 0, end = totalSize - 1;
+                    if (range != null && !ParseRange(range, totalSize, out start, out end))
                     {
-                        Console.Write($"Serving {Path.GetFileName(images[otaIndex].File)}...\r\n");
+                        Console.WriteLine($"[{remote}] Ignoring unsupported range: {range.Trim()}");
+                        range = null;
+                        start = 0;
+                        end = totalSize - 1;
+                    }
 
-                        using (var ms = new MemoryStream(images[otaIndex].Data))
+                    if (range != null)
+                    {
+                        if (start > end)
                         {
-                            int totalDone = 0;
-                            for (;;)
-                            {
-                                int done = ms.Read(buffer, 0, buffer.Length);
-                                if (done == 0)
-                                    break;
-                                sock.Send(buffer, done, SocketFlags.None);
-                                totalDone += done;
-
-                                int percent = (int)((totalDone * 100) / ms.Length);
-                                int progress = percent / 5;
-                                Console.Write($"\r[{new string('#', progress).PadRight(20)}] {percent}%");
-                            }
+                            SendReply(sock, "416 Range Not Satisfiable", $"Content-Range: bytes */{totalSize}", "Content-Length: 0");
+                            return;
                         }
-                        Console.WriteLine("\r\nFile sent successfully\n");
-                        break;
+
+                        SendReply(sock, "206 Partial Content", "Content-Type: application/octet-stream", "Accept-Ranges: bytes",
+                            $"Content-Range: bytes {start}-{end}/{totalSize}", $"Content-Length: {end - start + 1}");
                     }
+                    else
+                        SendReply(sock, "200 OK", "Content-Type: application/octet-stream", "Accept-Ranges: bytes", $"Content-Length: {totalSize}");
+
+                    if (method != "GET")
+                        return;
+
+                    DateTime startTime = DateTime.Now;
+                    for (long off = start; off <= end; off += SendChunkSize)
+                        SendAll(sock, image.Data, (int)off, (int)Math.Min(SendChunkSize, end + 1 - off));
+
+                    sock.Shutdown(SocketShutdown.Send);
+                    Console.WriteLine($"[{remote}] Sent {end - start + 1} bytes of {Path.GetFileName(image.File)} in {(int)(DateTime.Now - startTime).TotalMilliseconds} ms");
                 }
             }
-            listener.Stop();
+            catch (Exception ex)
+            {
+                Console.WriteLine($"[{remote}] {ex.Message}");
+            }
+        }
+
+        public static void ServeOTAFiles(int port, ESP8266BinaryImage.ESP8266ImageHeader hdr, params string[] elfFiles)
+        {
+            TcpListener listener = new TcpListener(port);
+            var cache = new OTAImageCache(hdr, elfFiles);
+
+            var images = new[] { cache.GetImage(0), cache.GetImage(1) };
+
+            Console.WriteLine($"Ready to serve the following files:");
+            Console.WriteLine($"APP1: {images[0]?.File ?? "(none)"}");
+            Console.WriteLine($"APP2: {images[1]?.File ?? "(none)"}");
+            Console.WriteLine($"Waiting for connections on port {port} (images are rebuilt automatically when the ELF files change)...");
+            listener.Start();
+            try
+            {
+                for (;;)
+                {
+                    //Each device is served on a separate thread pool thread directly from the cached image buffer
+                    var sock = listener.AcceptSocket();
+                    ThreadPool.QueueUserWorkItem(s => HandleConnection((Socket)s, cache), sock);
+                }
+            }
+            finally
+            {
+                listener.Stop();
+            }
         }
     }
 }
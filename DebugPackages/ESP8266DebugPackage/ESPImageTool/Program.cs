@@ -196,8 +196,8 @@ namespace ESPImageTool
                                 fn = string.Format("{0}-0x{1:x5}.bin", pathBase, sec.OffsetInFLASH);
                                 using (var fs = new FileStream(fn, FileMode.Create, FileAccess.ReadWrite, FileShare.ReadWrite))
                                 {
-                                    fs.Write(sec.Data, 0, sec.Data.Length);
-                                    regions.Add(new ProgrammableRegion { FileName = fn, Offset = (int)sec.OffsetInFLASH, Size = sec.Data.Length });
+                                    fs.Write(sec.Data.Array, sec.Data.Offset, sec.Data.Count);
+                                    regions.Add(new ProgrammableRegion { FileName = fn, Offset = (int)sec.OffsetInFLASH, Size = sec.Data.Count });
                                 }
                             }
                         }
@@ -235,7 +235,9 @@ namespace ESPImageTool
 
                 if (port != null)
                 {
-                    using (var serialPort = new SerialPortStream(port, baud, System.IO.Ports.Handshake.None) { AllowTimingOutWithZeroBytes = true })
+                    //The ESP32 ROM is synchronized at the default rate and then switched to the requested one. The ESP8266 ROM detects the rate during sync.
+                    const int ESP32SyncBaudRate = 115200;
+                    using (var serialPort = new SerialPortStream(port, esp32mode ? ESP32SyncBaudRate : baud, System.IO.Ports.Handshake.None) { AllowTimingOutWithZeroBytes = true })
                     {
                         ESP8266BootloaderClient client = new ESP8266BootloaderClient(serialPort, 50, null);
                         Console.WriteLine("Connecting to bootloader on {0}...", port);
@@ -248,16 +250,37 @@ namespace ESPImageTool
                             Console.ReadKey();
                             client.Sync();
                         }
+
+                        if (esp32mode && baud != ESP32SyncBaudRate)
+                        {
+                            Console.WriteLine("Switching to {0} baud...", baud);
+                            client.ChangeBaudRate(baud, 0);
+                        }
+
                         foreach (var region in regions)
                         {
                             DateTime start = DateTime.Now;
                             Console.WriteLine("Programming " + Path.GetFileName(region.FileName) + "...");
                             var tracker = new ProgressTracker(region);
                             client.BlockWritten += tracker.BlockWritten;
-                            client.ProgramFLASH((uint)region.Offset, File.ReadAllBytes(region.FileName));
-                            client.BlockWritten -= tracker.BlockWritten;
-                            Console.WriteLine("\rProgrammed in {0} seconds        ", (int)(DateTime.Now - start).TotalSeconds);
+                            byte[] data = File.ReadAllBytes(region.FileName);
+                            if (esp32mode)
+                            {
+                                //The ESP32 ROM can inflate the data on the fly, reducing the amount of data sent over the serial port.
+                                int compressedSize = client.ProgramFLASHCompressed((uint)region.Offset, data, false);
+                                client.BlockWritten -= tracker.BlockWritten;
+                                Console.WriteLine("\rProgrammed in {0} seconds (compressed {1}KB to {2}KB)        ", (int)(DateTime.Now - start).TotalSeconds, data.Length / 1024, compressedSize / 1024);
+                            }
+                            else
+                            {
+                                client.ProgramFLASH((uint)region.Offset, data);
+                                client.BlockWritten -= tracker.BlockWritten;
+                                Console.WriteLine("\rProgrammed in {0} seconds        ", (int)(DateTime.Now - start).TotalSeconds);
+                            }
                         }
+
+                        if (esp32mode)
+                            client.FinishCompressedFLASH(false);
                     }
                 }
                 else
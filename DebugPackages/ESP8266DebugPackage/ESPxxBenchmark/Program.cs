@@ -0,0 +1,325 @@
+﻿using ESP8266DebugPackage;
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Threading;
+
+namespace ESPxxBenchmark
+{
+    //Measures the performance-critical parts of the ESPxx package without hardware. Run without arguments to execute all benchmarks.
+    class Program
+    {
+        static int Main(string[] args)
+        {
+            var benchmarks = new Dictionary<string, Action<string[]>>
+            {
+                { "serial", BenchmarkSerialProgramming },
+                { "crc32", BenchmarkCRC32 },
+                { "timeouts", CheckSerialTimeouts },
+            };
+
+            try
+            {
+                if (args.Length == 0)
+                {
+                    foreach (var kv in benchmarks)
+                        kv.Value(args);
+                }
+                else if (benchmarks.TryGetValue(args[0], out var benchmark))
+                    benchmark(args);
+                else
+                {
+                    Console.WriteLine("Usage: ESPxxBenchmark [" + string.Join("|", new List<string>(benchmarks.Keys).ToArray()) + "] [arguments]");
+                    return 1;
+                }
+
+                return 0;
+            }
+            catch (Exception ex)
+            {
+                Console.WriteLine(ex.Message);
+                return 1;
+            }
+        }
+
+        #region Serial FLASH programming
+
+        //Something resembling a firmware image: the package's own code, which compresses similarly to Xtensa binaries.
+        static byte[] MakeTestImage(int size)
+        {
+            byte[] code = File.ReadAllBytes(typeof(ESP8266BootloaderClient).Assembly.Location);
+            byte[] image = new byte[size];
+            for (int i = 0; i < size; i += code.Length)
+                Buffer.BlockCopy(code, 0, image, i, Math.Min(code.Length, size - i));
+            return image;
+        }
+
+        class SerialScenario
+        {
+            public string Name;
+            public bool IsESP32;
+            public int SyncBaudRate, BaudRate;
+            public bool Compressed;
+        }
+
+        //Usage: serial [image file]
+        static void BenchmarkSerialProgramming(string[] args)
+        {
+            if (Environment.OSVersion.Platform != PlatformID.Unix)
+            {
+                Console.WriteLine("The serial benchmark uses a pseudo-terminal and only runs on Linux.");
+                return;
+            }
+
+            byte[] image = args.Length > 1 ? File.ReadAllBytes(args[1]) : MakeTestImage(128 * 1024);
+            Console.WriteLine("Programming {0}KB via a simulated ROM bootloader:", image.Length / 1024);
+
+            var scenarios = new[]
+            {
+                new SerialScenario { Name = "ESP8266, 115200 baud", SyncBaudRate = 115200, BaudRate = 115200 },
+                new SerialScenario { Name = "ESP8266, 921600 baud", SyncBaudRate = 921600, BaudRate = 921600 },
+                new SerialScenario { Name = "ESP32, 115200->921600 baud", IsESP32 = true, SyncBaudRate = 115200, BaudRate = 921600 },
+                new SerialScenario { Name = "ESP32, 115200->921600 baud, compressed", IsESP32 = true, SyncBaudRate = 115200, BaudRate = 921600, Compressed = true },
+                new SerialScenario { Name = "No line rate limit", SyncBaudRate = 0, BaudRate = 0 },
+                new SerialScenario { Name = "No line rate limit, compressed", IsESP32 = true, SyncBaudRate = 0, BaudRate = 0, Compressed = true },
+            };
+
+            foreach (var scenario in scenarios)
+            {
+                using (var rom = new SimulatedBootloader(image.Length + 65536) { IsESP32 = scenario.IsESP32, BaudRate = scenario.SyncBaudRate })
+                using (var port = new SerialPortStream(rom.PortName, scenario.SyncBaudRate != 0 ? scenario.SyncBaudRate : 115200, System.IO.Ports.Handshake.None))
+                {
+                    //Pseudo-terminals have no modem lines, so the reset sequence is skipped
+                    var client = new ESP8266BootloaderClient(port, 0, "");
+                    client.Sync();
+
+                    var sw = Stopwatch.StartNew();
+                    if (scenario.BaudRate != scenario.SyncBaudRate)
+                        client.ChangeBaudRate(scenario.BaudRate, 0);
+
+                    int sentBytes;
+                    if (scenario.Compressed)
+                    {
+                        sentBytes = client.ProgramFLASHCompressed(0, image, false);
+                        client.FinishCompressedFLASH(false);
+                    }
+                    else
+                    {
+                        client.ProgramFLASH(0, image);
+                        client.RunProgram(false);
+                        sentBytes = image.Length;
+                    }
+                    sw.Stop();
+
+                    for (int i = 0; i < image.Length; i++)
+                        if (rom.FLASH[i] != image[i])
+                            throw new Exception($"{scenario.Name}: FLASH contents differ at offset 0x{i:x}");
+
+                    Console.WriteLine("  {0,-40} {1,8:f1} KB/s ({2}KB sent, {3}KB on the wire)",
+                        scenario.Name, image.Length / 1024.0 / sw.Elapsed.TotalSeconds, sentBytes / 1024, rom.BytesReceived / 1024);
+                }
+            }
+        }
+
+        #endregion
+
+        #region Serial port timeouts
+
+        //Sends the given bytes from the master side of the terminal, waiting before each one
+        static Thread StartDelayedWriter(PseudoTerminal pty, params KeyValuePair<int, byte>[] delaysAndBytes)
+        {
+            var thread = new Thread(() =>
+            {
+                foreach (var kv in delaysAndBytes)
+                {
+                    Thread.Sleep(kv.Key);
+                    pty.Write(new[] { kv.Value });
+                }
+            }) { IsBackground = true };
+            thread.Start();
+            return thread;
+        }
+
+        static KeyValuePair<int, byte>[] MakeByteSequence(int count, int delay)
+        {
+            var result = new KeyValuePair<int, byte>[count];
+            for (int i = 0; i < count; i++)
+                result[i] = new KeyValuePair<int, byte>(delay, (byte)i);
+            return result;
+        }
+
+        //Runs a single read with the given COMMTIMEOUTS values and checks the number of bytes and the elapsed time.
+        //The read runs on a separate thread, so a hang is reported as a failure instead of blocking the benchmark.
+        static void CheckTimeout(string name, uint interval, uint multiplier, uint constant, int count, KeyValuePair<int, byte>[] input,
+                                 int expectedBytes, int minTime, int maxTime)
+        {
+            using (var pty = new PseudoTerminal())
+            using (var port = new SerialPortStream(pty.PortName, 115200, System.IO.Ports.Handshake.None) { AllowTimingOutWithZeroBytes = true })
+            {
+                port.SetTimeouts(interval, multiplier, constant, 0, 0);
+                var writer = (input == null) ? null : StartDelayedWriter(pty, input);
+
+                int done = -1;
+                var sw = Stopwatch.StartNew();
+                var reader = new Thread(() => done = port.Read(new byte[count], 0, count)) { IsBackground = true };
+                reader.Start();
+                bool finished = reader.Join(5000);
+                sw.Stop();
+
+                //The remaining input must be sent before the terminal is closed
+                writer?.Join();
+
+                if (!finished)
+                    throw new Exception($"{name}: Read() did not return within 5 seconds");
+                if (done != expectedBytes || sw.ElapsedMilliseconds < minTime || sw.ElapsedMilliseconds > maxTime)
+                    throw new Exception($"{name}: got {done} bytes after {sw.ElapsedMilliseconds} ms, expected {expectedBytes} bytes after {minTime}-{maxTime} ms");
+
+                Console.WriteLine("  {0,-60} {1,3} bytes after {2,4} ms", name, done, sw.ElapsedMilliseconds);
+            }
+        }
+
+        static void CheckSerialTimeouts(string[] args)
+        {
+            if (Environment.OSVersion.Platform != PlatformID.Unix)
+            {
+                Console.WriteLine("The serial timeout checks use a pseudo-terminal and only run on Linux.");
+                return;
+            }
+
+            Console.WriteLine("Checking SerialPortStream read timeouts:");
+
+            CheckTimeout("MAXDWORD/0/0, no data", uint.MaxValue, 0, 0, 16, null, 0, 0, 20);
+            CheckTimeout("MAXDWORD/MAXDWORD/200, no data", uint.MaxValue, uint.MaxValue, 200, 16, null, 0, 190, 300);
+            CheckTimeout("MAXDWORD/MAXDWORD/1000, 1 byte after 100 ms", uint.MaxValue, uint.MaxValue, 1000, 16, MakeByteSequence(3, 100), 1, 90, 200);
+            CheckTimeout("0/0/200, no data", 0, 0, 200, 16, null, 0, 190, 300);
+            CheckTimeout("0/10/0, no data, 20 bytes requested", 0, 10, 0, 20, null, 0, 190, 300);
+            CheckTimeout("0/0/0, 16 bytes at 10 ms intervals", 0, 0, 0, 16, MakeByteSequence(16, 10), 16, 150, 400);
+            CheckTimeout("50/0/0, 5 bytes, then a 300 ms gap", 50, 0, 0, 16,
+                new[] { new KeyValuePair<int, byte>(0, 1), new KeyValuePair<int, byte>(0, 2), new KeyValuePair<int, byte>(0, 3), new KeyValuePair<int, byte>(0, 4),
+                        new KeyValuePair<int, byte>(0, 5), new KeyValuePair<int, byte>(300, 6) }, 5, 40, 200);
+
+            //Bytes keep arriving within the interval timeout until the total timeout expires
+            CheckTimeout("1000/0/200, 1 byte every 30 ms", 1000, 0, 200, 64, MakeByteSequence(20, 30), 6, 190, 300);
+
+            Console.WriteLine("Single-byte read throughput:");
+            using (var pty = new PseudoTerminal())
+            using (var port = new SerialPortStream(pty.PortName, 115200, System.IO.Ports.Handshake.None))
+            {
+                const int totalSize = 4 * 1024 * 1024;
+                port.SetTimeouts(100, 1, 1000, 0, 0);
+
+                byte[] chunk = new byte[4096];
+                for (int i = 0; i < chunk.Length; i++)
+                    chunk[i] = (byte)i;
+
+                var writer = new Thread(() =>
+                {
+                    for (int i = 0; i < totalSize; i += chunk.Length)
+                        pty.Write(chunk);
+                }) { IsBackground = true };
+
+                byte[] tmp = new byte[1];
+                var sw = Stopwatch.StartNew();
+                writer.Start();
+                for (int i = 0; i < totalSize; i++)
+                {
+                    if (port.Read(tmp, 0, 1) != 1)
+                        throw new Exception($"Timeout after {i} bytes");
+                    if (tmp[0] != (byte)(i % chunk.Length))
+                        throw new Exception($"Unexpected data at offset {i}");
+                }
+                sw.Stop();
+
+                Console.WriteLine("  {0}MB read byte by byte at {1:f1} MB/s", totalSize >> 20, (totalSize >> 20) / sw.Elapsed.TotalSeconds);
+            }
+        }
+
+        #endregion
+
+        #region CRC32
+
+        //Independent byte-at-a-time reference, with the table generated from the polynomial rather than copied from CRC32.cs
+        static readonly uint[] _ReferenceCRCTable = BuildReferenceCRCTable();
+
+        static uint[] BuildReferenceCRCTable()
+        {
+            uint[] table = new uint[256];
+            for (uint n = 0; n < 256; n++)
+            {
+                uint c = n;
+                for (int k = 0; k < 8; k++)
+                    c = ((c & 1) != 0) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+                table[n] = c;
+            }
+            return table;
+        }
+
+        static uint ReferenceCRC32(uint crc, byte[] data, int offset, int size)
+        {
+            crc = ~crc;
+            for (int i = offset; i < offset + size; i++)
+                crc = _ReferenceCRCTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+            return ~crc;
+        }
+
+        static void BenchmarkCRC32(string[] args)
+        {
+            Console.WriteLine("Checking CRC32 against the bytewise reference...");
+
+            uint check = CRC32.Update(0, System.Text.Encoding.ASCII.GetBytes("123456789"), 9);
+            if (check != 0xCBF43926)
+                throw new Exception($"CRC32 of the check string is {check:x8} instead of cbf43926");
+
+            Random rng = new Random(1);
+            byte[] buffer = new byte[65536];
+            rng.NextBytes(buffer);
+
+            for (int iter = 0; iter < 10000; iter++)
+            {
+                int offset = rng.Next(64), size = rng.Next(iter < 1000 ? 64 : buffer.Length - offset), split = rng.Next(size + 1);
+                uint seed = (uint)rng.Next();
+                uint expected = ReferenceCRC32(seed, buffer, offset, size);
+
+                if (CRC32.Update(seed, buffer, offset, size) != expected)
+                    throw new Exception($"CRC32 mismatch at offset {offset}, size {size}");
+                if (CRC32.Update(CRC32.Update(seed, buffer, offset, split), new ArraySegment<byte>(buffer, offset + split, size - split)) != expected)
+                    throw new Exception($"Incremental CRC32 mismatch at offset {offset}, size {size}, split {split}");
+
+                using (var ms = new MemoryStream(buffer, offset, size))
+                    if (CRC32.Update(seed, ms, size) != expected)
+                        throw new Exception($"Stream CRC32 mismatch at offset {offset}, size {size}");
+            }
+
+            Console.WriteLine("  10000 random buffers matched");
+            Console.WriteLine("Throughput:");
+
+            for (int size = 1024 * 1024; size <= 16 * 1024 * 1024; size *= 4)
+            {
+                byte[] data = new byte[size];
+                rng.NextBytes(data);
+
+                //Warm up the JIT and the caches before measuring
+                uint expected = ReferenceCRC32(0, data, 0, size);
+                if (CRC32.Update(0, data, 0, size) != expected)
+                    throw new Exception("CRC32 mismatch");
+
+                const int iterations = 5;
+                var sw = Stopwatch.StartNew();
+                for (int i = 0; i < iterations; i++)
+                    ReferenceCRC32(0, data, 0, size);
+                double bytewise = sw.Elapsed.TotalSeconds / iterations;
+
+                sw = Stopwatch.StartNew();
+                for (int i = 0; i < iterations; i++)
+                    CRC32.Update(0, data, 0, size);
+                double sliced = sw.Elapsed.TotalSeconds / iterations;
+
+                Console.WriteLine("  {0,2}MB: bytewise {1,6:f1} ms ({2,5:f0} MB/s), slicing-by-8 {3,6:f1} ms ({4,5:f0} MB/s), {5:f1}x",
+                    size >> 20, bytewise * 1000, (size >> 20) / bytewise, sliced * 1000, (size >> 20) / sliced, bytewise / sliced);
+            }
+        }
+
+        #endregion
+    }
+}
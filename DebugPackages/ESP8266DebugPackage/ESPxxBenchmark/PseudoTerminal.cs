@@ -0,0 +1,68 @@
+﻿using System;
+using System.ComponentModel;
+using System.Runtime.InteropServices;
+
+namespace ESPxxBenchmark
+{
+    //Master side of a Linux pseudo-terminal. The slave side (PortName) can be opened by SerialPortStream like a regular serial port.
+    class PseudoTerminal : IDisposable
+    {
+        [DllImport("libc", SetLastError = true)]
+        static extern int posix_openpt(int flags);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int grantpt(int fd);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int unlockpt(int fd);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern IntPtr ptsname(int fd);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern IntPtr read(int fd, byte[] buf, IntPtr count);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern IntPtr write(int fd, byte[] buf, IntPtr count);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int close(int fd);
+
+        const int O_RDWR = 0x0002, O_NOCTTY = 0x0100;
+
+        int _MasterFD;
+
+        public string PortName { get; }
+
+        public PseudoTerminal()
+        {
+            _MasterFD = posix_openpt(O_RDWR | O_NOCTTY);
+            if (_MasterFD < 0 || grantpt(_MasterFD) != 0 || unlockpt(_MasterFD) != 0)
+                throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot create a pseudo-terminal");
+
+            PortName = Marshal.PtrToStringAnsi(ptsname(_MasterFD));
+        }
+
+        //Blocks until some data is available. Returns 0 once the slave side has been closed.
+        public int Read(byte[] buffer)
+        {
+            long done = read(_MasterFD, buffer, new IntPtr(buffer.Length)).ToInt64();
+            return done < 0 ? 0 : (int)done;
+        }
+
+        public void Write(byte[] data)
+        {
+            if (write(_MasterFD, data, new IntPtr(data.Length)).ToInt64() != data.Length)
+                throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot write to the pseudo-terminal");
+        }
+
+        public void Dispose()
+        {
+            if (_MasterFD >= 0)
+            {
+                close(_MasterFD);
+                _MasterFD = -1;
+            }
+        }
+    }
+}
@@ -0,0 +1,200 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.IO.Compression;
+using System.Threading;
+
+namespace ESPxxBenchmark
+{
+    //Emulates the ESP8266/ESP32 ROM bootloader on the master side of a pseudo-terminal, so that SerialPortStream and ESP8266BootloaderClient
+    //can be exercised without hardware. The line rate is modelled by delaying each reply until the request would have been received at BaudRate.
+    class SimulatedBootloader : IDisposable
+    {
+        enum Command : byte
+        {
+            ESP_FLASH_BEGIN = 0x02,
+            ESP_FLASH_DATA = 0x03,
+            ESP_FLASH_END = 0x04,
+            ESP_SYNC = 0x08,
+            ESP_CHANGE_BAUDRATE = 0x0f,
+            ESP_FLASH_DEFL_BEGIN = 0x10,
+            ESP_FLASH_DEFL_DATA = 0x11,
+            ESP_FLASH_DEFL_END = 0x12,
+        }
+
+        readonly PseudoTerminal _Terminal = new PseudoTerminal();
+        readonly Thread _Thread;
+        readonly Stopwatch _LineClock = Stopwatch.StartNew();
+        double _LineBusyUntil;
+
+        int _WriteAddress, _WriteBlockSize;
+        MemoryStream _CompressedData;
+
+        public string PortName => _Terminal.PortName;
+
+        //0 disables the line rate emulation, so only the host-side overhead is measured
+        public int BaudRate;
+
+        //The ESP32 ROM sends 4 status bytes, the ESP8266 ROM sends 2
+        public bool IsESP32;
+
+        public readonly byte[] FLASH;
+        public int BytesReceived;
+
+        public SimulatedBootloader(int flashSize)
+        {
+            FLASH = new byte[flashSize];
+            for (int i = 0; i < FLASH.Length; i++)
+                FLASH[i] = 0xff;
+
+            _Thread = new Thread(ThreadBody) { IsBackground = true, Name = "Simulated bootloader" };
+            _Thread.Start();
+        }
+
+        void ThreadBody()
+        {
+            byte[] chunk = new byte[65536];
+            List<byte> frame = new List<byte>();
+            bool inFrame = false, escaped = false;
+
+            for (;;)
+            {
+                int done = _Terminal.Read(chunk);
+                if (done <= 0)
+                    return;
+
+                lock (this)
+                {
+                    BytesReceived += done;
+                    if (BaudRate != 0)
+                        _LineBusyUntil = Math.Max(_LineBusyUntil, _LineClock.Elapsed.TotalSeconds) + done * 10.0 / BaudRate;
+                }
+
+                for (int i = 0; i < done; i++)
+                {
+                    byte b = chunk[i];
+                    if (b == 0xc0)
+                    {
+                        if (inFrame && frame.Count > 0)
+                            HandleFrame(frame.ToArray());
+                        frame.Clear();
+                        inFrame = true;
+                        escaped = false;
+                    }
+                    else if (!inFrame)
+                        continue;
+                    else if (escaped)
+                    {
+                        frame.Add(b == 0xdc ? (byte)0xc0 : (byte)0xdb);
+                        escaped = false;
+                    }
+                    else if (b == 0xdb)
+                        escaped = true;
+                    else
+                        frame.Add(b);
+                }
+            }
+        }
+
+        static byte ComputeChecksum(byte[] data, int offset, int length)
+        {
+            byte result = 0xef;
+            for (int i = 0; i < length; i++)
+                result ^= data[offset + i];
+            return result;
+        }
+
+        void HandleFrame(byte[] frame)
+        {
+            if (frame.Length < 8 || frame[0] != 0)
+                return;
+
+            Command op = (Command)frame[1];
+            int length = BitConverter.ToUInt16(frame, 2);
+            int chk = BitConverter.ToInt32(frame, 4);
+            if (frame.Length != 8 + length)
+            {
+                SendReply(op, false);
+                return;
+            }
+
+            bool ok = true;
+            switch (op)
+            {
+                case Command.ESP_SYNC:
+                    //The ROM answers a sync request with 8 replies. The client reads the remaining 7 as ESP_NO_COMMAND.
+                    for (int i = 0; i < 7; i++)
+                        SendReply(op, true);
+                    break;
+                case Command.ESP_FLASH_BEGIN:
+                case Command.ESP_FLASH_DEFL_BEGIN:
+                    _WriteBlockSize = BitConverter.ToInt32(frame, 16);
+                    _WriteAddress = BitConverter.ToInt32(frame, 20);
+                    _CompressedData = new MemoryStream();
+                    break;
+                case Command.ESP_FLASH_DATA:
+                case Command.ESP_FLASH_DEFL_DATA:
+                    {
+                        int size = BitConverter.ToInt32(frame, 8), seq = BitConverter.ToInt32(frame, 12);
+                        ok = size == length - 16 && ComputeChecksum(frame, 24, size) == (byte)chk;
+                        if (!ok)
+                            break;
+                        if (op == Command.ESP_FLASH_DATA)
+                            Buffer.BlockCopy(frame, 24, FLASH, _WriteAddress + seq * _WriteBlockSize, size);
+                        else
+                            _CompressedData.Write(frame, 24, size);
+                    }
+                    break;
+                case Command.ESP_FLASH_DEFL_END:
+                    {
+                        //Skip the 2-byte zlib header. The Adler-32 trailer is ignored by DeflateStream.
+                        _CompressedData.Position = 2;
+                        using (var ds = new DeflateStream(_CompressedData, CompressionMode.Decompress))
+                        {
+                            int offset = _WriteAddress;
+                            for (int done; (done = ds.Read(FLASH, offset, FLASH.Length - offset)) > 0;)
+                                offset += done;
+                        }
+                    }
+                    break;
+                case Command.ESP_FLASH_END:
+                    break;
+                case Command.ESP_CHANGE_BAUDRATE:
+                    SendReply(op, true);
+                    lock (this)
+                        BaudRate = BitConverter.ToInt32(frame, 8);
+                    return;
+                default:
+                    ok = false;
+                    break;
+            }
+
+            SendReply(op, ok);
+        }
+
+        void SendReply(Command op, bool ok)
+        {
+            double waitUntil;
+            lock (this)
+                waitUntil = _LineBusyUntil;
+
+            double delay = waitUntil - _LineClock.Elapsed.TotalSeconds;
+            if (delay > 0)
+                Thread.Sleep((int)Math.Ceiling(delay * 1000));
+
+            int statusSize = IsESP32 ? 4 : 2;
+            byte[] reply = new byte[10 + statusSize];
+            reply[0] = 0xc0;
+            reply[1] = 1;
+            reply[2] = (byte)op;
+            reply[3] = (byte)statusSize;
+            reply[9] = ok ? (byte)0 : (byte)1;
+            reply[10] = ok ? (byte)0 : (byte)7;
+            reply[reply.Length - 1] = 0xc0;
+            _Terminal.Write(reply);
+        }
+
+        public void Dispose() => _Terminal.Dispose();
+    }
+}
@@ -349,6 +349,54 @@ namespace ESP8266DebugPackage
             }
         }
 
+        static void RunSteps(ILoadProgressReporter reporter, ISimpleGDBSession session, List<CustomStartStep> steps, ref int done, ref int total)
+        {
+            foreach (var s in steps)
+            {
+                SimpleGDBCommandResult r = default(SimpleGDBCommandResult);
+
+                foreach (var scmd in s.Commands)
+                {
+                    r = session.RunGDBCommand(scmd);
+                }
+
+                bool failed = false;
+                if (s.ResultVariable != null)
+                {
+                    string val = session.EvaluateExpression(s.ResultVariable);
+                    if (val != "0")
+                        failed = true;
+                }
+                if (s.CheckResult && !failed)
+                    failed = r.MainStatus != "^done";
+
+                if (failed)
+                {
+                    string msg = s.DescribeFailure?.Invoke(session) ?? s.ErrorMessage ?? "Custom FLASH programming step failed";
+                    if (s.CanRetry)
+                        throw new RetriableException(msg);
+                    else
+                        throw new Exception(msg);
+                }
+
+                var followupSteps = s.GetFollowupSteps?.Invoke(session);
+                if (followupSteps != null)
+                {
+                    //The weight of a step with followup steps is only an estimate. Replace it with the actual weights.
+                    total -= s.ProgressWeight;
+                    foreach (var f in followupSteps)
+                        total += f.ProgressWeight;
+
+                    RunSteps(reporter, session, followupSteps, ref done, ref total);
+                }
+                else
+                {
+                    done += s.ProgressWeight;
+                    reporter.ReportTaskProgress(done, total);
+                }
+            }
+        }
+
         public static bool RunSequence(ILoadProgressReporter reporter, IDebugStartService service, ISimpleGDBSession session, CustomStartupSequence sequence)
         {
             var espCmds = sequence.Steps;
@@ -356,45 +404,15 @@ namespace ESP8266DebugPackage
             {
                 DateTime startTime = DateTime.Now;
 
-                int total = 0, done = 0;
-                foreach (var s in espCmds)
-                    total += s.ProgressWeight;
-
                 for (int retry = 0; ; retry++)
                 {
                     try
                     {
+                        int total = 0, done = 0;
                         foreach (var s in espCmds)
-                        {
-                            SimpleGDBCommandResult r = default(SimpleGDBCommandResult);
+                            total += s.ProgressWeight;
 
-                            foreach (var scmd in s.Commands)
-                            {
-                                r = session.RunGDBCommand(scmd);
-                            }
-
-                            bool failed = false;
-                            if (s.ResultVariable != null)
-                            {
-                                string val = session.EvaluateExpression(s.ResultVariable);
-                                if (val != "0")
-                                    failed = true;
-                            }
-                            if (s.CheckResult && !failed)
-                                failed = r.MainStatus != "^done";
-
-                            if (failed)
-                            {
-                                string msg = s.ErrorMessage ?? "Custom FLASH programming step failed";
-                                if (s.CanRetry)
-                                    throw new RetriableException(msg);
-                                else
-                                    throw new Exception(msg);
-                            }
-
-                            done += s.ProgressWeight;
-                            reporter.ReportTaskProgress(done, total);
-                        }
+                        RunSteps(reporter, session, espCmds, ref done, ref total);
                         break;
                     }
                     catch (RetriableException)
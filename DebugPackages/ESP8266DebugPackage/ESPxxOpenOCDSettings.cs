@@ -62,6 +62,9 @@ namespace ESP8266DebugPackage
 
         public int ProgramSectorSize = 4096;
         public int EraseSectorSize = 4096;
+
+        public bool EraseEntireChip;
+        public bool VerifyAfterProgramming;
     }
 
     public enum ResetMode
@@ -364,6 +367,32 @@ namespace ESP8266DebugPackage
             }
         }
 
+        public bool EraseEntireChip
+        {
+            get => !IsESP32 && ESP8266Settings.EraseEntireChip;
+            set
+            {
+                if (!IsESP32)
+                {
+                    ESP8266Settings.EraseEntireChip = value;
+                    OnPropertyChanged(nameof(EraseEntireChip));
+                }
+            }
+        }
+
+        public bool VerifyAfterProgramming
+        {
+            get => !IsESP32 && ESP8266Settings.VerifyAfterProgramming;
+            set
+            {
+                if (!IsESP32)
+                {
+                    ESP8266Settings.VerifyAfterProgramming = value;
+                    OnPropertyChanged(nameof(VerifyAfterProgramming));
+                }
+            }
+        }
+
         public bool ShowRTOSThreads
         {
             get
@@ -0,0 +1,563 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Text;
+
+namespace ESP8266DebugPackage
+{
+    //Produces zlib streams accepted by the FLASH_DEFL_xxx commands of the ESP32 ROM bootloader and the esptool stub.
+    //The deflate encoder is implemented here instead of using System.IO.Compression.DeflateStream, as the .NET 2.0/3.5 version
+    //of DeflateStream only emits static Huffman blocks and often makes firmware images larger than the original.
+    public static class FLASHDataCompressor
+    {
+        const uint AdlerModulo = 65521;
+
+        //Maximum number of bytes that can be summed up before the Adler-32 accumulators need to be reduced modulo 65521.
+        const int AdlerBlockSize = 5552;
+
+        public static uint Adler32(byte[] data, int offset, int size)
+        {
+            uint a = 1, b = 0;
+            while (size > 0)
+            {
+                int todo = Math.Min(size, AdlerBlockSize);
+                for (int i = 0; i < todo; i++)
+                {
+                    a += data[offset + i];
+                    b += a;
+                }
+
+                a %= AdlerModulo;
+                b %= AdlerModulo;
+                offset += todo;
+                size -= todo;
+            }
+
+            return (b << 16) | a;
+        }
+
+        public static byte[] Compress(byte[] data, int offset, int size)
+        {
+            using (var ms = new MemoryStream())
+            {
+                //CMF = deflate with 32KB window, FLG = maximum compression level, no preset dictionary.
+                ms.WriteByte(0x78);
+                ms.WriteByte(0xDA);
+
+                new DeflateEncoder(data, offset, size, ms).Run();
+
+                uint adler = Adler32(data, offset, size);
+                ms.WriteByte((byte)(adler >> 24));
+                ms.WriteByte((byte)(adler >> 16));
+                ms.WriteByte((byte)(adler >> 8));
+                ms.WriteByte((byte)adler);
+                return ms.ToArray();
+            }
+        }
+
+        public static byte[] Compress(byte[] data) => Compress(data, 0, data.Length);
+
+        //A straightforward RFC 1951 encoder: LZ77 with hash chains and one-step lazy matching, followed by
+        //a choice between stored, fixed and dynamic Huffman encoding for each block, whichever is the smallest.
+        class DeflateEncoder
+        {
+            const int WindowSize = 32768;
+            const int WindowMask = WindowSize - 1;
+            const int HashBits = 15;
+            const int HashSize = 1 << HashBits;
+            const int MinMatch = 3;
+            const int MaxMatch = 258;
+            const int MaxChainLength = 4096;
+            const int NiceMatchLength = MaxMatch;
+
+            //Matches of 3 bytes at larger distances usually take more bits than 3 literals.
+            const int MaxShortMatchDistance = 4096;
+
+            const int MaxBlockTokens = 16384;
+            const int MaxStoredBlockSize = 65535;
+
+            const int EndOfBlock = 256;
+            const int LiteralLengthCodes = 286;
+            const int DistanceCodes = 30;
+            const int CodeLengthCodes = 19;
+            const int MaxCodeLength = 15;
+            const int MaxCodeLengthCodeLength = 7;
+
+            static readonly int[] LengthBase = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+            static readonly int[] LengthExtraBits = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+            static readonly int[] DistanceBase = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+            static readonly int[] DistanceExtraBits = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+            static readonly int[] CodeLengthOrder = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+            static readonly byte[] LengthToCode = new byte[MaxMatch + 1];
+            static readonly byte[] FixedLiteralLengths = new byte[288];
+            static readonly byte[] FixedDistanceLengths = new byte[DistanceCodes];
+
+            static DeflateEncoder()
+            {
+                for (int code = 0; code < LengthBase.Length; code++)
+                    for (int len = LengthBase[code]; len < LengthBase[code] + (1 << LengthExtraBits[code]) && len <= MaxMatch; len++)
+                        LengthToCode[len] = (byte)code;
+
+                for (int i = 0; i < FixedLiteralLengths.Length; i++)
+                    FixedLiteralLengths[i] = (byte)(i < 144 ? 8 : (i < 256 ? 9 : (i < 280 ? 7 : 8)));
+                for (int i = 0; i < FixedDistanceLengths.Length; i++)
+                    FixedDistanceLengths[i] = 5;
+            }
+
+            static int GetDistanceCode(int distance)
+            {
+                int code = DistanceBase.Length - 1;
+                while (DistanceBase[code] > distance)
+                    code--;
+                return code;
+            }
+
+            readonly byte[] _Data;
+            readonly int _End;
+            readonly Stream _Output;
+
+            readonly int[] _HashHeads = new int[HashSize];
+            readonly int[] _PreviousPositions = new int[WindowSize];
+
+            //Literals are stored with a zero length and the byte value in the distance field.
+            readonly int[] _TokenLengths = new int[MaxBlockTokens];
+            readonly int[] _TokenDistances = new int[MaxBlockTokens];
+            int _TokenCount;
+            int _BlockStart;
+
+            ulong _BitBuffer;
+            int _BitCount;
+
+            public DeflateEncoder(byte[] data, int offset, int size, Stream output)
+            {
+                _Data = data;
+                _BlockStart = offset;
+                _End = offset + size;
+                _Output = output;
+                for (int i = 0; i < _HashHeads.Length; i++)
+                    _HashHeads[i] = -1;
+            }
+
+            int Hash(int pos) => ((_Data[pos] << 10) ^ (_Data[pos + 1] << 5) ^ _Data[pos + 2]) & (HashSize - 1);
+
+            void InsertPosition(int pos)
+            {
+                if (pos + MinMatch > _End)
+                    return;
+
+                int hash = Hash(pos);
+                _PreviousPositions[pos & WindowMask] = _HashHeads[hash];
+                _HashHeads[hash] = pos;
+            }
+
+            //Returns the length of the longest match for the specified position and inserts the position into the hash chains.
+            int FindMatchAndInsert(int pos, out int distance)
+            {
+                distance = 0;
+                if (pos + MinMatch > _End)
+                    return 0;
+
+                int maxLength = Math.Min(MaxMatch, _End - pos);
+                int bestLength = MinMatch - 1;
+                int candidate = _HashHeads[Hash(pos)];
+
+                for (int chain = MaxChainLength; candidate >= 0 && candidate > pos - WindowSize && chain > 0; chain--)
+                {
+                    if (_Data[candidate + bestLength] == _Data[pos + bestLength] && _Data[candidate] == _Data[pos])
+                    {
+                        int len = 1;
+                        while (len < maxLength && _Data[candidate + len] == _Data[pos + len])
+                            len++;
+
+                        if (len > bestLength && (len > MinMatch || pos - candidate <= MaxShortMatchDistance))
+                        {
+                            bestLength = len;
+                            distance = pos - candidate;
+                            if (len >= maxLength)
+                                break;
+                        }
+                    }
+
+                    int next = _PreviousPositions[candidate & WindowMask];
+                    if (next >= candidate)
+                        break;  //The ring entry has been overwritten by a newer position
+                    candidate = next;
+                }
+
+                InsertPosition(pos);
+                return distance == 0 ? 0 : bestLength;
+            }
+
+            void AddToken(int length, int distance, int nextPosition)
+            {
+                _TokenLengths[_TokenCount] = length;
+                _TokenDistances[_TokenCount] = distance;
+                if (++_TokenCount == MaxBlockTokens)
+                    FlushBlock(nextPosition, false);
+            }
+
+            public void Run()
+            {
+                int pos = _BlockStart;
+                bool haveNextMatch = false;
+                int nextLength = 0, nextDistance = 0;
+
+                while (pos < _End)
+                {
+                    int length, distance;
+                    if (haveNextMatch)
+                    {
+                        length = nextLength;
+                        distance = nextDistance;
+                        haveNextMatch = false;
+                    }
+                    else
+                        length = FindMatchAndInsert(pos, out distance);
+
+                    if (length >= MinMatch && length < NiceMatchLength && pos + 1 < _End)
+                    {
+                        //Lazy matching: if the next position yields a longer match, emit the current byte as a literal.
+                        nextLength = FindMatchAndInsert(pos + 1, out nextDistance);
+                        haveNextMatch = true;
+                        if (nextLength > length)
+                        {
+                            AddToken(0, _Data[pos], pos + 1);
+                            pos++;
+                            continue;
+                        }
+                    }
+
+                    if (length >= MinMatch)
+                    {
+                        for (int i = haveNextMatch ? 2 : 1; i < length; i++)
+                            InsertPosition(pos + i);
+
+                        haveNextMatch = false;
+                        AddToken(length, distance, pos + length);
+                        pos += length;
+                    }
+                    else
+                    {
+                        AddToken(0, _Data[pos], pos + 1);
+                        pos++;
+                    }
+                }
+
+                FlushBlock(_End, true);
+                if (_BitCount > 0)
+                    WriteBits(0, 8 - _BitCount);
+            }
+
+            void WriteBits(int value, int count)
+            {
+                _BitBuffer |= (ulong)(uint)value << _BitCount;
+                _BitCount += count;
+                while (_BitCount >= 8)
+                {
+                    _Output.WriteByte((byte)_BitBuffer);
+                    _BitBuffer >>= 8;
+                    _BitCount -= 8;
+                }
+            }
+
+            #region Huffman code construction
+            //Computes code lengths for the given symbol frequencies. If the resulting tree is deeper than maxLength,
+            //the frequencies are halved until it fits. At least 2 codes are always produced, as inflaters reject incomplete codes.
+            static byte[] BuildCodeLengths(int[] frequencies, int maxLength)
+            {
+                int[] freq = (int[])frequencies.Clone();
+                int used = 0;
+                for (int i = 0; i < freq.Length; i++)
+                    if (freq[i] != 0)
+                        used++;
+                for (int i = 0; used < 2; i++)
+                    if (freq[i] == 0)
+                    {
+                        freq[i] = 1;
+                        used++;
+                    }
+
+                for (;;)
+                {
+                    byte[] lengths = TryBuildCodeLengths(freq, maxLength);
+                    if (lengths != null)
+                        return lengths;
+
+                    for (int i = 0; i < freq.Length; i++)
+                        if (freq[i] != 0)
+                            freq[i] = (freq[i] + 1) / 2;
+                }
+            }
+
+            static byte[] TryBuildCodeLengths(int[] freq, int maxLength)
+            {
+                List<int> leaves = new List<int>();
+                for (int i = 0; i < freq.Length; i++)
+                    if (freq[i] != 0)
+                        leaves.Add(i);
+                leaves.Sort((a, b) => freq[a] != freq[b] ? freq[a].CompareTo(freq[b]) : a.CompareTo(b));
+
+                //Two-queue construction: leaves are consumed in the order of increasing frequency and the internal nodes are created in the same order.
+                int leafCount = leaves.Count;
+                long[] nodeWeights = new long[leafCount - 1];
+                int[] parents = new int[2 * leafCount - 1];     //[0..leafCount) are leaves, the rest are internal nodes
+                int nextLeaf = 0, nextNode = 0;
+
+                for (int node = 0; node < leafCount - 1; node++)
+                {
+                    int[] children = new int[2];
+                    long weight = 0;
+                    for (int j = 0; j < 2; j++)
+                    {
+                        if (nextLeaf < leafCount && (nextNode >= node || freq[leaves[nextLeaf]] <= nodeWeights[nextNode]))
+                        {
+                            weight += freq[leaves[nextLeaf]];
+                            children[j] = nextLeaf++;
+                        }
+                        else
+                        {
+                            weight += nodeWeights[nextNode];
+                            children[j] = leafCount + nextNode++;
+                        }
+                    }
+
+                    nodeWeights[node] = weight;
+                    parents[children[0]] = parents[children[1]] = leafCount + node;
+                }
+
+                int[] depths = new int[2 * leafCount - 1];
+                for (int i = 2 * leafCount - 3; i >= 0; i--)
+                    depths[i] = depths[parents[i]] + 1;
+
+                byte[] lengths = new byte[freq.Length];
+                for (int i = 0; i < leafCount; i++)
+                {
+                    if (depths[i] > maxLength)
+                        return null;
+                    lengths[leaves[i]] = (byte)depths[i];
+                }
+                return lengths;
+            }
+
+            //Returns canonical codes (RFC 1951, 3.2.2) with the bit order reversed, as deflate emits Huffman codes starting from the MSB.
+            static int[] BuildCodes(byte[] lengths)
+            {
+                int[] lengthCounts = new int[MaxCodeLength + 1];
+                foreach (var len in lengths)
+                    lengthCounts[len]++;
+                lengthCounts[0] = 0;
+
+                int[] nextCode = new int[MaxCodeLength + 1];
+                for (int len = 1, code = 0; len <= MaxCodeLength; len++)
+                {
+                    code = (code + lengthCounts[len - 1]) << 1;
+                    nextCode[len] = code;
+                }
+
+                int[] codes = new int[lengths.Length];
+                for (int i = 0; i < lengths.Length; i++)
+                {
+                    int len = lengths[i];
+                    if (len == 0)
+                        continue;
+
+                    int code = nextCode[len]++, reversed = 0;
+                    for (int j = 0; j < len; j++)
+                        reversed |= ((code >> j) & 1) << (len - 1 - j);
+                    codes[i] = reversed;
+                }
+                return codes;
+            }
+            #endregion
+
+            #region Block encoding
+            void CountFrequencies(int[] literalFrequencies, int[] distanceFrequencies)
+            {
+                for (int i = 0; i < _TokenCount; i++)
+                {
+                    if (_TokenLengths[i] == 0)
+                        literalFrequencies[_TokenDistances[i]]++;
+                    else
+                    {
+                        literalFrequencies[257 + LengthToCode[_TokenLengths[i]]]++;
+                        distanceFrequencies[GetDistanceCode(_TokenDistances[i])]++;
+                    }
+                }
+                literalFrequencies[EndOfBlock]++;
+            }
+
+            static long GetEncodedSize(int[] literalFrequencies, int[] distanceFrequencies, byte[] literalLengths, byte[] distanceLengths)
+            {
+                long bits = 0;
+                for (int i = 0; i < LiteralLengthCodes; i++)
+                {
+                    bits += (long)literalFrequencies[i] * literalLengths[i];
+                    if (i > EndOfBlock)
+                        bits += (long)literalFrequencies[i] * LengthExtraBits[i - 257];
+                }
+                for (int i = 0; i < DistanceCodes; i++)
+                    bits += (long)distanceFrequencies[i] * (distanceLengths[i] + DistanceExtraBits[i]);
+                return bits;
+            }
+
+            //Run-length encodes the concatenated code lengths using the symbols 16 (repeat previous), 17 and 18 (repeat zero).
+            //Each entry contains the symbol in the lower 8 bits and the value of its extra bits in the upper bits.
+            static List<int> EncodeCodeLengths(byte[] lengths, int count)
+            {
+                List<int> result = new List<int>();
+                for (int i = 0; i < count;)
+                {
+                    int value = lengths[i], run = 1;
+                    while (i + run < count && lengths[i + run] == value)
+                        run++;
+
+                    i += run;
+                    if (value == 0)
+                    {
+                        while (run >= 11)
+                        {
+                            int todo = Math.Min(run, 138);
+                            result.Add(18 | ((todo - 11) << 8));
+                            run -= todo;
+                        }
+                        if (run >= 3)
+                        {
+                            result.Add(17 | ((run - 3) << 8));
+                            run = 0;
+                        }
+                    }
+                    else
+                    {
+                        result.Add(value);
+                        run--;
+                        while (run >= 3)
+                        {
+                            int todo = Math.Min(run, 6);
+                            result.Add(16 | ((todo - 3) << 8));
+                            run -= todo;
+                        }
+                    }
+
+                    for (; run > 0; run--)
+                        result.Add(value);
+                }
+                return result;
+            }
+
+            static int GetCodeLengthExtraBits(int symbol) => symbol == 16 ? 2 : (symbol == 17 ? 3 : (symbol == 18 ? 7 : 0));
+
+            void FlushBlock(int blockEnd, bool final)
+            {
+                int[] literalFrequencies = new int[LiteralLengthCodes], distanceFrequencies = new int[DistanceCodes];
+                CountFrequencies(literalFrequencies, distanceFrequencies);
+
+                byte[] literalLengths = BuildCodeLengths(literalFrequencies, MaxCodeLength);
+                byte[] distanceLengths = BuildCodeLengths(distanceFrequencies, MaxCodeLength);
+
+                int literalCount = LiteralLengthCodes, distanceCount = DistanceCodes;
+                while (literalCount > 257 && literalLengths[literalCount - 1] == 0)
+                    literalCount--;
+                while (distanceCount > 1 && distanceLengths[distanceCount - 1] == 0)
+                    distanceCount--;
+
+                byte[] allLengths = new byte[literalCount + distanceCount];
+                Array.Copy(literalLengths, allLengths, literalCount);
+                Array.Copy(distanceLengths, 0, allLengths, literalCount, distanceCount);
+                var encodedLengths = EncodeCodeLengths(allLengths, allLengths.Length);
+
+                int[] codeLengthFrequencies = new int[CodeLengthCodes];
+                foreach (var entry in encodedLengths)
+                    codeLengthFrequencies[entry & 0xFF]++;
+                byte[] codeLengthLengths = BuildCodeLengths(codeLengthFrequencies, MaxCodeLengthCodeLength);
+
+                int codeLengthCount = CodeLengthCodes;
+                while (codeLengthCount > 4 && codeLengthLengths[CodeLengthOrder[codeLengthCount - 1]] == 0)
+                    codeLengthCount--;
+
+                long dynamicSize = 3 + 5 + 5 + 4 + 3 * codeLengthCount + GetEncodedSize(literalFrequencies, distanceFrequencies, literalLengths, distanceLengths);
+                foreach (var entry in encodedLengths)
+                    dynamicSize += codeLengthLengths[entry & 0xFF] + GetCodeLengthExtraBits(entry & 0xFF);
+
+                long fixedSize = 3 + GetEncodedSize(literalFrequencies, distanceFrequencies, FixedLiteralLengths, FixedDistanceLengths);
+
+                int rawSize = blockEnd - _BlockStart;
+                int storedBlockCount = Math.Max(1, (rawSize + MaxStoredBlockSize - 1) / MaxStoredBlockSize);
+                long storedSize = 7 + (long)storedBlockCount * (3 + 32) + 8L * rawSize;
+
+                if (storedSize <= fixedSize && storedSize <= dynamicSize)
+                    WriteStoredBlocks(blockEnd, final);
+                else if (fixedSize <= dynamicSize)
+                {
+                    WriteBits(final ? 3 : 2, 3);
+                    WriteTokens(FixedLiteralLengths, FixedDistanceLengths);
+                }
+                else
+                {
+                    WriteBits(final ? 5 : 4, 3);
+                    WriteBits(literalCount - 257, 5);
+                    WriteBits(distanceCount - 1, 5);
+                    WriteBits(codeLengthCount - 4, 4);
+                    for (int i = 0; i < codeLengthCount; i++)
+                        WriteBits(codeLengthLengths[CodeLengthOrder[i]], 3);
+
+                    int[] codeLengthCodes = BuildCodes(codeLengthLengths);
+                    foreach (var entry in encodedLengths)
+                    {
+                        int symbol = entry & 0xFF;
+                        WriteBits(codeLengthCodes[symbol], codeLengthLengths[symbol]);
+                        WriteBits(entry >> 8, GetCodeLengthExtraBits(symbol));
+                    }
+
+                    WriteTokens(literalLengths, distanceLengths);
+                }
+
+                _TokenCount = 0;
+                _BlockStart = blockEnd;
+            }
+
+            void WriteTokens(byte[] literalLengths, byte[] distanceLengths)
+            {
+                int[] literalCodes = BuildCodes(literalLengths), distanceCodes = BuildCodes(distanceLengths);
+                for (int i = 0; i < _TokenCount; i++)
+                {
+                    int length = _TokenLengths[i], distance = _TokenDistances[i];
+                    if (length == 0)
+                    {
+                        WriteBits(literalCodes[distance], literalLengths[distance]);
+                        continue;
+                    }
+
+                    int lengthCode = LengthToCode[length];
+                    WriteBits(literalCodes[257 + lengthCode], literalLengths[257 + lengthCode]);
+                    WriteBits(length - LengthBase[lengthCode], LengthExtraBits[lengthCode]);
+
+                    int distanceCode = GetDistanceCode(distance);
+                    WriteBits(distanceCodes[distanceCode], distanceLengths[distanceCode]);
+                    WriteBits(distance - DistanceBase[distanceCode], DistanceExtraBits[distanceCode]);
+                }
+
+                WriteBits(literalCodes[EndOfBlock], literalLengths[EndOfBlock]);
+            }
+
+            void WriteStoredBlocks(int blockEnd, bool final)
+            {
+                int pos = _BlockStart;
+                do
+                {
+                    int todo = Math.Min(blockEnd - pos, MaxStoredBlockSize);
+                    bool last = final && pos + todo == blockEnd;
+                    WriteBits(last ? 1 : 0, 3);
+                    if (_BitCount > 0)
+                        WriteBits(0, 8 - _BitCount);
+
+                    WriteBits(todo, 16);
+                    WriteBits(~todo & 0xFFFF, 16);
+                    _Output.Write(_Data, pos, todo);
+                    pos += todo;
+                } while (pos < blockEnd);
+            }
+            #endregion
+        }
+    }
+}
@@ -1,35 +1,28 @@
-﻿using Microsoft.Win32.SafeHandles;
-using System;
+﻿using System;
 using System.Collections.Generic;
-using System.Collections.Specialized;
-using System.ComponentModel;
 using System.IO;
-using System.Runtime.InteropServices;
-using System.Text;
 using System.Threading;
 
 namespace ESP8266DebugPackage
 {
-    public class SerialPortStream : Stream, IDisposable
+    //Platform-specific part of the serial port implementation
+    interface ISerialPortBackend : IDisposable
     {
-        #region PInvoke definitions
-        [DllImport("kernel32.dll", CharSet = CharSet.Auto, SetLastError = true)]
-        public static extern SafeFileHandle CreateFile(
-             [MarshalAs(UnmanagedType.LPTStr)] string filename,
-             [MarshalAs(UnmanagedType.U4)] FileAccess access,
-             [MarshalAs(UnmanagedType.U4)] FileShare share,
-             IntPtr securityAttributes, // optional SECURITY_ATTRIBUTES struct or IntPtr.Zero
-             [MarshalAs(UnmanagedType.U4)] FileMode creationDisposition,
-             [MarshalAs(UnmanagedType.U4)] FileAttributes flagsAndAttributes,
-             IntPtr templateFile);
-
-        [DllImport("kernel32.dll", SetLastError = true)]
-        [return: MarshalAs(UnmanagedType.Bool)]
-        static extern bool CloseHandle(IntPtr hObject);
-
-        [DllImport("kernel32.dll")]
-        static extern bool EscapeCommFunction(SafeFileHandle hFile, CommFunction dwFunc);
+        void Configure(int baudRate, System.IO.Ports.Handshake flowControl);
+        void SetWriteTimeouts(uint writeTotalTimeoutMultiplier, uint writeTotalTimeoutConstant);
+
+        //Returns the data that is already available, or waits for a short polling interval and returns 0 if nothing arrives
+        int Read(byte[] buffer, int offset, int count);
+        void Write(IList<ArraySegment<byte>> buffers);
+
+        void Purge();
+        void EscapeFunction(SerialPortStream.CommFunction func);
+    }
 
+    //Received data is collected by a background thread into a ring buffer, so reading single bytes (e.g. when decoding SLIP frames)
+    //does not result in a system call per byte. Read timeouts follow the COMMTIMEOUTS semantics and are emulated on top of the buffer.
+    public class SerialPortStream : Stream, IDisposable
+    {
         public enum CommFunction : uint
         {
             CLRBREAK = 9,
@@ -42,337 +35,239 @@ namespace ESP8266DebugPackage
             SETXON = 2
         }
 
+        const int ReceiveBufferSize = 65536;
 
-        [DllImport("kernel32.dll", SetLastError = true)]
-        static extern bool GetOverlappedResult(SafeHandle hFile,
-           [In] IntPtr lpOverlapped,
-           out int lpNumberOfBytesTransferred, bool bWait);
-
-        [DllImport("kernel32.dll", SetLastError = true)]
-        static extern bool ReadFile(SafeHandle hFile, IntPtr buf,
-           int nNumberOfBytesToRead, out int lpNumberOfBytesRead, IntPtr lpOverlapped);
-
-        [DllImport("kernel32.dll", SetLastError = true)]
-        static extern bool WriteFile(SafeHandle hFile, IntPtr buf,
-           int nNumberOfBytesToRead, out int lpNumberOfBytesRead, IntPtr lpOverlapped);
-
-        [StructLayout(LayoutKind.Sequential)]
-        struct COMMTIMEOUTS
-        {
-            public UInt32 ReadIntervalTimeout;
-            public UInt32 ReadTotalTimeoutMultiplier;
-            public UInt32 ReadTotalTimeoutConstant;
-            public UInt32 WriteTotalTimeoutMultiplier;
-            public UInt32 WriteTotalTimeoutConstant;
-        }
-
-        [DllImport("kernel32.dll", SetLastError = true)]
-        static extern bool SetCommTimeouts(SafeHandle hFile, ref COMMTIMEOUTS lpCommTimeouts);
-
-        SafeFileHandle _Handle;
-
-        public enum Parity : byte
-        {
-            None = 0,
-            Odd = 1,
-            Even = 2,
-            Mark = 3,
-            Space = 4,
-        }
-
-        public enum StopBits : byte
-        {
-            One = 0,
-            OnePointFive = 1,
-            Two = 2
-        }
-
-        public enum RtsControl : int
-        {
-            /// <summary>
-            /// Disables the RTS line when the device is opened and leaves it disabled.
-            /// </summary>
-            Disable = 0,
-
-            /// <summary>
-            /// Enables the RTS line when the device is opened and leaves it on.
-            /// </summary>
-            Enable = 1,
-
-            /// <summary>
-            /// Enables RTS handshaking. The driver raises the RTS line when the "type-ahead" (input) buffer
-            /// is less than one-half full and lowers the RTS line when the buffer is more than
-            /// three-quarters full. If handshaking is enabled, it is an error for the application to
-            /// adjust the line by using the EscapeCommFunction function.
-            /// </summary>
-            Handshake = 2,
-
-            /// <summary>
-            /// Specifies that the RTS line will be high if bytes are available for transmission. After
-            /// all buffered bytes have been sent, the RTS line will be low.
-            /// </summary>
-            Toggle = 3
-        }
+        readonly ISerialPortBackend _Backend;
+        readonly System.IO.Ports.Handshake _FlowControl;
+        readonly Thread _ReaderThread;
 
-        public enum DtrControl : int
-        {
-            /// <summary>
-            /// Disables the DTR line when the device is opened and leaves it disabled.
-            /// </summary>
-            Disable = 0,
-
-            /// <summary>
-            /// Enables the DTR line when the device is opened and leaves it on.
-            /// </summary>
-            Enable = 1,
-
-            /// <summary>
-            /// Enables DTR handshaking. If handshaking is enabled, it is an error for the application to adjust the line by
-            /// using the EscapeCommFunction function.
-            /// </summary>
-            Handshake = 2
-        }
+        //_BackendReadLock is held by the reader thread while it reads from the port and stores the data, so Purge() can wait for that to complete
+        readonly object _ReceiveLock = new object(), _WriteLock = new object(), _BackendReadLock = new object();
+        readonly byte[] _ReceiveBuffer = new byte[ReceiveBufferSize];
+        int _ReceiveStart, _ReceiveCount;
+        bool _PurgePending;
+        Exception _ReaderException;
+        volatile bool _Closed;
 
+        uint _ReadIntervalTimeout = 1, _ReadTotalTimeoutMultiplier, _ReadTotalTimeoutConstant;
 
-        [StructLayout(LayoutKind.Sequential)]
-        internal struct DCB
+        public SerialPortStream(string portName, int baudRate, System.IO.Ports.Handshake flowControl)
         {
-            internal uint DCBLength;
-            internal uint BaudRate;
-            private BitVector32 Flags;
-
-            private ushort wReserved;        // not currently used
-            internal ushort XonLim;           // transmit XON threshold
-            internal ushort XoffLim;          // transmit XOFF threshold             
-
-            internal byte ByteSize;
-            internal Parity Parity;
-            internal StopBits StopBits;
-
-            internal sbyte XonChar;          // Tx and Rx XON character
-            internal sbyte XoffChar;         // Tx and Rx XOFF character
-            internal sbyte ErrorChar;        // error replacement character
-            internal sbyte EofChar;          // end of input character
-            internal sbyte EvtChar;          // received event character
-            private ushort wReserved1;       // reserved; do not use     
-
-            private static readonly int fBinary;
-            private static readonly int fParity;
-            private static readonly int fOutxCtsFlow;
-            private static readonly int fOutxDsrFlow;
-            private static readonly BitVector32.Section fDtrControl;
-            private static readonly int fDsrSensitivity;
-            private static readonly int fTXContinueOnXoff;
-            private static readonly int fOutX;
-            private static readonly int fInX;
-            private static readonly int fErrorChar;
-            private static readonly int fNull;
-            private static readonly BitVector32.Section fRtsControl;
-            private static readonly int fAbortOnError;
-
-            static DCB()
+            if (Environment.OSVersion.Platform == PlatformID.Unix || Environment.OSVersion.Platform == PlatformID.MacOSX)
             {
-                // Create Boolean Mask
-                int previousMask;
-                fBinary = BitVector32.CreateMask();
-                fParity = BitVector32.CreateMask(fBinary);
-                fOutxCtsFlow = BitVector32.CreateMask(fParity);
-                fOutxDsrFlow = BitVector32.CreateMask(fOutxCtsFlow);
-                previousMask = BitVector32.CreateMask(fOutxDsrFlow);
-                previousMask = BitVector32.CreateMask(previousMask);
-                fDsrSensitivity = BitVector32.CreateMask(previousMask);
-                fTXContinueOnXoff = BitVector32.CreateMask(fDsrSensitivity);
-                fOutX = BitVector32.CreateMask(fTXContinueOnXoff);
-                fInX = BitVector32.CreateMask(fOutX);
-                fErrorChar = BitVector32.CreateMask(fInX);
-                fNull = BitVector32.CreateMask(fErrorChar);
-                previousMask = BitVector32.CreateMask(fNull);
-                previousMask = BitVector32.CreateMask(previousMask);
-                fAbortOnError = BitVector32.CreateMask(previousMask);
-
-                // Create section Mask
-                BitVector32.Section previousSection;
-                previousSection = BitVector32.CreateSection(1);
-                previousSection = BitVector32.CreateSection(1, previousSection);
-                previousSection = BitVector32.CreateSection(1, previousSection);
-                previousSection = BitVector32.CreateSection(1, previousSection);
-                fDtrControl = BitVector32.CreateSection(2, previousSection);
-                previousSection = BitVector32.CreateSection(1, fDtrControl);
-                previousSection = BitVector32.CreateSection(1, previousSection);
-                previousSection = BitVector32.CreateSection(1, previousSection);
-                previousSection = BitVector32.CreateSection(1, previousSection);
-                previousSection = BitVector32.CreateSection(1, previousSection);
-                previousSection = BitVector32.CreateSection(1, previousSection);
-                fRtsControl = BitVector32.CreateSection(3, previousSection);
-                previousSection = BitVector32.CreateSection(1, fRtsControl);
+                //The termios constants and structure layouts in TermiosSerialPortBackend are Linux-specific
+                if (!TermiosSerialPortBackend.IsSupportedPlatform)
+                    throw new PlatformNotSupportedException("Serial ports are only supported on Windows and Linux");
+                _Backend = new TermiosSerialPortBackend(portName);
             }
+            else
+                _Backend = new Win32SerialPortBackend(portName);
 
-            public bool Binary
+            _FlowControl = flowControl;
+            try
             {
-                get { return Flags[fBinary]; }
-                set { Flags[fBinary] = value; }
+                _Backend.Configure(baudRate, flowControl);
             }
-
-            public bool CheckParity
+            catch
             {
-                get { return Flags[fParity]; }
-                set { Flags[fParity] = value; }
+                _Backend.Dispose();
+                throw;
             }
 
-            public bool OutxCtsFlow
-            {
-                get { return Flags[fOutxCtsFlow]; }
-                set { Flags[fOutxCtsFlow] = value; }
-            }
+            _ReaderThread = new Thread(ReaderThreadBody) { IsBackground = true, Name = "Serial port reader (" + portName + ")" };
+            _ReaderThread.Start();
+        }
 
-            public bool OutxDsrFlow
+        public void SetTimeouts(UInt32 readIntervalTimeout, UInt32 readTotalTimeoutMultiplier, UInt32 readTotalTimeoutConstant, UInt32 writeTotalTimeoutMultiplier, UInt32 writeTotalTimeoutConstant)
+        {
+            lock (_ReceiveLock)
             {
-                get { return Flags[fOutxDsrFlow]; }
-                set { Flags[fOutxDsrFlow] = value; }
+                _ReadIntervalTimeout = readIntervalTimeout;
+                _ReadTotalTimeoutMultiplier = readTotalTimeoutMultiplier;
+                _ReadTotalTimeoutConstant = readTotalTimeoutConstant;
             }
 
-            public DtrControl DtrControl
-            {
-                get { return (DtrControl)Flags[fDtrControl]; }
-                set { Flags[fDtrControl] = (int)value; }
-            }
+            _Backend.SetWriteTimeouts(writeTotalTimeoutMultiplier, writeTotalTimeoutConstant);
+        }
 
-            public bool DsrSensitivity
-            {
-                get { return Flags[fDsrSensitivity]; }
-                set { Flags[fDsrSensitivity] = value; }
-            }
+        public void SetBaudRate(int baudRate) => _Backend.Configure(baudRate, _FlowControl);
 
-            public bool TxContinueOnXoff
+        public void Purge()
+        {
+            lock (_ReceiveLock)
             {
-                get { return Flags[fTXContinueOnXoff]; }
-                set { Flags[fTXContinueOnXoff] = value; }
+                _PurgePending = true;
+                Monitor.PulseAll(_ReceiveLock);
             }
 
-            public bool OutX
+            lock (_BackendReadLock)
             {
-                get { return Flags[fOutX]; }
-                set { Flags[fOutX] = value; }
+                _Backend.Purge();
+                lock (_ReceiveLock)
+                {
+                    _ReceiveStart = _ReceiveCount = 0;
+                    _PurgePending = false;
+                    Monitor.PulseAll(_ReceiveLock);
+                }
             }
+        }
 
-            public bool InX
+        void ReaderThreadBody()
+        {
+            byte[] chunk = new byte[ReceiveBufferSize / 4];
+            try
             {
-                get { return Flags[fInX]; }
-                set { Flags[fInX] = value; }
-            }
+                while (!_Closed)
+                {
+                    lock (_BackendReadLock)
+                    {
+                        int done = _Backend.Read(chunk, 0, chunk.Length);
+                        if (done <= 0)
+                            continue;
 
-            public bool ReplaceErrorChar
-            {
-                get { return Flags[fErrorChar]; }
-                set { Flags[fErrorChar] = value; }
+                        lock (_ReceiveLock)
+                        {
+                            //If the consumer falls behind, stop reading and let the driver buffer (or flow control) hold the data instead of dropping it
+                            while (!_Closed && !_PurgePending && (_ReceiveBuffer.Length - _ReceiveCount) < done)
+                                Monitor.Wait(_ReceiveLock, 100);
+
+                            //The data would be discarded by the pending Purge() call anyway
+                            if (_Closed || _PurgePending)
+                                continue;
+
+                            int tail = (_ReceiveStart + _ReceiveCount) % _ReceiveBuffer.Length;
+                            int firstPart = Math.Min(done, _ReceiveBuffer.Length - tail);
+                            Buffer.BlockCopy(chunk, 0, _ReceiveBuffer, tail, firstPart);
+                            Buffer.BlockCopy(chunk, firstPart, _ReceiveBuffer, 0, done - firstPart);
+                            _ReceiveCount += done;
+                            Monitor.PulseAll(_ReceiveLock);
+                        }
+                    }
+                }
             }
-
-            public bool Null
+            catch (Exception ex)
             {
-                get { return Flags[fNull]; }
-                set { Flags[fNull] = value; }
+                lock (_ReceiveLock)
+                {
+                    if (!_Closed)
+                        _ReaderException = ex;
+                    Monitor.PulseAll(_ReceiveLock);
+                }
             }
+        }
 
-            public RtsControl RtsControl
-            {
-                get { return (RtsControl)Flags[fRtsControl]; }
-                set { Flags[fRtsControl] = (int)value; }
-            }
+        //Must be called with _ReceiveLock held
+        int TakeReceivedData(byte[] buffer, int offset, int count)
+        {
+            int done = Math.Min(count, _ReceiveCount);
+            int firstPart = Math.Min(done, _ReceiveBuffer.Length - _ReceiveStart);
+            Buffer.BlockCopy(_ReceiveBuffer, _ReceiveStart, buffer, offset, firstPart);
+            Buffer.BlockCopy(_ReceiveBuffer, 0, buffer, offset + firstPart, done - firstPart);
+
+            _ReceiveStart = (_ReceiveStart + done) % _ReceiveBuffer.Length;
+            _ReceiveCount -= done;
+            if (_ReceiveCount == 0)
+                _ReceiveStart = 0;
+
+            Monitor.PulseAll(_ReceiveLock);
+            return done;
+        }
 
-            public bool AbortOnError
-            {
-                get { return Flags[fAbortOnError]; }
-                set { Flags[fAbortOnError] = value; }
-            }
+        //Waits for more data with _ReceiveLock held. A negative timeout means waiting indefinitely. Returns false on timeout.
+        bool WaitForData(int timeout)
+        {
+            if (_Closed)
+                throw new ObjectDisposedException(GetType().Name);
+            if (_ReaderException != null)
+                throw new IOException("Cannot read from serial port", _ReaderException);
+
+            if (timeout < 0)
+                return Monitor.Wait(_ReceiveLock);
+            return timeout > 0 && Monitor.Wait(_ReceiveLock, timeout);
         }
 
-        [DllImport("kernel32.dll")]
-        static extern bool PurgeComm(SafeFileHandle hFile, uint dwFlags);
+        public bool AllowTimingOutWithZeroBytes { get; set; }
 
-        public void Purge()
+        //Computes the total read timeout in milliseconds as COMMTIMEOUTS would. 0 means no total timeout.
+        int ComputeTotalTimeout(int count)
         {
-            if (!PurgeComm(_Handle, 0x0F))
-                throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot purge COM port");
+            //MAXDWORD/MAXDWORD/constant: return as soon as any data arrives, but wait at most 'constant' for it
+            if (_ReadIntervalTimeout == uint.MaxValue && _ReadTotalTimeoutMultiplier == uint.MaxValue)
+                return (int)Math.Min(_ReadTotalTimeoutConstant, int.MaxValue);
+
+            return (int)Math.Min((ulong)_ReadTotalTimeoutMultiplier * (ulong)count + _ReadTotalTimeoutConstant, int.MaxValue);
         }
 
-        [DllImport("kernel32.dll")]
-        static extern bool GetCommState(SafeFileHandle hFile,  ref DCB lpDCB);
+        public override int Read(byte[] buffer, int offset, int count)
+        {
+            if (count == 0)
+                return 0;
 
-        [DllImport("kernel32.dll")]
-        static extern bool SetCommState(SafeFileHandle hFile, ref DCB lpDCB);
+            lock (_ReceiveLock)
+            {
+                //MAXDWORD/0/0: return whatever has already been received without waiting, even if it is nothing
+                if (_ReadIntervalTimeout == uint.MaxValue && _ReadTotalTimeoutMultiplier == 0 && _ReadTotalTimeoutConstant == 0)
+                {
+                    WaitForData(0);     //Only reports errors from the reader thread
+                    return TakeReceivedData(buffer, offset, count);
+                }
 
-        #endregion
+                for (;;)
+                {
+                    int totalTimeout = ComputeTotalTimeout(count);
+                    int start = Environment.TickCount;
 
+                    while (_ReceiveCount == 0)
+                    {
+                        int remaining = (totalTimeout == 0) ? -1 : totalTimeout - (Environment.TickCount - start);
+                        if (totalTimeout != 0 && remaining <= 0)
+                            break;
+                        WaitForData(remaining);
+                    }
 
-        public SerialPortStream(string portName, int baudRate, System.IO.Ports.Handshake flowControl)
-        {
-            _Handle = CreateFile(@"\\.\" + portName, FileAccess.ReadWrite, FileShare.None, IntPtr.Zero, FileMode.Open, FileAttributes.Normal | (FileAttributes)0x40000000, IntPtr.Zero);
-            if (_Handle.IsInvalid)
-                throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot open " + portName);
+                    if (_ReceiveCount == 0)
+                    {
+                        if (AllowTimingOutWithZeroBytes)
+                            return 0;
+                        continue;
+                    }
+
+                    int done = TakeReceivedData(buffer, offset, count);
 
-            ApplyAdvancedSettings(baudRate, flowControl);
+                    //Keep collecting data as long as the gaps between the incoming bytes do not exceed the interval timeout (0 means no interval limit)
+                    while (done < count && _ReadIntervalTimeout != uint.MaxValue)
+                    {
+                        int timeout = (_ReadIntervalTimeout == 0) ? -1 : (int)Math.Min(_ReadIntervalTimeout, int.MaxValue);
+                        if (totalTimeout != 0)
+                        {
+                            //A negative value would make WaitForData() wait indefinitely
+                            int remaining = totalTimeout - (Environment.TickCount - start);
+                            timeout = (timeout < 0) ? remaining : Math.Min(timeout, remaining);
+                            if (timeout <= 0)
+                                break;
+                        }
+
+                        if (_ReceiveCount == 0 && !WaitForData(timeout))
+                            break;
+
+                        done += TakeReceivedData(buffer, offset + done, count - done);
+                    }
 
-            COMMTIMEOUTS timeouts = new COMMTIMEOUTS { ReadIntervalTimeout = 1 };
-            if (!SetCommTimeouts(_Handle, ref timeouts))
-                throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot set timeouts on " + portName);
+                    return done;
+                }
+            }
         }
 
-        public void SetTimeouts(UInt32 readIntervalTimeout, UInt32 readTotalTimeoutMultiplier, UInt32 readTotalTimeoutConstant, UInt32 writeTotalTimeoutMultiplier, UInt32 writeTotalTimeoutConstant)
+        public override void Write(byte[] buffer, int offset, int count)
         {
-            COMMTIMEOUTS timeouts = new COMMTIMEOUTS { ReadIntervalTimeout = readIntervalTimeout, ReadTotalTimeoutMultiplier = readTotalTimeoutMultiplier, ReadTotalTimeoutConstant = readTotalTimeoutConstant, WriteTotalTimeoutMultiplier = writeTotalTimeoutMultiplier, WriteTotalTimeoutConstant = writeTotalTimeoutConstant };
-            if (!SetCommTimeouts(_Handle, ref timeouts))
-                throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot set timeouts on a serial port");
+            Write(new[] { new ArraySegment<byte>(buffer, offset, count) });
         }
 
-        private void ApplyAdvancedSettings(int baudRate, System.IO.Ports.Handshake flowControl)
+        //Sends multiple buffers (e.g. a packet header and a payload) without concatenating them first
+        public void Write(IList<ArraySegment<byte>> buffers)
         {
-            DCB dcb = new DCB { DCBLength = (uint)Marshal.SizeOf(typeof(DCB)) };
-            if (!GetCommState(_Handle, ref dcb))
-                throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot query comm state for serial port");
-
-            dcb.BaudRate = (uint)baudRate;
-            dcb.ByteSize = 8;
-            dcb.Parity = Parity.None;
-            dcb.StopBits = StopBits.One;
-
-            switch (flowControl)
-            {
-                case System.IO.Ports.Handshake.None:
-                    dcb.TxContinueOnXoff = false;
-                    dcb.OutX = false;
-                    dcb.RtsControl = RtsControl.Enable;
-                    dcb.DtrControl = DtrControl.Enable;
-                    dcb.OutxCtsFlow = false;
-                    dcb.OutxDsrFlow = false;
-                    break;
-                case System.IO.Ports.Handshake.XOnXOff:
-                    dcb.TxContinueOnXoff = true;
-                    dcb.OutX = true;
-                    dcb.RtsControl = RtsControl.Enable;
-                    dcb.DtrControl = DtrControl.Enable;
-                    dcb.OutxCtsFlow = false;
-                    dcb.OutxDsrFlow = false;
-                    break;
-                case System.IO.Ports.Handshake.RequestToSend:
-                    dcb.TxContinueOnXoff = false;
-                    dcb.OutX = false;
-                    dcb.RtsControl = RtsControl.Handshake;
-                    dcb.DtrControl = DtrControl.Enable;
-                    dcb.OutxCtsFlow = true;
-                    dcb.OutxDsrFlow = false;
-                    break;
-                case System.IO.Ports.Handshake.RequestToSendXOnXOff:
-                    dcb.TxContinueOnXoff = true;
-                    dcb.OutX = true;
-                    dcb.RtsControl = RtsControl.Handshake;
-                    dcb.DtrControl = DtrControl.Enable;
-                    dcb.OutxCtsFlow = true;
-                    dcb.OutxDsrFlow = false;
-                    break;
-            }
-
-            if (!SetCommState(_Handle, ref dcb))
-                throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot set comm state for serial port");
+            lock (_WriteLock)
+                _Backend.Write(buffers);
         }
 
         public override bool CanRead
@@ -421,102 +316,23 @@ namespace ESP8266DebugPackage
             throw new NotSupportedException();
         }
 
-        object _ReadLock = new object(), _WriteLock = new object();
-        ManualResetEvent _ReadDone = new ManualResetEvent(false);
-        ManualResetEvent _WriteDone = new ManualResetEvent(false);
-
-        public bool AllowTimingOutWithZeroBytes { get; set; }
-
-        public override int Read(byte[] buffer, int offset, int count)
-        {
-            lock (_ReadLock)
-            {
-                NativeOverlapped ovl = new NativeOverlapped { EventHandle = _ReadDone.SafeWaitHandle.DangerousGetHandle() };
-                IntPtr povl = Marshal.AllocHGlobal(Marshal.SizeOf(typeof(NativeOverlapped)));
-                IntPtr pbuf = Marshal.AllocHGlobal(count);
-                int done;
-                try
-                {
-                    for (; ; )
-                    {
-                        Marshal.StructureToPtr(ovl, povl, false);
-
-                        if (!ReadFile(_Handle, pbuf, count, out done, povl) && Marshal.GetLastWin32Error() != 997)
-                            throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot read from serial port");
-
-                        _ReadDone.WaitOne();
-                        if (!GetOverlappedResult(_Handle, povl, out done, false))
-                            throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot read from serial port");
-
-                        if (done == 0 && !AllowTimingOutWithZeroBytes)
-                            continue;
-
-                        Marshal.Copy(pbuf, buffer, offset, done);
-                        return done;
-                    }
-                }
-                finally
-                {
-                    Marshal.FreeHGlobal(povl);
-                    Marshal.FreeHGlobal(pbuf);
-                }
-            }
-        }
-
-        int DoWrite(byte[] buffer, int offset, int count)
+        public override void Close()
         {
-            lock (_WriteLock)
+            if (!_Closed)
             {
-                NativeOverlapped ovl = new NativeOverlapped { EventHandle = _WriteDone.SafeWaitHandle.DangerousGetHandle() };
-                IntPtr povl = Marshal.AllocHGlobal(Marshal.SizeOf(typeof(NativeOverlapped)));
-                IntPtr pbuf = Marshal.AllocHGlobal(count);
-                int done;
-                try
+                lock (_ReceiveLock)
                 {
-                    Marshal.StructureToPtr(ovl, povl, false);
-                    Marshal.Copy(buffer, offset, pbuf, count);
-
-                    if (!WriteFile(_Handle, pbuf, count, out done, povl) && Marshal.GetLastWin32Error() != 997)
-                        throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot read from serial port");
-
-                    _WriteDone.WaitOne();
-                    if (!GetOverlappedResult(_Handle, povl, out done, false))
-                        throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot read from serial port");
-
-                }
-                finally
-                {
-                    Marshal.FreeHGlobal(povl);
-                    Marshal.FreeHGlobal(pbuf);
+                    _Closed = true;
+                    Monitor.PulseAll(_ReceiveLock);
                 }
-                return done;
-            }
-        }
 
-        public override void Write(byte[] buffer, int offset, int count)
-        {
-            for (int total = 0; total < count; )
-            {
-                int done = DoWrite(buffer, offset + total, count - total);
-                if (done <= 0)
-                    throw new Exception("Unexpected byte count written to serial port: " + done);
-                total += done;
+                //The reader thread polls the port periodically, so it will notice the flag shortly
+                _ReaderThread.Join();
+                _Backend.Dispose();
             }
-        }
-
-
-        public override void Close()
-        {
-            _Handle.Close();
-            _ReadDone.Set();
-            _WriteDone.Set();
             base.Close();
         }
 
-        public void EscapeFunction(CommFunction func)
-        {
-            if (!EscapeCommFunction(_Handle, func))
-                throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot " + func + " on serial port");
-        }
+        public void EscapeFunction(CommFunction func) => _Backend.EscapeFunction(func);
     }
 }
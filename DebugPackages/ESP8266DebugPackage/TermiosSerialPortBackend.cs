@@ -0,0 +1,326 @@
+﻿using System;
+using System.Collections.Generic;
+using System.ComponentModel;
+using System.Runtime.InteropServices;
+using System.Text;
+
+namespace ESP8266DebugPackage
+{
+    //Serial port access via termios on Linux. The constants and the termios layout below match the Linux/glibc ABI.
+    class TermiosSerialPortBackend : ISerialPortBackend
+    {
+        #region PInvoke definitions
+        [DllImport("libc", SetLastError = true)]
+        static extern int open(string pathname, int flags);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int close(int fd);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int fcntl(int fd, int cmd, int arg);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern IntPtr read(int fd, IntPtr buf, IntPtr count);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern IntPtr writev(int fd, IntPtr iov, int iovcnt);
+
+        [StructLayout(LayoutKind.Sequential)]
+        struct iovec
+        {
+            public IntPtr iov_base;
+            public IntPtr iov_len;
+        }
+
+        [StructLayout(LayoutKind.Sequential)]
+        struct pollfd
+        {
+            public int fd;
+            public short events;
+            public short revents;
+        }
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int poll([In, Out] pollfd[] fds, uint nfds, int timeout);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int tcgetattr(int fd, [Out] byte[] termios);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int tcsetattr(int fd, int optional_actions, byte[] termios);
+
+        [DllImport("libc")]
+        static extern void cfmakeraw([In, Out] byte[] termios);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int cfsetispeed([In, Out] byte[] termios, uint speed);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int cfsetospeed([In, Out] byte[] termios, uint speed);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int tcflush(int fd, int queue_selector);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int tcflow(int fd, int action);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int ioctl(int fd, UIntPtr request, ref int arg);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int uname([Out] byte[] buf);
+
+        const int O_RDWR = 0x0002, O_NOCTTY = 0x0100, O_NONBLOCK = 0x0800;
+        const int F_GETFL = 3, F_SETFL = 4;
+        const int EINTR = 4, EAGAIN = 11;
+        const short POLLIN = 0x0001;
+        const int TCSANOW = 0, TCIOFLUSH = 2, TCOOFF = 0, TCOON = 1;
+
+        const uint TIOCMBIS = 0x5416, TIOCMBIC = 0x5417, TIOCSBRK = 0x5427, TIOCCBRK = 0x5428;
+        const int TIOCM_DTR = 0x002, TIOCM_RTS = 0x004;
+
+        //Offsets within struct termios
+        const int c_iflag = 0, c_cflag = 8, c_cc = 17;
+        const int VTIME = 5, VMIN = 6;
+
+        const uint IXON = 0x0400, IXOFF = 0x1000;
+        const uint CSTOPB = 0x0040, CREAD = 0x0080, PARENB = 0x0100, CLOCAL = 0x0800, CRTSCTS = 0x80000000;
+        #endregion
+
+        static readonly Dictionary<int, uint> _BaudRateConstants = new Dictionary<int, uint>
+        {
+            { 9600, 0x000D }, { 19200, 0x000E }, { 38400, 0x000F }, { 57600, 0x1001 }, { 115200, 0x1002 },
+            { 230400, 0x1003 }, { 460800, 0x1004 }, { 500000, 0x1005 }, { 576000, 0x1006 }, { 921600, 0x1007 },
+            { 1000000, 0x1008 }, { 1152000, 0x1009 }, { 1500000, 0x100A }, { 2000000, 0x100B }, { 2500000, 0x100C },
+            { 3000000, 0x100D }, { 3500000, 0x100E }, { 4000000, 0x100F },
+        };
+
+        const int ReadPollInterval = 100;
+
+        //The constants above and the termios layout are only valid on Linux (other Unix systems, e.g. macOS, use different values)
+        public static bool IsSupportedPlatform
+        {
+            get
+            {
+                try
+                {
+                    //struct utsname starts with the null-terminated system name on every Unix system. The buffer is larger than any known layout.
+                    byte[] utsname = new byte[8192];
+                    if (uname(utsname) != 0)
+                        return false;
+
+                    int len = Array.IndexOf(utsname, (byte)0);
+                    return Encoding.ASCII.GetString(utsname, 0, len < 0 ? utsname.Length : len) == "Linux";
+                }
+                catch (DllNotFoundException)
+                {
+                    return false;
+                }
+                catch (EntryPointNotFoundException)
+                {
+                    return false;
+                }
+            }
+        }
+
+        int _FD;
+        readonly string _PortName;
+
+        public TermiosSerialPortBackend(string portName)
+        {
+            _PortName = portName.StartsWith("/") ? portName : "/dev/" + portName;
+
+            //O_NONBLOCK prevents open() from waiting for the carrier detect signal. It is cleared once CLOCAL is set.
+            _FD = open(_PortName, O_RDWR | O_NOCTTY | O_NONBLOCK);
+            if (_FD < 0)
+                throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot open " + _PortName);
+        }
+
+        static void SetFlag(byte[] termios, int offset, uint flag, bool set)
+        {
+            uint value = BitConverter.ToUInt32(termios, offset);
+            value = set ? (value | flag) : (value & ~flag);
+            BitConverter.GetBytes(value).CopyTo(termios, offset);
+        }
+
+        public void Configure(int baudRate, System.IO.Ports.Handshake flowControl)
+        {
+            uint speed;
+            if (!_BaudRateConstants.TryGetValue(baudRate, out speed))
+                throw new NotSupportedException($"Baud rate {baudRate} is not supported on this platform");
+
+            //Larger than sizeof(struct termios) on any supported architecture
+            byte[] termios = new byte[256];
+            if (tcgetattr(_FD, termios) != 0)
+                throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot query comm state for serial port");
+
+            cfmakeraw(termios);
+            if (cfsetispeed(termios, speed) != 0 || cfsetospeed(termios, speed) != 0)
+                throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot set baud rate for serial port");
+
+            bool xonXoff = flowControl == System.IO.Ports.Handshake.XOnXOff || flowControl == System.IO.Ports.Handshake.RequestToSendXOnXOff;
+            bool rtsCts = flowControl == System.IO.Ports.Handshake.RequestToSend || flowControl == System.IO.Ports.Handshake.RequestToSendXOnXOff;
+
+            SetFlag(termios, c_cflag, CLOCAL | CREAD, true);
+            SetFlag(termios, c_cflag, CSTOPB | PARENB, false);
+            SetFlag(termios, c_cflag, CRTSCTS, rtsCts);
+            SetFlag(termios, c_iflag, IXON | IXOFF, xonXoff);
+
+            //read() is only called after poll() reports data, so it should never block
+            termios[c_cc + VMIN] = 0;
+            termios[c_cc + VTIME] = 0;
+
+            if (tcsetattr(_FD, TCSANOW, termios) != 0)
+                throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot set comm state for serial port");
+
+            int flags = fcntl(_FD, F_GETFL, 0);
+            if (flags < 0 || fcntl(_FD, F_SETFL, flags & ~O_NONBLOCK) < 0)
+                throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot switch serial port to blocking mode");
+        }
+
+        //Writes are blocking, so the Win32-style write timeouts are not used
+        public void SetWriteTimeouts(uint writeTotalTimeoutMultiplier, uint writeTotalTimeoutConstant)
+        {
+        }
+
+        public int Read(byte[] buffer, int offset, int count)
+        {
+            pollfd[] fds = new[] { new pollfd { fd = _FD, events = POLLIN } };
+            int result = poll(fds, 1, ReadPollInterval);
+            if (result < 0)
+            {
+                int err = Marshal.GetLastWin32Error();
+                if (err == EINTR)
+                    return 0;
+                throw new Win32Exception(err, "Cannot read from serial port");
+            }
+            if (result == 0)
+                return 0;
+
+            var handle = GCHandle.Alloc(buffer, GCHandleType.Pinned);
+            try
+            {
+                long done = read(_FD, new IntPtr(handle.AddrOfPinnedObject().ToInt64() + offset), new IntPtr(count)).ToInt64();
+                if (done < 0)
+                {
+                    int err = Marshal.GetLastWin32Error();
+                    if (err == EINTR || err == EAGAIN)
+                        return 0;
+                    throw new Win32Exception(err, "Cannot read from serial port");
+                }
+                if (done == 0)
+                    throw new Win32Exception(0, "Serial port " + _PortName + " was disconnected");
+
+                return (int)done;
+            }
+            finally
+            {
+                handle.Free();
+            }
+        }
+
+        public void Write(IList<ArraySegment<byte>> buffers)
+        {
+            GCHandle[] handles = new GCHandle[buffers.Count];
+            iovec[] iov = new iovec[buffers.Count];
+            GCHandle iovHandle = GCHandle.Alloc(iov, GCHandleType.Pinned);
+            try
+            {
+                for (int i = 0; i < buffers.Count; i++)
+                {
+                    handles[i] = GCHandle.Alloc(buffers[i].Array, GCHandleType.Pinned);
+                    iov[i].iov_base = new IntPtr(handles[i].AddrOfPinnedObject().ToInt64() + buffers[i].Offset);
+                    iov[i].iov_len = new IntPtr(buffers[i].Count);
+                }
+
+                int first = 0, iovSize = Marshal.SizeOf(typeof(iovec));
+                while (first < iov.Length)
+                {
+                    long done = writev(_FD, new IntPtr(iovHandle.AddrOfPinnedObject().ToInt64() + first * iovSize), iov.Length - first).ToInt64();
+                    if (done < 0)
+                    {
+                        int err = Marshal.GetLastWin32Error();
+                        if (err == EINTR)
+                            continue;
+                        throw new Win32Exception(err, "Cannot write to serial port");
+                    }
+
+                    //Skip the fully written buffers and advance into the partially written one
+                    while (first < iov.Length && done >= iov[first].iov_len.ToInt64())
+                        done -= iov[first++].iov_len.ToInt64();
+
+                    if (done > 0)
+                    {
+                        iov[first].iov_base = new IntPtr(iov[first].iov_base.ToInt64() + done);
+                        iov[first].iov_len = new IntPtr(iov[first].iov_len.ToInt64() - done);
+                    }
+                }
+            }
+            finally
+            {
+                iovHandle.Free();
+                foreach (var h in handles)
+                    if (h.IsAllocated)
+                        h.Free();
+            }
+        }
+
+        public void Purge()
+        {
+            if (tcflush(_FD, TCIOFLUSH) != 0)
+                throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot purge COM port");
+        }
+
+        public void EscapeFunction(SerialPortStream.CommFunction func)
+        {
+            int result, bits;
+            switch (func)
+            {
+                case SerialPortStream.CommFunction.SETDTR:
+                    bits = TIOCM_DTR;
+                    result = ioctl(_FD, new UIntPtr(TIOCMBIS), ref bits);
+                    break;
+                case SerialPortStream.CommFunction.CLRDTR:
+                    bits = TIOCM_DTR;
+                    result = ioctl(_FD, new UIntPtr(TIOCMBIC), ref bits);
+                    break;
+                case SerialPortStream.CommFunction.SETRTS:
+                    bits = TIOCM_RTS;
+                    result = ioctl(_FD, new UIntPtr(TIOCMBIS), ref bits);
+                    break;
+                case SerialPortStream.CommFunction.CLRRTS:
+                    bits = TIOCM_RTS;
+                    result = ioctl(_FD, new UIntPtr(TIOCMBIC), ref bits);
+                    break;
+                case SerialPortStream.CommFunction.SETBREAK:
+                    bits = 0;
+                    result = ioctl(_FD, new UIntPtr(TIOCSBRK), ref bits);
+                    break;
+                case SerialPortStream.CommFunction.CLRBREAK:
+                    bits = 0;
+                    result = ioctl(_FD, new UIntPtr(TIOCCBRK), ref bits);
+                    break;
+                case SerialPortStream.CommFunction.SETXOFF:
+                    result = tcflow(_FD, TCOOFF);
+                    break;
+                case SerialPortStream.CommFunction.SETXON:
+                    result = tcflow(_FD, TCOON);
+                    break;
+                default:
+                    throw new NotSupportedException("Unsupported serial port function: " + func);
+            }
+
+            if (result != 0)
+                throw new Win32Exception(Marshal.GetLastWin32Error(), "Cannot " + func + " on serial port");
+        }
+
+        public void Dispose()
+        {
+            if (_FD >= 0)
+            {
+                close(_FD);
+                _FD = -1;
+            }
+        }
+    }
+}
@@ -18,6 +18,9 @@ namespace RedLinkDebugPackage
         public ProgramMode ProgramMode = ProgramMode.Enabled;
         public bool AlwaysUseProbeSerialNumber;
 
+        //Live watch reads separated by at most this many bytes are fetched with a single MEMDUMP command
+        public int LiveMemoryReadMergeGap = 64;
+
         public RedLinkDebugSettings ShallowClone() => (RedLinkDebugSettings)MemberwiseClone();
     }
 }
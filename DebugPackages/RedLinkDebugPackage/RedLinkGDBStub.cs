@@ -78,7 +78,22 @@ namespace RedLinkDebugPackage
 
         public ILiveMemoryEvaluator CreateLiveMemoryEvaluator(IDebugStartService service)
         {
-            return new RedLinkLiveMemoryEvaluator(_ExplicitSerialNumber, _CoreIndex);
+            return new RedLinkLiveMemoryEvaluator(_ExplicitSerialNumber, _CoreIndex, _Settings.LiveMemoryReadMergeGap, GetKnownRAMRegions(service.MCU?.ExpandedMCU));
+        }
+
+        static MCUMemory[] GetKnownRAMRegions(MCU mcu)
+        {
+            if (mcu == null)
+                return new MCUMemory[0];
+
+            var result = (mcu.GetEffectiveMemoryMap()?.Memories ?? new MCUMemory[0])
+                .Where(m => (m.Flags & MCUMemoryFlags.IsDefaultFLASH) == 0 && m.Name?.IndexOf("RAM", StringComparison.OrdinalIgnoreCase) >= 0)
+                .ToList();
+
+            if (mcu.RAMSize > 0)
+                result.Add(new MCUMemory { Name = "RAM", Address = mcu.RAMBase, Size = (ulong)mcu.RAMSize });
+
+            return result.ToArray();
         }
 
         public void Dispose()
@@ -1,9 +1,11 @@
 ﻿using BSPEngine;
 using System;
 using System.Collections.Generic;
+using System.Diagnostics;
 using System.IO;
 using System.Linq;
 using System.Text;
+using System.Threading;
 
 namespace RedLinkDebugPackage
 {
@@ -14,10 +16,12 @@ namespace RedLinkDebugPackage
 
         RedLinkToolClient _Tool;
 
-        public RedLinkLiveMemoryEvaluator(string explicitSerialNumber, int coreIndex)
+        public RedLinkLiveMemoryEvaluator(string explicitSerialNumber, int coreIndex, int maximumMergedReadGap, MCUMemory[] knownRAM)
         {
             _SerialNumber = explicitSerialNumber;
             _CoreIndex = coreIndex;
+            _MaximumMergedReadGap = Math.Max(0, maximumMergedReadGap);
+            _KnownRAM = knownRAM ?? new MCUMemory[0];
         }
 
         public int[] SupportedAccessSizes { get; } = new[] { -1, 1, 2, 4 };
@@ -27,12 +31,21 @@ namespace RedLinkDebugPackage
         public void Dispose()
         {
             _Tool?.Dispose();
+
+            foreach (var tmp in _StagingFiles)
+            {
+                try
+                {
+                    File.Delete(tmp);
+                }
+                catch { }
+            }
         }
 
         public byte[] ReadMemory(ulong address, int size)
         {
             AlignedIORequest[] requests = new[] { new AlignedIORequest { Address = address, WordSize = 1, WordCount = (uint)size, Buffer = new byte[size], Direction = LiveMemoryIODirection.Read } };
-            if (!RunMultipleIORequests(requests))
+            if (!RunIORequests(requests, false))
                 throw new Exception($"Failed to read memory at {address:x8}");
 
             if (requests[0].BytesDone != (uint)size)
@@ -41,69 +54,236 @@ namespace RedLinkDebugPackage
             return requests[0].Buffer;
         }
 
-        public bool RunMultipleIORequests(AlignedIORequest[] requests)
+        //A single 'srv' command together with the code that processes its output
+        class PendingCommand
         {
-            StringBuilder requestBuilder = new StringBuilder();
-            string requestNumberPrefix = "__CurrentRequest=";
-            List<string> temporaryFiles = new List<string>();
+            public string Text;
+            public Action<string[], int, int> ProcessOutput;
+        }
+
+        //Several nearby read requests served by a single MEMDUMP command
+        class ReadGroup
+        {
+            public ulong Address;
+            public int Size;
+            public List<int> Requests = new List<int>();
+            public byte[] Data;
+            public int BytesDone;
+            public string Error;
+        }
+
+        const int MaximumDumpSize = 4096;
+        const int CommandTimeout = 5000;
+
+        //Reads are delayed so that the probe spends at most this fraction of time serving live memory requests
+        const double MaximumProbeDutyCycle = 0.5;
+        const int MaximumRefreshDelay = 1000;
+
+        readonly int _MaximumMergedReadGap;
+        readonly MCUMemory[] _KnownRAM;   //Reads are only merged across gaps that are entirely within these regions
+        readonly List<string> _StagingFiles = new List<string>();
+        readonly Stopwatch _Clock = Stopwatch.StartNew();
+        double _AverageRoundTrip;   //Milliseconds
+        long _LastBatchEnd;
+
+        public bool RunMultipleIORequests(AlignedIORequest[] requests) => RunIORequests(requests, true);
 
-            try
+        //Only the periodic live watch refreshes are throttled. Explicit ReadMemory()/WriteMemory() calls are served immediately.
+        bool RunIORequests(AlignedIORequest[] requests, bool isPeriodicRefresh)
+        {
+            if (isPeriodicRefresh && requests.All(rq => rq.Direction != LiveMemoryIODirection.Write))
+                WaitForNextRefreshSlot();
+
+            List<PendingCommand> commands = new List<PendingCommand>();
+            List<ReadGroup> readGroups = new List<ReadGroup>();
+            int stagingFilesUsed = 0;
+
+            //Reads can be reordered relative to each other, but not across writes
+            for (int i = 0; i < requests.Length; )
             {
-                for (int i = 0; i < requests.Length; i++)
+                int last = i + 1;
+                while (last < requests.Length && (requests[last].Direction == LiveMemoryIODirection.Write) == (requests[i].Direction == LiveMemoryIODirection.Write))
+                    last++;
+
+                if (requests[i].Direction == LiveMemoryIODirection.Write)
                 {
-                    requestBuilder.Append($"echo {requestNumberPrefix}{i}; ");
-                    if (requests[i].Direction == LiveMemoryIODirection.Write)
-                    {
-                        if (requests[i].WordCount == 1 && (requests[i].WordSize == 1 || requests[i].WordSize == 2 || requests[i].WordSize == 4))
-                            requestBuilder.Append($"srv POKE{requests[i].WordSize * 8} {_ProbeIndex} {_CoreIndex} 0x{requests[i].Address:x8} {FormatByteValueAsSingleNumber(requests[i])};");
-                        else
-                        {
-                            var tmpFile = Path.GetTempFileName();
-                            temporaryFiles.Add(tmpFile);
-                            File.WriteAllBytes(tmpFile, requests[i].Buffer.Skip(requests[i].BufferOffset).Take(requests[i].ByteCount).ToArray());
-                            tmpFile = tmpFile.Replace('\\', '/');
-                            requestBuilder.Append($"srv MEMLOAD {_ProbeIndex} {_CoreIndex} \"{tmpFile}\" 0x{requests[i].Address:x8} {requests[i].ByteCount};");
-                        }
-                    }
-                    else
-                        requestBuilder.Append($"srv MEMDUMP {_ProbeIndex} {_CoreIndex} 0x{requests[i].Address:x8} {requests[i].ByteCount};");
+                    //Failed merged reads must be retried before the following writes change the memory
+                    if (readGroups.Any(g => g.Requests.Count > 1))
+                        RunReadCommandsAndRetries(requests, commands, readGroups);
+
+                    AddWriteCommands(requests, i, last, commands, ref stagingFilesUsed);
                 }
+                else
+                    AddReadCommands(requests, i, last, commands, readGroups);
+
+                i = last;
+            }
+
+            RunReadCommandsAndRetries(requests, commands, readGroups);
+            return true;
+        }
+
+        void RunReadCommandsAndRetries(AlignedIORequest[] requests, List<PendingCommand> commands, List<ReadGroup> readGroups)
+        {
+            RunCommands(commands);
+            commands.Clear();
+
+            //If a merged dump failed (e.g. the gap between the variables is not readable), retry the affected requests individually
+            List<PendingCommand> retries = new List<PendingCommand>();
+            foreach (var group in readGroups)
+                ScatterReadGroup(requests, group, retries);
+
+            readGroups.Clear();
+            RunCommands(retries);
+        }
+
+        bool IsInKnownRAM(ulong start, ulong end) => _KnownRAM.Any(m => start >= m.Address && end <= m.Address + m.Size);
+
+        void WaitForNextRefreshSlot()
+        {
+            int delay = (int)Math.Min(MaximumRefreshDelay, _AverageRoundTrip * (1 / MaximumProbeDutyCycle - 1) - (_Clock.ElapsedMilliseconds - _LastBatchEnd));
+            if (delay > 0)
+                Thread.Sleep(delay);
+        }
+
+        void RunCommands(List<PendingCommand> commands)
+        {
+            if (commands.Count == 0)
+                return;
+
+            StringBuilder requestBuilder = new StringBuilder();
+            string requestNumberPrefix = "__CurrentRequest=";
+            for (int i = 0; i < commands.Count; i++)
+                requestBuilder.Append($"echo {requestNumberPrefix}{i}; {commands[i].Text};");
+
+            long start = _Clock.ElapsedMilliseconds;
+            var output = _Tool.RunCommand(requestBuilder.ToString(), CommandTimeout);
+            _LastBatchEnd = _Clock.ElapsedMilliseconds;
 
-                var output = _Tool.RunCommand(requestBuilder.ToString(), 5000);
+            double roundTrip = _LastBatchEnd - start;
+            _AverageRoundTrip = (_AverageRoundTrip == 0) ? roundTrip : (_AverageRoundTrip * 7 + roundTrip) / 8;
 
-                int currentIndex = -1;
-                int firstLine = -1;
+            int currentIndex = -1;
+            int firstLine = -1;
 
-                for (int i = 0; i < output.Length; i++)
+            for (int i = 0; i < output.Length; i++)
+            {
+                var line = output[i];
+                bool isNewRequest = line.StartsWith(requestNumberPrefix);
+
+                if (isNewRequest || line == "> ")
                 {
-                    var line = output[i];
-                    bool isNewRequest = line.StartsWith(requestNumberPrefix);
+                    if (firstLine != -1 && currentIndex >= 0 && currentIndex < commands.Count)
+                        commands[currentIndex].ProcessOutput(output, firstLine, i - firstLine);
 
-                    if (isNewRequest || line == "> ")
-                    {
-                        if (firstLine != -1 && currentIndex >= 0 && currentIndex < requests.Length)
-                            ProcessRequestOutput(ref requests[currentIndex], output, firstLine, i - firstLine);
+                    if (!isNewRequest || !int.TryParse(line.Substring(requestNumberPrefix.Length), out currentIndex))
+                        currentIndex = -1;
 
-                        if (!isNewRequest || !int.TryParse(line.Substring(requestNumberPrefix.Length), out currentIndex))
-                            currentIndex = -1;
+                    firstLine = i + 1;
+                }
+            }
+        }
 
-                        firstLine = i + 1;
-                    }
+        void AddReadCommands(AlignedIORequest[] requests, int first, int end, List<PendingCommand> commands, List<ReadGroup> readGroups)
+        {
+            List<ReadGroup> groups = new List<ReadGroup>();
+            ReadGroup group = null;
+            foreach (var i in Enumerable.Range(first, end - first).OrderBy(i => requests[i].Address))
+            {
+                ulong requestEnd = requests[i].Address + (ulong)requests[i].ByteCount;
+                ulong groupEnd = group == null ? 0 : group.Address + (ulong)group.Size;
+
+                //Overlapping and adjacent requests can always be merged. Non-adjacent ones only if the gap is known to be plain RAM.
+                bool canMerge = group != null && requestEnd - group.Address <= MaximumDumpSize &&
+                    (requests[i].Address <= groupEnd || (requests[i].Address <= groupEnd + (ulong)_MaximumMergedReadGap && IsInKnownRAM(groupEnd, requests[i].Address)));
+
+                if (canMerge)
+                    group.Size = (int)Math.Max((ulong)group.Size, requestEnd - group.Address);
+                else
+                {
+                    group = new ReadGroup { Address = requests[i].Address, Size = requests[i].ByteCount };
+                    groups.Add(group);
                 }
+
+                group.Requests.Add(i);
             }
-            finally
+
+            readGroups.AddRange(groups);
+            foreach (var g in groups)
+            {
+                var dumpGroup = g;
+                dumpGroup.Data = new byte[dumpGroup.Size];
+                commands.Add(new PendingCommand
+                {
+                    Text = $"srv MEMDUMP {_ProbeIndex} {_CoreIndex} 0x{dumpGroup.Address:x8} {dumpGroup.Size}",
+                    ProcessOutput = (output, firstLine, lineCount) => dumpGroup.BytesDone = ParseMemoryDump(output, firstLine, lineCount, dumpGroup.Address, dumpGroup.Data, 0, dumpGroup.Size, out dumpGroup.Error),
+                });
+            }
+        }
+
+        void ScatterReadGroup(AlignedIORequest[] requests, ReadGroup group, List<PendingCommand> retries)
+        {
+            foreach (var i in group.Requests)
             {
-                foreach(var tmp in temporaryFiles)
+                int offset = (int)(requests[i].Address - group.Address);
+                int available = Math.Max(0, Math.Min(requests[i].ByteCount, group.BytesDone - offset));
+                bool isPartial = requests[i].Direction == LiveMemoryIODirection.PartialRead;
+
+                if (available == requests[i].ByteCount || (isPartial && available > 0 && group.Requests.Count == 1))
                 {
-                    try
+                    Buffer.BlockCopy(group.Data, offset, requests[i].Buffer, requests[i].BufferOffset, available);
+                    requests[i].Complete((uint)available / requests[i].WordSize, null);
+                }
+                else if (group.Requests.Count > 1)
+                {
+                    int index = i;
+                    retries.Add(new PendingCommand
                     {
-                        File.Delete(tmp);
-                    }
-                    catch { }
+                        Text = $"srv MEMDUMP {_ProbeIndex} {_CoreIndex} 0x{requests[i].Address:x8} {requests[i].ByteCount}",
+                        ProcessOutput = (output, firstLine, lineCount) => ProcessReadOutput(ref requests[index], output, firstLine, lineCount),
+                    });
                 }
+                else
+                    requests[i].Complete(0, group.Error ?? $"Failed to read memory at 0x{requests[i].Address:x8}");
             }
+        }
 
-            return true;
+        //Consecutive writes to adjacent addresses are merged into a single command
+        void AddWriteCommands(AlignedIORequest[] requests, int first, int end, List<PendingCommand> commands, ref int stagingFilesUsed)
+        {
+            for (int i = first; i < end; )
+            {
+                int last = i + 1;
+                int totalSize = requests[i].ByteCount;
+                while (last < end && requests[last].Address == requests[last - 1].Address + (ulong)requests[last - 1].ByteCount)
+                    totalSize += requests[last++].ByteCount;
+
+                int firstRequest = i, lastRequest = last;
+                Action<string[], int, int> processOutput = (output, firstLine, lineCount) =>
+                {
+                    string error = FindErrorLine(output, firstLine, lineCount);
+                    for (int j = firstRequest; j < lastRequest; j++)
+                        requests[j].Complete(error == null ? requests[j].WordCount : 0, error);
+                };
+
+                if (last == i + 1 && requests[i].WordCount == 1 && (requests[i].WordSize == 1 || requests[i].WordSize == 2 || requests[i].WordSize == 4))
+                    commands.Add(new PendingCommand { Text = $"srv POKE{requests[i].WordSize * 8} {_ProbeIndex} {_CoreIndex} 0x{requests[i].Address:x8} {FormatByteValueAsSingleNumber(requests[i])}", ProcessOutput = processOutput });
+                else
+                {
+                    //The staging files are reused between the calls and deleted when the evaluator is disposed
+                    if (stagingFilesUsed == _StagingFiles.Count)
+                        _StagingFiles.Add(Path.GetTempFileName());
+
+                    string stagingFile = _StagingFiles[stagingFilesUsed++];
+                    using (var fs = new FileStream(stagingFile, FileMode.Create, FileAccess.Write))
+                        for (int j = i; j < last; j++)
+                            fs.Write(requests[j].Buffer, requests[j].BufferOffset, requests[j].ByteCount);
+
+                    commands.Add(new PendingCommand { Text = $"srv MEMLOAD {_ProbeIndex} {_CoreIndex} \"{stagingFile.Replace('\\', '/')}\" 0x{requests[i].Address:x8} {totalSize}", ProcessOutput = processOutput });
+                }
+
+                i = last;
+            }
         }
 
         private string FormatByteValueAsSingleNumber(AlignedIORequest rq)
@@ -115,74 +295,70 @@ namespace RedLinkDebugPackage
             return result.ToString();
         }
 
-        private void ProcessRequestOutput(ref AlignedIORequest request, string[] output, int firstLine, int lineCount)
+        static string FindErrorLine(string[] output, int firstLine, int lineCount)
         {
-            if (request.Direction == LiveMemoryIODirection.Write)
-            {
-                string error = null;
-                for (int i = 0; i < lineCount; i++)
-                    if (output[firstLine + 1].StartsWith("Error:"))
-                    {
-                        error = output[firstLine + 1];
-                        break;
-                    }
+            for (int i = 0; i < lineCount; i++)
+                if (output[firstLine + i].StartsWith("Error:"))
+                    return output[firstLine + i];
+            return null;
+        }
 
-                if (error == null)
-                    request.Complete(request.WordCount, null);
-                else
-                    request.Complete(0, error);
-            }
+        private void ProcessReadOutput(ref AlignedIORequest request, string[] output, int firstLine, int lineCount)
+        {
+            int bytesDone = ParseMemoryDump(output, firstLine, lineCount, request.Address, request.Buffer, request.BufferOffset, request.ByteCount, out var error);
+
+            if (bytesDone == request.ByteCount || ((request.Direction == LiveMemoryIODirection.PartialRead) && bytesDone > 0))
+                request.Complete((uint)bytesDone / request.WordSize, null);
             else
-            {
-                int bytesDone = 0;
+                request.Complete(0, error ?? $"Failed to read memory at 0x{request.Address:x8}");
+        }
+
+        //Parses the MEMDUMP output into the buffer and returns the number of bytes read
+        static int ParseMemoryDump(string[] output, int firstLine, int lineCount, ulong baseAddress, byte[] buffer, int bufferOffset, int size, out string error)
+        {
+            int bytesDone = 0;
+            error = null;
 
-                for (int i = 0; i < lineCount; i++)
+            for (int i = 0; i < lineCount; i++)
+            {
+                string line = output[firstLine + i];
+                int idx = line.IndexOf(':');
+                if (idx == -1)
                 {
-                    string line = output[firstLine + i];
-                    int idx = line.IndexOf(':');
-                    if (idx == -1)
-                    {
-                        request.Complete(0, line);
-                        return;
-                    }
+                    error = line;
+                    return bytesDone;
+                }
 
-                    if (!ulong.TryParse(line.Substring(0, idx).Trim(), System.Globalization.NumberStyles.HexNumber, null, out var address))
-                    {
-                        request.Complete(0, "Invalid address output: " + line);
-                        return;
-                    }
+                if (!ulong.TryParse(line.Substring(0, idx).Trim(), System.Globalization.NumberStyles.HexNumber, null, out var address))
+                {
+                    error = "Invalid address output: " + line;
+                    return bytesDone;
+                }
 
-                    if (address != (request.Address + (uint)bytesDone))
-                        throw new Exception($"Mismatching address (expected 0x{request.Address + (uint)bytesDone:x8}: {line})");
+                if (address != (baseAddress + (uint)bytesDone))
+                    throw new Exception($"Mismatching address (expected 0x{baseAddress + (uint)bytesDone:x8}: {line})");
 
-                    while (bytesDone < request.ByteCount)
-                    {
+                while (bytesDone < size)
+                {
+                    idx++;
+                    while (idx < line.Length && line[idx] == ' ')
                         idx++;
-                        while (idx < line.Length && line[idx] == ' ')
-                            idx++;
-
-                        if (idx >= (line.Length - 2))
-                            break;
 
-                        if (!byte.TryParse(line.Substring(idx, 2), System.Globalization.NumberStyles.HexNumber, null, out var byteValue))
-                        {
-                            request.Complete(0, "Invalid output: " + line);
-                            return;
-                        }
+                    if (idx >= (line.Length - 2))
+                        break;
 
-                        idx += 2;
-                        request.Buffer[request.BufferOffset + bytesDone++] = byteValue;
+                    if (!byte.TryParse(line.Substring(idx, 2), System.Globalization.NumberStyles.HexNumber, null, out var byteValue))
+                    {
+                        error = "Invalid output: " + line;
+                        return bytesDone;
                     }
 
-                }
-
-                if (bytesDone == request.ByteCount || ((request.Direction == LiveMemoryIODirection.PartialRead) && bytesDone > 0))
-                    request.Complete((uint)bytesDone / request.WordSize, null);
-                else
-                {
-                    request.Complete(0, $"Failed to read memory at 0x{request.Address:x8}");
+                    idx += 2;
+                    buffer[bufferOffset + bytesDone++] = byteValue;
                 }
             }
+
+            return bytesDone;
         }
 
         public void Start()
@@ -215,7 +391,7 @@ namespace RedLinkDebugPackage
         public void WriteMemory(ulong address, byte[] value, int offset, int length)
         {
             AlignedIORequest[] requests = new[] { new AlignedIORequest { Address = address, WordSize = 1, WordCount = (uint)length, Buffer = value, Direction = LiveMemoryIODirection.Write, BufferOffset = offset } };
-            if (!RunMultipleIORequests(requests))
+            if (!RunIORequests(requests, false))
                 throw new Exception($"Failed to read memory at {address:x8}");
 
             if (requests[0].BytesDone != length)
@@ -61,8 +61,28 @@ struct AddressTable
     
     void *EntryPoint;
     void *Result;
+
+    void *RequestLoopEntry;
+    void *RequestRing;
 };
 
+/*
+ *  The request ring reuses s_ProgramBuffer as its data area. The host appends requests
+ *  ({command, arg1, arg2} followed by arg2 bytes of data for ProgramPages) and advances
+ *  WriteCount, while RunRequestLoop() consumes them and advances ReadCount. Both counters
+ *  are free-running byte counts and all requests are word-aligned.
+ */
+struct RequestRing
+{
+    volatile unsigned ReadCount;
+    volatile unsigned WriteCount;
+    volatile int Status;
+    volatile unsigned RequestsProcessed;
+    volatile unsigned StopWhenIdle;
+};
+
+static struct RequestRing s_RequestRing;
+
 enum ProgramCommand
 {
     EraseAll,
@@ -94,15 +114,98 @@ static void ProgramEntry(enum ProgramCommand cmd, unsigned arg1, unsigned arg2)
     asm("bkpt 255");
 }
 
+/* Returns the amount of unread data, waiting for the host if the ring is empty */
+static unsigned WaitForRequestData(void)
+{
+    unsigned available;
+    while (!(available = s_RequestRing.WriteCount - s_RequestRing.ReadCount))
+    {
+        if (s_RequestRing.StopWhenIdle)
+            asm("bkpt 254");    /* The host will fill the ring and resume us past this instruction */
+    }
+    return available;
+}
+
+static unsigned ReadRequestWord(void)
+{
+    unsigned word;
+    WaitForRequestData();
+    word = s_ProgramBuffer[(s_RequestRing.ReadCount % sizeof(s_ProgramBuffer)) / 4];
+    s_RequestRing.ReadCount += 4;
+    return word;
+}
+
+/* Programs the data directly from the ring, splitting it at the wraparound point */
+static int ProgramFromRing(unsigned address, unsigned size)
+{
+    int result;
+    while (size)
+    {
+        unsigned offset = s_RequestRing.ReadCount % sizeof(s_ProgramBuffer);
+        unsigned todo = WaitForRequestData();
+        if (todo > size)
+            todo = size;
+        if (todo > sizeof(s_ProgramBuffer) - offset)
+            todo = sizeof(s_ProgramBuffer) - offset;
+
+        result = FlashProgram((unsigned long *)(s_ProgramBuffer + offset / 4), address, todo);
+        if (result)
+            return result;
+
+        s_RequestRing.ReadCount += todo;
+        address += todo;
+        size -= todo;
+    }
+    return 0;
+}
+
+static void RunRequestLoop(void)
+{
+    for (;;)
+    {
+        enum ProgramCommand cmd = (enum ProgramCommand)ReadRequestWord();
+        unsigned arg1 = ReadRequestWord();
+        unsigned arg2 = ReadRequestWord();
+        unsigned off;
+        int result = -1024;
+
+        switch (cmd)
+        {
+        case EraseAll:
+            result = FlashMassErase();
+            break;
+        case ErasePages:
+            result = 0;
+            for (off = 0; off < arg2 && !result; off += FLASH_CTRL_ERASE_SIZE)
+                result = FlashErase((arg1 + off) & ~(FLASH_CTRL_ERASE_SIZE - 1));
+            break;
+        case ProgramPages:
+            result = ProgramFromRing(arg1, arg2);
+            break;
+        }
+
+        if (result)
+        {
+            s_RequestRing.Status = result;
+            for (;;)
+                asm("bkpt 255");
+        }
+
+        s_RequestRing.RequestsProcessed++;
+    }
+}
+
 volatile struct AddressTable g_AddressTable = 
 { 
-    .Signature = 0x769730AE,
+    .Signature = 0x769730AF,
     .EndOfStack = (unsigned)&_stack_end,
     .LoadAddress = 0x20004000,
     .ProgramBuffer = (unsigned)&s_ProgramBuffer,
     .ProgramBufferSize = (unsigned)sizeof(s_ProgramBuffer),
     .EntryPoint = ProgramEntry,
     .Result = (void *)&g_Result,
+    .RequestLoopEntry = RunRequestLoop,
+    .RequestRing = &s_RequestRing,
 };
 
 
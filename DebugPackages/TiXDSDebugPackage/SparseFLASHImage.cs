@@ -0,0 +1,105 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Linq;
+
+namespace TiXDSDebugPackage
+{
+    //Combines the loadable sections and the additional FLASH resources into a small number of contiguous word-aligned blocks.
+    //Gaps up to MaximumMergedGap bytes are filled with 0xFF (erased FLASH value), so they can be programmed with the neighboring data.
+    class SparseFLASHImage
+    {
+        public class Block
+        {
+            public uint Address;
+            public byte[] Data;
+            public string Description;
+
+            public uint EndAddress => Address + (uint)Data.Length;
+        }
+
+        struct Segment
+        {
+            public uint Address;
+            public byte[] Data;
+            public int Offset, Size;
+            public string Name;
+            public int Index;
+
+            public uint EndAddress => Address + (uint)Size;
+        }
+
+        public const uint MaximumMergedGap = 256;
+
+        readonly List<Segment> _Segments = new List<Segment>();
+
+        //Segments added later override the overlapping parts of the earlier ones
+        public void AddData(uint address, byte[] data, int offset, int size, string name)
+        {
+            if (size <= 0)
+                return;
+            if (offset < 0 || offset + size > data.Length)
+                throw new Exception($"{name} is outside the provided data range");
+
+            _Segments.Add(new Segment { Address = address, Data = data, Offset = offset, Size = size, Name = name, Index = _Segments.Count });
+        }
+
+        public Block[] Build()
+        {
+            List<Block> blocks = new List<Block>();
+            var sorted = _Segments.OrderBy(s => s.Address).ToArray();
+
+            for (int first = 0; first < sorted.Length; )
+            {
+                uint start = sorted[first].Address & ~3U, end = sorted[first].EndAddress;
+                int last = first + 1;
+                while (last < sorted.Length && sorted[last].Address <= end + MaximumMergedGap)
+                    end = Math.Max(end, sorted[last++].EndAddress);
+
+                end = (end + 3U) & ~3U;
+
+                var block = new Block { Address = start, Data = new byte[end - start] };
+                for (int i = 0; i < block.Data.Length; i++)
+                    block.Data[i] = 0xFF;
+
+                var segments = sorted.Skip(first).Take(last - first).OrderBy(s => s.Index).ToArray();
+                foreach (var seg in segments)
+                    Buffer.BlockCopy(seg.Data, seg.Offset, block.Data, (int)(seg.Address - start), seg.Size);
+
+                block.Description = string.Join(", ", segments.Select(s => s.Name).ToArray());
+                blocks.Add(block);
+                first = last;
+            }
+
+            return blocks.ToArray();
+        }
+
+        //Returns the merged ranges of erase pages touched by the blocks
+        public static List<KeyValuePair<uint, uint>> ComputeErasedRanges(Block[] blocks, uint pageSize)
+        {
+            List<KeyValuePair<uint, uint>> ranges = new List<KeyValuePair<uint, uint>>();
+            uint rangeStart = 0, rangeEnd = 0;
+
+            foreach (var block in blocks.OrderBy(b => b.Address))
+            {
+                uint start = block.Address & ~(pageSize - 1);
+                uint end = (block.EndAddress + pageSize - 1) & ~(pageSize - 1);
+
+                if (rangeEnd != rangeStart && start <= rangeEnd)
+                {
+                    rangeEnd = Math.Max(rangeEnd, end);
+                    continue;
+                }
+
+                if (rangeEnd != rangeStart)
+                    ranges.Add(new KeyValuePair<uint, uint>(rangeStart, rangeEnd - rangeStart));
+                rangeStart = start;
+                rangeEnd = end;
+            }
+
+            if (rangeEnd != rangeStart)
+                ranges.Add(new KeyValuePair<uint, uint>(rangeStart, rangeEnd - rangeStart));
+
+            return ranges;
+        }
+    }
+}
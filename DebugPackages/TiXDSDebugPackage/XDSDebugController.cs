@@ -90,18 +90,34 @@ namespace TiXDSDebugPackage
 
         class LoadedProgrammingStub
         {
-            const int Signature = 0x769730AE;
+            const int LegacySignature = 0x769730AE;
+            const int Signature = 0x769730AF;
+
+            const int RequestHeaderSize = 12;
 
             public readonly uint LoadAddress, EndOfStack, ProgramBuffer, ProgramBufferSize;
             public readonly uint EntryPoint, Result;
+            public readonly uint RequestLoopEntry, RequestRing;    //0 if the stub does not support the request ring
             private readonly ISimpleGDBSession _Session;
             bool _Loaded;
 
+            static int[] FindSignature(byte[] data, int signature, int tableSize)
+            {
+                return Enumerable.Range(0, data.Length - tableSize + 1).Where(d => BitConverter.ToInt32(data, d) == signature).ToArray();
+            }
+
             public LoadedProgrammingStub(string path, ISimpleGDBSession session, TiXDSDebugSettings settings)
             {
                 byte[] data = File.ReadAllBytes(path);
                 _Path = path.Replace('\\', '/');
-                var offsets = Enumerable.Range(0, data.Length - 3).Where(d => BitConverter.ToInt32(data, d) == Signature).ToArray();
+
+                //Stubs built before the request ring was introduced (including the prebuilt CC3220SF.bin shipped with older packages)
+                //only have the legacy address table. They are still supported via the per-command protocol.
+                var offsets = FindSignature(data, Signature, 9 * 4);
+                bool hasRequestRing = offsets.Length == 1;
+                if (!hasRequestRing)
+                    offsets = FindSignature(data, LegacySignature, 7 * 4);
+
                 if (offsets.Length != 1)
                     throw new Exception("Unable to uniquely locate the address table block in " + path);
 
@@ -113,6 +129,19 @@ namespace TiXDSDebugPackage
 
                 EntryPoint = BitConverter.ToUInt32(data, off += 4);
                 Result = BitConverter.ToUInt32(data, off += 4);
+
+                if (hasRequestRing)
+                {
+                    RequestLoopEntry = BitConverter.ToUInt32(data, off += 4);
+                    RequestRing = BitConverter.ToUInt32(data, off += 4);
+                }
+
+                if (RequestLoopEntry == 0 || RequestRing == 0)
+                {
+                    RequestLoopEntry = RequestRing = 0;
+                    session.SendInformationalOutput($"{Path.GetFileName(path)} does not support batched requests. FLASH will be programmed one block at a time. Rebuild it from FLASH/CC3220SF to speed up programming.");
+                }
+
                 _Session = session;
                 _Settings = settings;
             }
@@ -147,43 +176,203 @@ namespace TiXDSDebugPackage
                 _Session.RunGDBCommand($"-gdb-set $r1=0x{arg1:x8}", false);
                 _Session.RunGDBCommand($"-gdb-set $r2=0x{arg2:x8}", false);
                 _Session.ResumeAndWaitForStop(_Settings.ProgramTimeout);
-                string result = _Session.EvaluateExpression($"*((int *)0x{Result:x8})");
+                return ReadInt32(Result);
+            }
+
+            int ReadInt32(uint address)
+            {
+                string result = _Session.EvaluateExpression($"*((int *)0x{address:x8})");
                 if (int.TryParse(result, out var t))
                     return t;
                 throw new Exception("Failed to parse algorithm result: " + result);
             }
 
+            #region Request ring
+            //The stub keeps running RunRequestLoop() between the requests. We append the requests to the ring while the target is stopped
+            //and resume it once per ring fill. The stub stops with 'bkpt 254' once it has consumed all the data, or with 'bkpt 255' on error.
+            //The XDS gdb agent cannot access the memory while the target is running, so the stub is always configured to stop when idle.
+
+            struct QueuedRequest
+            {
+                public string Description;
+                public uint Size;
+            }
+
+            uint _WriteCount, _FlushedCount;
+            bool _RequestLoopStarted;
+            readonly List<QueuedRequest> _Requests = new List<QueuedRequest>();
+            int _RequestsReported;
+
+            //Called for each erase/program request once the stub has completed it. When using the request ring, this is driven by the stub's RequestsProcessed counter.
+            public Action<uint, string> RequestCompleted;
+
+            uint FreeRingSpace => ProgramBufferSize - (_WriteCount - _FlushedCount);
+
+            void WriteMemory(uint address, byte[] data, int offset, int size)
+            {
+                var result = _Session.RunGDBCommand($"-data-write-memory-bytes 0x{address:x8} {BitConverter.ToString(data, offset, size).Replace("-", "")}");
+                if (!result.IsDone)
+                    throw new Exception($"Failed to write memory at 0x{address:x8}");
+            }
+
+            void AppendRequest(ProgramCommand cmd, uint arg1, uint arg2, uint size, string description)
+            {
+                if (FreeRingSpace < RequestHeaderSize)
+                    Flush();
+
+                byte[] header = new byte[RequestHeaderSize];
+                BitConverter.GetBytes((uint)cmd).CopyTo(header, 0);
+                BitConverter.GetBytes(arg1).CopyTo(header, 4);
+                BitConverter.GetBytes(arg2).CopyTo(header, 8);
+
+                //The header may straddle the end of the ring
+                uint ringOffset = _WriteCount % ProgramBufferSize;
+                int firstPart = (int)Math.Min(RequestHeaderSize, ProgramBufferSize - ringOffset);
+                WriteMemory(ProgramBuffer + ringOffset, header, 0, firstPart);
+                if (firstPart < RequestHeaderSize)
+                    WriteMemory(ProgramBuffer, header, firstPart, RequestHeaderSize - firstPart);
+
+                _WriteCount += RequestHeaderSize;
+                _Requests.Add(new QueuedRequest { Description = description, Size = size });
+            }
+
+            void ReportCompletedRequests(int requestsProcessed)
+            {
+                for (; _RequestsReported < Math.Min(requestsProcessed, _Requests.Count); _RequestsReported++)
+                    RequestCompleted?.Invoke(_Requests[_RequestsReported].Size, _Requests[_RequestsReported].Description);
+            }
+
+            void AppendData(byte[] data, int offset, int size)
+            {
+                while (size > 0)
+                {
+                    if (FreeRingSpace == 0)
+                        Flush();
+
+                    uint ringOffset = _WriteCount % ProgramBufferSize;
+                    int todo = (int)Math.Min(Math.Min((uint)size, FreeRingSpace), ProgramBufferSize - ringOffset);
+
+                    WriteMemory(ProgramBuffer + ringOffset, data, offset, todo);
+
+                    _WriteCount += (uint)todo;
+                    offset += todo;
+                    size -= todo;
+                }
+            }
+
+            //Lets the stub process all requests appended so far and waits for it to stop
+            void Flush()
+            {
+                if (_WriteCount == _FlushedCount)
+                    return;
+
+                EnsureLoaded();
+                if (!_RequestLoopStarted)
+                {
+                    byte[] ringState = new byte[20];    //ReadCount, WriteCount, Status, RequestsProcessed, StopWhenIdle
+                    BitConverter.GetBytes(_WriteCount).CopyTo(ringState, 4);
+                    BitConverter.GetBytes(1).CopyTo(ringState, 16);
+                    WriteMemory(RequestRing, ringState, 0, ringState.Length);
+
+                    _Session.RunGDBCommand($"-gdb-set $sp=0x{EndOfStack:x8}", false);
+                    _Session.RunGDBCommand($"-gdb-set $pc=0x{RequestLoopEntry:x8}", false);
+                    _RequestLoopStarted = true;
+                }
+                else
+                {
+                    WriteMemory(RequestRing + 4, BitConverter.GetBytes(_WriteCount), 0, 4);
+                    _Session.RunGDBCommand("-gdb-set $pc=$pc+2", false);   //Skip the 'bkpt 254' instruction
+                }
+
+                //Each request in the batch could take as long as a single command in the legacy protocol
+                int requestsInBatch = Math.Max(1, _Requests.Count - _RequestsReported);
+                _Session.ResumeAndWaitForStop(_Settings.ProgramTimeout * requestsInBatch);
+
+                int status = ReadInt32(RequestRing + 8);
+                int requestsProcessed = ReadInt32(RequestRing + 12);
+                ReportCompletedRequests(requestsProcessed);
+
+                if (status != 0)
+                {
+                    string description = (requestsProcessed >= 0 && requestsProcessed < _Requests.Count) ? _Requests[requestsProcessed].Description : "unknown request";
+                    throw new Exception($"Failed to {description}: error {status}");
+                }
+
+                if ((uint)ReadInt32(RequestRing) != _WriteCount)
+                    throw new Exception("The FLASH programming stub stopped before processing all requests");
+
+                _FlushedCount = _WriteCount;
+            }
+            #endregion
+
             public void EraseMemory(uint address, uint size)
             {
+                string description = $"erase FLASH range 0x{address:x8} - 0x{address + size:x8}";
+                if (RequestRing != 0)
+                {
+                    AppendRequest(ProgramCommand.ErasePages, address, size, size, description);
+                    return;
+                }
+
                 int r = ExecuteCommand(ProgramCommand.ErasePages, address, size);
                 if (r != 0)
-                    throw new Exception($"Failed to erase FLASH range 0x{address:x8} - 0x{address + size:x8}: error {r}");
+                    throw new Exception($"Failed to {description}: error {r}");
+                RequestCompleted?.Invoke(size, description);
             }
 
-            public void ProgramMemory(uint address, string elfFile, uint offset, uint size, string sectionName)
+            public void EraseAll(uint flashSize)
             {
-                uint alignment = address - (address & ~3U);
-                address -= alignment;
-                offset -= alignment;
-                size += alignment;
+                if (RequestRing != 0)
+                {
+                    AppendRequest(ProgramCommand.EraseAll, 0, 0, flashSize, "erase FLASH");
+                    return;
+                }
 
-                size = (size + 3U) & ~3U;
+                int r = ExecuteCommand(ProgramCommand.EraseAll, 0, 0);
+                if (r != 0)
+                    throw new Exception($"Failed to erase FLASH: error {r}");
+                RequestCompleted?.Invoke(flashSize, "erase FLASH");
+            }
 
-                uint loadBase = ProgramBuffer - offset;
+            //The address and the size must be word-aligned. The data is sent to the target directly via memory write packets.
+            public void ProgramMemory(uint address, byte[] data, int offset, int size, string sectionName)
+            {
+                if (((address | (uint)size) & 3U) != 0)
+                    throw new ArgumentException($"Unaligned FLASH range 0x{address:x8} - 0x{address + size:x8}");
 
-                var result = _Session.RunGDBCommand($"restore {elfFile} binary 0x{loadBase:x8} 0x{offset:x8} 0x{offset + size:x8}");
-                if (!result.IsDone)
-                    throw new Exception("Failed to load " + elfFile);
+                string description = $"program FLASH range 0x{address:x8} - 0x{address + size:x8} ({sectionName})";
+                if (RequestRing != 0)
+                {
+                    //The data follows the header directly, so it can be larger than the ring itself
+                    AppendRequest(ProgramCommand.ProgramPages, address, (uint)size, (uint)size, description);
+                    AppendData(data, offset, size);
+                    return;
+                }
+
+                if (size > ProgramBufferSize)
+                    throw new ArgumentException("The programmed block does not fit into the stub buffer");
+
+                EnsureLoaded();
+                WriteMemory(ProgramBuffer, data, offset, size);
 
                 int r = ExecuteCommand(ProgramCommand.ProgramPages, address, (uint)size);
                 if (r != 0)
-                    throw new Exception($"Failed to program FLASH range 0x{address:x8} - 0x{address + size:x8} ({sectionName}): error {r}");
+                    throw new Exception($"Failed to {description}: error {r}");
+                RequestCompleted?.Invoke((uint)size, description);
+            }
 
+            //Waits for all queued requests to complete. Must be called after the last EraseMemory()/ProgramMemory() call.
+            public void Complete()
+            {
+                if (RequestRing != 0)
+                    Flush();
             }
         }
 
         const int FLASHBase = 0x01000000;
         const int MaximumFLASHSize = 1024 * 1024;
+        const uint FLASHErasePageSize = 2048;
+        const long MassEraseThreshold = MaximumFLASHSize * 3 / 4;   //Use a single mass erase if most of the FLASH is going to be erased anyway
 
         public class StubInstance : IGDBStubInstance
         {
@@ -257,59 +446,55 @@ namespace TiXDSDebugPackage
                             using (var progr = session.CreateScopedProgressReporter("Programming FLASH...", new[] { "Erasing FLASH", "Programing FLASH" }))
                             {
                                 var stub = new LoadedProgrammingStub(service.GetPathWithoutSpaces(Path.Combine(_BaseDir, "CC3220SF.bin")), session, _Settings);
-                                uint totalSize = 0;
-
-                                int totalItems = sections.Length + resources.Length;
-                                int itemsDone = 0;
 
+                                //Read every input file once and program the combined image, so that adjacent sections/resources share the erase and program requests
+                                var image = new SparseFLASHImage();
+                                byte[] elfData = File.ReadAllBytes(info.Path);
                                 foreach (var sec in sections)
-                                {
-                                    stub.EraseMemory((uint)sec.LoadAddress.Value, (uint)sec.Size);
-                                    totalSize += (uint)sec.Size;
-                                    progr.ReportTaskProgress(itemsDone, totalItems, $"Erasing {sec.Name}...");
-                                }
+                                    image.AddData((uint)sec.LoadAddress.Value, elfData, (int)sec.OffsetInFile, (int)sec.Size, sec.Name);
 
                                 foreach (var r in resources)
                                 {
                                     r.ExpandedPath = service.ExpandProjectVariables(r.Path, true, true);
                                     r.Data = File.ReadAllBytes(r.ExpandedPath);
-
-                                    stub.EraseMemory(FLASHBase + (uint)r.ParsedOffset, (uint)r.Data.Length);
-                                    totalSize += (uint)r.Data.Length;
-                                    progr.ReportTaskProgress(itemsDone, totalItems, $"Erasing area for {Path.GetFileName(r.ExpandedPath)}...");
+                                    image.AddData(FLASHBase + (uint)r.ParsedOffset, r.Data, 0, r.Data.Length, Path.GetFileName(r.ExpandedPath));
                                 }
 
-                                progr.ReportTaskCompletion(true);
+                                var blocks = image.Build();
+                                var erasedRanges = SparseFLASHImage.ComputeErasedRanges(blocks, FLASHErasePageSize);
+                                long erasedSize = erasedRanges.Sum(r => (long)r.Value);
+                                bool massErase = erasedSize >= MassEraseThreshold;
 
-                                var path = service.GetPathWithoutSpaces(info.Path);
+                                //Progress follows the requests completed by the stub rather than the ones queued by us
+                                long phaseTotal = massErase ? MaximumFLASHSize : erasedSize, phaseDone = 0;
+                                stub.RequestCompleted = (size, description) => progr.ReportTaskProgress(phaseDone += size, phaseTotal, $"Completed: {description}");
 
-                                uint doneTotal = 0;
-                                foreach (var sec in sections)
+                                progr.ReportTaskProgress(0, phaseTotal, "Erasing FLASH...");
+                                if (massErase)
+                                    stub.EraseAll(MaximumFLASHSize);
+                                else
                                 {
-                                    for (uint done = 0; done < (uint)sec.Size; done++)
-                                    {
-                                        uint todo = Math.Min(stub.ProgramBufferSize, (uint)sec.Size - done);
-                                        progr.ReportTaskProgress(doneTotal, totalSize, $"Programming {sec.Name}...");
-                                        stub.ProgramMemory((uint)sec.LoadAddress.Value + done, path, (uint)sec.OffsetInFile + done, todo, sec.Name);
-
-                                        doneTotal += todo;
-                                        done += todo;
-                                    }
+                                    foreach (var range in erasedRanges)
+                                        stub.EraseMemory(range.Key, range.Value);
                                 }
 
-                                foreach (var r in resources)
+                                //Run the erase batch now, so that the erase task completes before programming starts
+                                stub.Complete();
+                                progr.ReportTaskCompletion(true);
+
+                                phaseTotal = blocks.Sum(b => (long)b.Data.Length);
+                                phaseDone = 0;
+                                foreach (var block in blocks)
                                 {
-                                    var imgName = Path.GetFileName(r.ExpandedPath);
-                                    for (uint done = 0; done < (uint)r.Data.Length; done++)
+                                    for (int done = 0; done < block.Data.Length; )
                                     {
-                                        uint todo = Math.Min(stub.ProgramBufferSize, (uint)r.Data.Length - done);
-                                        progr.ReportTaskProgress(doneTotal, totalSize, $"Programming {imgName}...");
-                                        stub.ProgramMemory((uint)FLASHBase + (uint)r.ParsedOffset + done, path, done, todo, imgName);
-
-                                        doneTotal += todo;
+                                        int todo = (int)Math.Min(stub.ProgramBufferSize, (uint)(block.Data.Length - done));
+                                        stub.ProgramMemory(block.Address + (uint)done, block.Data, done, todo, block.Description);
                                         done += todo;
                                     }
                                 }
+
+                                stub.Complete();
                             }
                         }
 
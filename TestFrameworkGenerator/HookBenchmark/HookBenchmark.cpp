@@ -0,0 +1,259 @@
+/*
+    Measures the throughput of the host-side test hooks (Rules/Common/SysprogsTestHooks.cpp) and validates the resulting report stream.
+
+    The benchmark starts HookBenchmarkProducer as a child process that calls the hooks from several threads, and decodes
+    the reports from a FIFO (SYSPROGS_TEST_REPORTING_PIPE) or from the shared-memory ring (SYSPROGS_TEST_REPORTING_SHM).
+    The reported time includes decoding the whole stream.
+
+    Usage: HookBenchmark [pipe|shm] [thread count] [tests per thread]
+*/
+
+#include "HookBenchmark.h"
+#include "SysprogsTestReportRing.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <vector>
+
+//Checks that each thread's tests arrive in order and that no packets were lost or corrupted
+class ReportValidator : public SysprogsTestPacketDecoder
+{
+private:
+    unsigned m_TestCount;
+    std::vector<unsigned> m_NextTest;
+    bool m_SequentialCounters;
+    unsigned m_LastCounter;
+    unsigned long long m_LastTimestamp;
+
+public:
+    unsigned long long Starts, Ends, Messages, LargeMessages, Failures, Counters, Timestamps;
+    unsigned long long Errors, CounterErrors, UnorderedTimestamps;
+
+    ReportValidator(unsigned threadCount, unsigned testCount, bool sequentialCounters)
+        : m_TestCount(testCount)
+        , m_NextTest(threadCount)
+        , m_SequentialCounters(sequentialCounters)
+        , m_LastCounter(0)
+        , m_LastTimestamp(0)
+        , Starts(0), Ends(0), Messages(0), LargeMessages(0), Failures(0), Counters(0), Timestamps(0)
+        , Errors(0), CounterErrors(0), UnorderedTimestamps(0)
+    {
+    }
+
+    virtual void OnPacket(TestPacketType type, const unsigned char *pBody, unsigned size)
+    {
+        switch (type)
+        {
+        case strpTestStartingByName:
+        {
+            unsigned thread, test;
+            char name[64];
+            if (size >= sizeof(name))
+            {
+                Errors++;
+                break;
+            }
+
+            memcpy(name, pBody, size);
+            name[size] = 0;
+            if (sscanf(name, "Group.T%u_%u", &thread, &test) != 2 || thread >= m_NextTest.size() || test != m_NextTest[thread]++)
+                Errors++;
+            Starts++;
+            break;
+        }
+        case strpTestEnded:
+            Ends++;
+            break;
+        case strpOutputMessage:
+            if (size == 2 + sizeof(kBenchmarkSmallMessage) - 1)
+                Messages++;
+            else if (size == 1 + kBenchmarkLargeMessageSize)
+                LargeMessages++;
+            else
+                Errors++;
+            break;
+        case strpTestFailed:
+            Failures++;
+            break;
+        case strpTimestamp:
+        {
+            //Mirrors g_SysprogsTestReportTimestamp that the debugger uses to detect new reports
+            if (size != 4)
+            {
+                Errors++;
+                break;
+            }
+
+            unsigned counter = pBody[0] | (pBody[1] << 8) | (pBody[2] << 16) | ((unsigned)pBody[3] << 24);
+            if (m_SequentialCounters && counter != m_LastCounter + 1)
+                CounterErrors++;
+            m_LastCounter = counter;
+            Counters++;
+            break;
+        }
+        case strpClockTimestamp:
+        {
+            //Reports buffered by different threads may carry slightly out-of-order times
+            unsigned long long timestamp = 0;
+            for (unsigned i = 0; i < size && i < 8; i++)
+                timestamp |= (unsigned long long)pBody[i] << (i * 8);
+            if (size != 8)
+                Errors++;
+            else if (timestamp < m_LastTimestamp)
+                UnorderedTimestamps++;
+            m_LastTimestamp = timestamp;
+            Timestamps++;
+            break;
+        }
+        case strpReferenceAddressReport:
+        case strpTimestampFrequency:
+        case strpPerfCounters:
+            break;
+        default:
+            Errors++;
+            break;
+        }
+    }
+
+    unsigned long long GetExpectedReportCount(unsigned long long *pMessages, unsigned long long *pLargeMessages, unsigned long long *pFailures)
+    {
+        unsigned long long tests = 0;
+        *pMessages = *pLargeMessages = *pFailures = 0;
+        for (unsigned i = 0; i < m_TestCount; i++)
+        {
+            tests++;
+            if (!(i % kBenchmarkMessageInterval))
+                ++*((i % kBenchmarkLargeMessageInterval) ? pMessages : pLargeMessages);
+            if (!(i % kBenchmarkFailureInterval))
+                ++*pFailures;
+        }
+
+        unsigned long long threads = m_NextTest.size();
+        *pMessages *= threads;
+        *pLargeMessages *= threads;
+        *pFailures *= threads;
+        return tests * threads * 2 + *pMessages + *pLargeMessages + *pFailures;
+    }
+
+    bool Validate()
+    {
+        unsigned long long messages, largeMessages, failures;
+        unsigned long long tests = (unsigned long long)m_TestCount * m_NextTest.size();
+        GetExpectedReportCount(&messages, &largeMessages, &failures);
+
+        bool ok = !Errors && Starts == tests && Ends == tests && Messages == messages && LargeMessages == largeMessages && Failures == failures;
+        for (size_t i = 0; i < m_NextTest.size(); i++)
+            if (m_NextTest[i] != m_TestCount)
+                ok = false;
+
+        if (CounterErrors)
+            ok = false;
+
+        printf("Packets: %llu starts, %llu ends, %llu messages, %llu large messages, %llu failures, %llu counters (%llu out of sequence), %llu timestamps (%llu out of order), %llu errors\n",
+               Starts, Ends, Messages, LargeMessages, Failures, Counters, CounterErrors, Timestamps, UnorderedTimestamps, Errors);
+        return ok;
+    }
+};
+
+static double GetTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *pTransport = argc > 1 ? argv[1] : "pipe";
+    unsigned threadCount = argc > 2 ? atoi(argv[2]) : 1;
+    unsigned testCount = argc > 3 ? atoi(argv[3]) : 200000;
+    bool useRing = !strcmp(pTransport, "shm");
+
+    if ((!useRing && strcmp(pTransport, "pipe")) || !threadCount || !testCount)
+    {
+        fprintf(stderr, "Usage: %s [pipe|shm] [thread count] [tests per thread]\n", argv[0]);
+        return 1;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), useRing ? "/dev/shm/HookBenchmark.%d" : "/tmp/HookBenchmark.%d", (int)getpid());
+
+    SysprogsTestReportRingReader ring;
+    if (useRing ? !ring.Create(path) : mkfifo(path, 0600) != 0)
+    {
+        perror(path);
+        return 1;
+    }
+
+    char producer[PATH_MAX], threadCountText[16], testCountText[16];
+    ssize_t length = readlink("/proc/self/exe", producer, sizeof(producer) - sizeof("Producer"));
+    if (length <= 0)
+    {
+        perror("/proc/self/exe");
+        return 1;
+    }
+    strcpy(producer + length, "Producer");
+
+    snprintf(threadCountText, sizeof(threadCountText), "%u", threadCount);
+    snprintf(testCountText, sizeof(testCountText), "%u", testCount);
+
+    double start = GetTime();
+    pid_t pid = fork();
+    if (!pid)
+    {
+        setenv(useRing ? "SYSPROGS_TEST_REPORTING_SHM" : "SYSPROGS_TEST_REPORTING_PIPE", path, 1);
+        char *childArgs[] = { producer, threadCountText, testCountText, 0 };
+        execv(producer, childArgs);
+        perror(producer);
+        if (!useRing)
+            close(open(path, O_WRONLY));    //Unblocks the parent
+        _exit(127);
+    }
+
+    //The counters from concurrently published ring reports are allowed to be slightly out of order (see SysprogsTestHooks.cpp)
+    ReportValidator validator(threadCount, testCount, !useRing);
+    int status = 0;
+
+    if (useRing)
+    {
+        for (;;)
+        {
+            if (ring.Poll(validator))
+                continue;
+            if (waitpid(pid, &status, WNOHANG) == pid)
+            {
+                ring.Poll(validator);
+                break;
+            }
+            usleep(100);
+        }
+    }
+    else
+    {
+        int fd = open(path, O_RDONLY);
+        std::vector<char> buffer(1024 * 1024);
+        for (ssize_t done; fd >= 0 && (done = read(fd, &buffer[0], buffer.size())) > 0;)
+            validator.ProcessData(&buffer[0], (unsigned)done);
+        if (fd >= 0)
+            close(fd);
+        waitpid(pid, &status, 0);
+    }
+
+    double elapsed = GetTime() - start;
+    unlink(path);
+
+    unsigned long long messages, largeMessages, failures;
+    unsigned long long reports = validator.GetExpectedReportCount(&messages, &largeMessages, &failures);
+    printf("%s, %u thread(s), %u tests per thread: %.3f seconds, %.0f reports/s\n", pTransport, threadCount, testCount, elapsed, reports / elapsed);
+
+    bool ok = validator.Validate() && WIFEXITED(status) && !WEXITSTATUS(status);
+    printf("%s\n", ok ? "Report stream OK" : "Report stream INVALID");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+//Workload shared by HookBenchmarkProducer and the validator in HookBenchmark
+enum
+{
+    kBenchmarkMessageInterval = 10,         //Every 10th test outputs a message
+    kBenchmarkLargeMessageInterval = 1000,  //Every 1000th test outputs a message larger than the per-thread report buffer instead
+    kBenchmarkLargeMessageSize = 50000,     //Including the null terminator
+    kBenchmarkFailureInterval = 1000,       //Every 1000th test fails
+};
+
+static const char kBenchmarkSmallMessage[] = "Test message";
@@ -0,0 +1,69 @@
+/*
+    Calls the test hooks from several threads. Started by HookBenchmark with SYSPROGS_TEST_REPORTING_PIPE or
+    SYSPROGS_TEST_REPORTING_SHM pointing to the reader.
+
+    Usage: HookBenchmarkProducer <thread count> <tests per thread>
+*/
+
+#include "HookBenchmark.h"
+#include "SysprogsTestHooks.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+struct ProducerThreadArguments
+{
+    unsigned Index;
+    unsigned TestCount;
+    const char *pLargeMessage;
+};
+
+static void *ProducerThread(void *pContext)
+{
+    ProducerThreadArguments *pArgs = (ProducerThreadArguments *)pContext;
+    char name[32];
+
+    for (unsigned i = 0; i < pArgs->TestCount; i++)
+    {
+        snprintf(name, sizeof(name), "T%u_%u", pArgs->Index, i);
+        SysprogsTestHook_TestStartingEx2("Group", name);
+        if (!(i % kBenchmarkMessageInterval))
+            SysprogsTestHook_OutputMessage(tmsInfo, (i % kBenchmarkLargeMessageInterval) ? kBenchmarkSmallMessage : pArgs->pLargeMessage);
+        if (!(i % kBenchmarkFailureInterval))
+            SysprogsTestHook_TestFailed(0, "Summary", "Details");
+        SysprogsTestHook_TestEnded();
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: %s <thread count> <tests per thread>\n", argv[0]);
+        return 1;
+    }
+
+    unsigned threadCount = atoi(argv[1]), testCount = atoi(argv[2]);
+    std::vector<char> largeMessage(kBenchmarkLargeMessageSize, 'A');
+    largeMessage.back() = 0;
+
+    std::vector<pthread_t> threads(threadCount);
+    std::vector<ProducerThreadArguments> args(threadCount);
+    for (unsigned i = 0; i < threadCount; i++)
+    {
+        args[i].Index = i;
+        args[i].TestCount = testCount;
+        args[i].pLargeMessage = &largeMessage[0];
+        pthread_create(&threads[i], 0, ProducerThread, &args[i]);
+    }
+
+    for (unsigned i = 0; i < threadCount; i++)
+        pthread_join(threads[i], 0);
+
+    SysprogsTestHook_TestsCompleted();
+    return 0;
+}
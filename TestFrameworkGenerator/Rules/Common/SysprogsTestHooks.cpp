@@ -1,4 +1,5 @@
 #include "SysprogsTestHooks.h"
+#include <stdint.h>
 #include <string.h>
 
 #ifdef SYSPROGS_TEST_PLATFORM_EMBEDDED
@@ -9,6 +10,119 @@
 
 #include <SysprogsProfilerInterface.h>
 
+#if (defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__) || defined(__ARM_ARCH_8M_MAIN__)) && !defined(SIMULATION)
+#define SYSPROGS_TEST_HAS_TIMESTAMPS
+
+//Provided by the CMSIS system file. The timestamps are reported in CPU cycles, so the frequency is only needed to convert them to time.
+extern "C" uint32_t SystemCoreClock __attribute__((weak));
+
+/*
+    Extends the 32-bit DWT cycle counter to 64 bits. The extension assumes that the timestamps are read at least once per
+    counter overflow period (~25 seconds at 168 MHz), as the tests normally produce reports much more often.
+*/
+static unsigned long long ReadTestTimestamp()
+{
+    static unsigned s_LastCycleCount, s_Overflows;
+    volatile unsigned *pDEMCR = (volatile unsigned *)0xE000EDFC;
+    volatile unsigned *pDWT_CTRL = (volatile unsigned *)0xE0001000;
+    volatile unsigned *pDWT_CYCCNT = (volatile unsigned *)0xE0001004;
+
+    if (!(*pDWT_CTRL & 1))
+    {
+        *pDEMCR |= (1 << 24);   //TRCENA
+        *pDWT_CTRL |= 1;        //CYCCNTENA
+    }
+
+    unsigned cycles = *pDWT_CYCCNT;
+    if (cycles < s_LastCycleCount)
+        s_Overflows++;
+    s_LastCycleCount = cycles;
+    return ((unsigned long long)s_Overflows << 32) | cycles;
+}
+
+static unsigned GetTestTimestampFrequency()
+{
+    return &SystemCoreClock ? SystemCoreClock : 0;
+}
+#endif
+
+//Size of the local RAM buffer for the test reports. Set to 0 to pass every report to the profiler interface directly.
+#ifndef SYSPROGS_TEST_REPORT_BUFFER_SIZE
+#define SYSPROGS_TEST_REPORT_BUFFER_SIZE 1024
+#endif
+
+//If set to 1, reports that do not fit into the buffer are discarded (and counted) instead of waiting for the debugger
+#ifndef SYSPROGS_TEST_REPORT_DROP_ON_OVERFLOW
+#define SYSPROGS_TEST_REPORT_DROP_ON_OVERFLOW 0
+#endif
+
+//Number of strings remembered by the string interning (see strpDefineString). Set to 0 to always send the full strings.
+#ifndef SYSPROGS_TEST_INTERNED_STRING_COUNT
+#define SYSPROGS_TEST_INTERNED_STRING_COUNT 0
+#endif
+
+#if SYSPROGS_TEST_INTERNED_STRING_COUNT > 0
+#define SYSPROGS_TEST_HAS_STRING_INTERNING
+
+/*
+    Remembers the hashes of the strings sent via strpDefineString. The IDs are assigned sequentially and are never reused,
+    so once the table is full, the new strings are sent in full. The strings defined by a report that was discarded
+    (see TestReportBuffer) are forgotten, so that the host never receives a reference to a string it has not seen.
+*/
+class TestStringTable
+{
+private:
+    static unsigned long long s_Hashes[SYSPROGS_TEST_INTERNED_STRING_COUNT];
+    static unsigned s_Count, s_CommittedCount;
+
+public:
+    //64-bit FNV-1a with the length mixed in. The collisions are unlikely enough to not store the strings themselves.
+    static unsigned long long ComputeHash(const char *pString, unsigned length)
+    {
+        unsigned long long hash = 0xcbf29ce484222325ULL ^ length;
+        for (unsigned i = 0; i < length; i++)
+        {
+            hash ^= (unsigned char)pString[i];
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    //Returns -1 if the string has not been defined yet
+    static int Find(unsigned long long hash)
+    {
+        for (unsigned i = 0; i < s_Count; i++)
+            if (s_Hashes[i] == hash)
+                return i;
+        return -1;
+    }
+
+    //Returns -1 if the table is full
+    static int Add(unsigned long long hash)
+    {
+        if (s_Count >= SYSPROGS_TEST_INTERNED_STRING_COUNT)
+            return -1;
+        s_Hashes[s_Count] = hash;
+        return s_Count++;
+    }
+
+    static void Commit()
+    {
+        s_CommittedCount = s_Count;
+    }
+
+    static void Rollback()
+    {
+        s_Count = s_CommittedCount;
+    }
+};
+
+unsigned long long TestStringTable::s_Hashes[SYSPROGS_TEST_INTERNED_STRING_COUNT];
+unsigned TestStringTable::s_Count, TestStringTable::s_CommittedCount;
+#endif
+
+#if SYSPROGS_TEST_REPORT_BUFFER_SIZE == 0
+
 static void WriteTestOutput(const void *pHeader, unsigned headerSize, const void *pPayload, unsigned payloadSize)
 {
     while (!SysprogsProfiler_WriteData(pdcTestReportStream, pHeader, headerSize, pPayload, payloadSize))
@@ -17,18 +131,215 @@ static void WriteTestOutput(const void *pHeader, unsigned headerSize, const void
     }
 }
 
+static void FlushTestOutput()
+{
+}
+
 class TestOutputSynchronizer
 {
     //Nothing here, not needed on Embedded
+public:
+    TestOutputSynchronizer(bool flush = false)
+    {
+    }
+
+#ifdef SYSPROGS_TEST_HAS_STRING_INTERNING
+    ~TestOutputSynchronizer()
+    {
+        TestStringTable::Commit();
+    }
+#endif
 };
 
 #else
 
+/*
+    The hooks write the reports into a local ring buffer and only pass them to the profiler interface (without waiting)
+    once the buffer is half full. The buffer is fully flushed (waiting for the debugger if needed) when a test ends or fails.
+    In the drop mode, a report is only committed to the buffer once it has been written completely, so that a report
+    that does not fit can be discarded without corrupting the packet stream. The number of discarded bytes is then
+    reported via strpDroppedBytes.
+*/
+class TestReportBuffer
+{
+private:
+    enum
+    {
+        kSize = SYSPROGS_TEST_REPORT_BUFFER_SIZE,
+        kMaxChunkSize = 256,    //Allows partial progress if the profiler buffer is almost full
+    };
+
+    //All counters are free-running. Must be zero-initialized, as the hooks can be called before the static constructors.
+    static unsigned char s_Data[kSize];
+    static unsigned s_ReadCount, s_CommittedCount, s_WriteCount;
+    static unsigned s_ReportSize, s_DroppedBytes;
+    static bool s_ReportOverflowed;
+
+    static unsigned FreeSpace()
+    {
+        return kSize - (s_WriteCount - s_ReadCount);
+    }
+
+    static void Copy(const void *pData, unsigned size)
+    {
+        unsigned offset = s_WriteCount % kSize;
+        unsigned firstPart = (size < kSize - offset) ? size : kSize - offset;
+        memcpy(s_Data + offset, pData, firstPart);
+        memcpy(s_Data, (const char *)pData + firstPart, size - firstPart);
+        s_WriteCount += size;
+    }
+
+public:
+    //Returns false if the profiler interface did not accept the data and block is false
+    static bool Flush(bool block)
+    {
+        while (s_ReadCount != s_CommittedCount)
+        {
+            unsigned offset = s_ReadCount % kSize;
+            unsigned size = s_CommittedCount - s_ReadCount;
+            if (!block && size > kMaxChunkSize)
+                size = kMaxChunkSize;
+
+            unsigned firstPart = (size < kSize - offset) ? size : kSize - offset;
+            if (SysprogsProfiler_WriteData(pdcTestReportStream, s_Data + offset, firstPart, s_Data, size - firstPart))
+                s_ReadCount += size;
+            else if (!block)
+                return false;
+            else
+                asm("nop");
+        }
+
+        return true;
+    }
+
+    static void BeginReport()
+    {
+        s_ReportSize = 0;
+        s_ReportOverflowed = false;
+
+        if (s_DroppedBytes && FreeSpace() >= 6)
+        {
+            unsigned dropped = s_DroppedBytes;
+            unsigned char hdr[] = { 5, strpDroppedBytes, (unsigned char)(dropped), (unsigned char)(dropped >> 8), (unsigned char)(dropped >> 16), (unsigned char)(dropped >> 24) };
+            Copy(hdr, sizeof(hdr));
+            s_CommittedCount = s_WriteCount;
+            s_DroppedBytes = 0;
+        }
+    }
+
+    static void Write(const void *pData, unsigned size)
+    {
+        s_ReportSize += size;
+        if (SYSPROGS_TEST_REPORT_DROP_ON_OVERFLOW)
+        {
+            if (s_ReportOverflowed || FreeSpace() < size)
+                s_ReportOverflowed = true;
+            else
+                Copy(pData, size);
+            return;
+        }
+
+        //Blocking mode: the report can be flushed partially to make room for the rest of it
+        while (size)
+        {
+            unsigned todo = FreeSpace();
+            if (todo > size)
+                todo = size;
+
+            Copy(pData, todo);
+            pData = (const char *)pData + todo;
+            size -= todo;
+
+            if (size)
+            {
+                s_CommittedCount = s_WriteCount;
+                Flush(true);
+            }
+        }
+    }
+
+    static void EndReport(bool flush)
+    {
+        if (s_ReportOverflowed)
+        {
+            s_WriteCount = s_CommittedCount;
+            s_DroppedBytes += s_ReportSize;
+#ifdef SYSPROGS_TEST_HAS_STRING_INTERNING
+            TestStringTable::Rollback();
+#endif
+        }
+        else
+        {
+            s_CommittedCount = s_WriteCount;
+#ifdef SYSPROGS_TEST_HAS_STRING_INTERNING
+            TestStringTable::Commit();
+#endif
+        }
+
+        if (flush)
+            Flush(true);
+        else if ((s_CommittedCount - s_ReadCount) >= kSize / 2)
+            Flush(false);
+    }
+};
+
+unsigned char TestReportBuffer::s_Data[TestReportBuffer::kSize];
+unsigned TestReportBuffer::s_ReadCount, TestReportBuffer::s_CommittedCount, TestReportBuffer::s_WriteCount;
+unsigned TestReportBuffer::s_ReportSize, TestReportBuffer::s_DroppedBytes;
+bool TestReportBuffer::s_ReportOverflowed;
+
+static void WriteTestOutput(const void *pHeader, unsigned headerSize, const void *pPayload, unsigned payloadSize)
+{
+    TestReportBuffer::Write(pHeader, headerSize);
+    TestReportBuffer::Write(pPayload, payloadSize);
+}
+
+static void FlushTestOutput()
+{
+    TestReportBuffer::Flush(true);
+}
+
+class TestOutputSynchronizer
+{
+private:
+    bool m_Flush;
+
+public:
+    TestOutputSynchronizer(bool flush = false)
+        : m_Flush(flush)
+    {
+        TestReportBuffer::BeginReport();
+    }
+
+    ~TestOutputSynchronizer()
+    {
+        TestReportBuffer::EndReport(m_Flush);
+    }
+};
+
+#endif
+
+#else
+
 #include <pthread.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <new>
+#ifdef _WIN32
+struct iovec
+{
+    void *iov_base;
+    size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include "SysprogsTestReportRing.h"
+#endif
 
 #ifdef ANDROID
 #include <string.h>
@@ -88,11 +399,120 @@ static int WaitForConnectionOnLocalSocket(const char* name)
 #define O_BINARY 0
 #endif
 
+#ifndef _WIN32
+//Producer side of the shared-memory transport (see SysprogsTestReportRing.h). Does not require any locking.
+class SharedMemoryReportRing
+{
+private:
+    SysprogsTestReportRingHeader *m_pHeader;
+    unsigned m_PayloadSize;
+
+    //Returns false if the reader has closed the ring
+    bool WaitForSlot(SysprogsTestReportSlotHeader *pSlot, uint64_t position)
+    {
+        for (unsigned i = 0; __atomic_load_n(&pSlot->Sequence, __ATOMIC_ACQUIRE) != position; i++)
+        {
+            if (__atomic_load_n(&m_pHeader->ReaderState, __ATOMIC_ACQUIRE) != trrsReaderActive)
+                return false;
+            if (i >= 64)
+                sched_yield();  //The ring is full. Let the reader catch up.
+        }
+        return true;
+    }
+
+public:
+    SharedMemoryReportRing()
+        : m_pHeader(0)
+        , m_PayloadSize(0)
+    {
+    }
+
+    //pSpec is either a file path or 'fd:<inherited file descriptor>'
+    bool Attach(const char *pSpec)
+    {
+        int fd = strncmp(pSpec, "fd:", 3) ? open(pSpec, O_RDWR) : dup(atoi(pSpec + 3));
+        if (fd < 0)
+            return false;
+
+        SysprogsTestReportRingHeader header;
+        struct stat st;
+        void *pMapping = MAP_FAILED;
+        unsigned mappingSize = 0;
+
+        if (!fstat(fd, &st) && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+            header.Signature == kSysprogsTestReportRingSignature && header.Version == kSysprogsTestReportRingVersion)
+        {
+            mappingSize = SysprogsTestReportRing_GetMappingSize(header.SlotSize, header.SlotCount);
+            if (st.st_size >= mappingSize && header.SlotSize > sizeof(SysprogsTestReportSlotHeader))
+                pMapping = mmap(0, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+
+        close(fd);
+        if (pMapping == MAP_FAILED)
+            return false;
+
+        m_pHeader = (SysprogsTestReportRingHeader *)pMapping;
+        m_PayloadSize = header.SlotSize - sizeof(SysprogsTestReportSlotHeader);
+        return true;
+    }
+
+    bool IsAttached()
+    {
+        return m_pHeader != 0;
+    }
+
+    unsigned GetSlotCount(unsigned dataSize)
+    {
+        return dataSize ? (dataSize + m_PayloadSize - 1) / m_PayloadSize : 0;
+    }
+
+    //Reserves consecutive slots. The reports from different threads appear in the stream in the order of their reservations.
+    uint64_t Reserve(unsigned slotCount)
+    {
+        return __atomic_fetch_add(&m_pHeader->ReservedSlots, (uint64_t)slotCount, __ATOMIC_RELAXED);
+    }
+
+    //Copies the data into the slots reserved at the given position and publishes them
+    void Fill(uint64_t position, const struct iovec *pVectors, int count)
+    {
+        unsigned vectorOffset = 0;
+        while (count > 0)
+        {
+            SysprogsTestReportSlotHeader *pSlot = SysprogsTestReportRing_GetSlot(m_pHeader, position);
+            if (!WaitForSlot(pSlot, position))
+                return;
+
+            unsigned char *pPayload = (unsigned char *)(pSlot + 1);
+            unsigned done = 0;
+            while (count > 0 && done < m_PayloadSize)
+            {
+                unsigned todo = pVectors->iov_len - vectorOffset;
+                if (todo > m_PayloadSize - done)
+                    todo = m_PayloadSize - done;
+
+                memcpy(pPayload + done, (char *)pVectors->iov_base + vectorOffset, todo);
+                done += todo;
+                vectorOffset += todo;
+                if (vectorOffset == pVectors->iov_len)
+                    pVectors++, count--, vectorOffset = 0;
+            }
+
+            pSlot->Size = done;
+            __atomic_store_n(&pSlot->Sequence, position + 1, __ATOMIC_RELEASE);
+            position++;
+        }
+    }
+};
+#endif
+
 class TestOutputPipe
 {
 private:
     int m_Pipe;
     pthread_mutex_t m_Mutex;
+#ifndef _WIN32
+    SharedMemoryReportRing m_Ring;
+#endif
     
 public:
     TestOutputPipe()
@@ -100,7 +520,17 @@ public:
         m_Pipe = -1;
         pthread_mutex_init(&m_Mutex, 0);
      
-        const char *pPipe = getenv("SYSPROGS_TEST_REPORTING_PIPE");
+        const char *pPipe = getenv("SYSPROGS_TEST_REPORTING_SHM");
+#ifndef _WIN32
+        if (pPipe && pPipe[0])
+        {
+            if (!m_Ring.Attach(pPipe))
+                fprintf(stderr, "Cannot attach to the shared-memory test reporting ring (%s). Cannot report test status!\n", pPipe);
+            return;
+        }
+#endif
+
+        pPipe = getenv("SYSPROGS_TEST_REPORTING_PIPE");
         if (pPipe && pPipe[0])
         {
             m_Pipe = open(pPipe, O_WRONLY | O_BINARY);
@@ -130,8 +560,33 @@ public:
     }
     
     
+#ifdef _WIN32
+    bool IsSharedMemory()
+    {
+        return false;
+    }
+#else
+    bool IsSharedMemory()
+    {
+        return m_Ring.IsAttached();
+    }
+
+    SharedMemoryReportRing &GetRing()
+    {
+        return m_Ring;
+    }
+#endif
+
     void WriteTestOutput(const void *pData, unsigned dataSize)
     {
+#ifndef _WIN32
+        if (m_Ring.IsAttached())
+        {
+            struct iovec vector = { (void *)pData, dataSize };
+            WriteTestOutputV(&vector, 1);
+            return;
+        }
+#endif
         unsigned done = 0;
         while (done < dataSize)
         {
@@ -141,6 +596,48 @@ public:
             done += doneNow;
         }
     }
+
+#ifdef _WIN32
+    void WriteTestOutputV(struct iovec *pVectors, int count)
+    {
+        for (int i = 0; i < count; i++)
+            WriteTestOutput(pVectors[i].iov_base, pVectors[i].iov_len);
+    }
+#else
+    //Writes all vectors with as few syscalls as possible. Modifies the passed vectors.
+    void WriteTestOutputV(struct iovec *pVectors, int count)
+    {
+        if (m_Ring.IsAttached())
+        {
+            unsigned total = 0;
+            for (int i = 0; i < count; i++)
+                total += pVectors[i].iov_len;
+
+            unsigned slotCount = m_Ring.GetSlotCount(total);
+            m_Ring.Fill(m_Ring.Reserve(slotCount), pVectors, count);
+            return;
+        }
+
+        while (count > 0)
+        {
+            ssize_t doneNow = writev(m_Pipe, pVectors, count);
+            if (doneNow <= 0)
+                break;
+
+            while (count > 0 && (size_t)doneNow >= pVectors->iov_len)
+            {
+                doneNow -= pVectors->iov_len;
+                pVectors++, count--;
+            }
+
+            if (count > 0)
+            {
+                pVectors->iov_base = (char *)pVectors->iov_base + doneNow;
+                pVectors->iov_len -= doneNow;
+            }
+        }
+    }
+#endif
     
     void Lock()
     {
@@ -157,30 +654,322 @@ public:
 TestOutputPipe g_Pipe;
 unsigned g_SysprogsTestReportTimestamp;
 
-class TestOutputSynchronizer
+#include <time.h>
+
+#define SYSPROGS_TEST_HAS_TIMESTAMPS
+
+//Nanoseconds from an arbitrary point in the past
+static unsigned long long ReadTestTimestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned GetTestTimestampFrequency()
 {
+    return 1000000000;
+}
+
+/*
+    Each thread accumulates its reports in a separate buffer that is sent to the pipe with a single writev()
+    when a test ends or fails, or when the buffer gets full. Every flush is followed by one timestamp packet,
+    so g_SysprogsTestReportTimestamp only advances once the preceding reports have actually been written.
+
+    With the shared-memory ring, the buffer is never flushed in the middle of a report (it grows instead),
+    so the whole report can be published with a single slot reservation without taking the pipe mutex.
+    The timestamps are then derived from the slot positions: they are increasing, but not consecutive.
+*/
+class TestOutputBuffer
+{
+private:
+    enum
+    {
+        kBufferSize = 16384,
+        kTimestampPacketSize = 6,
+    };
+
+    unsigned char m_InlineData[kBufferSize + kTimestampPacketSize];
+    unsigned char *m_pData;
+    unsigned m_Size, m_Capacity;
+    bool m_PipeLocked;
+
+    static pthread_key_t s_Key;
+    static pthread_once_t s_KeyOnce;
+    static TestOutputBuffer s_SharedBuffer;
+
+    static void DestroyBuffer(void *pBuffer)
+    {
+        ((TestOutputBuffer *)pBuffer)->EndReport(true);
+        delete (TestOutputBuffer *)pBuffer;
+    }
+
+    static void CreateKey()
+    {
+        pthread_key_create(&s_Key, DestroyBuffer);
+    }
+
+    //The m_PipeLocked shortcut is only safe for the buffer owned by the calling thread. The shared buffer is locked by AcquireSharedBuffer().
+    void LockPipe()
+    {
+        if (!m_PipeLocked)
+        {
+            g_Pipe.Lock();
+            m_PipeLocked = true;
+        }
+    }
+
+    //Must be called with the pipe locked
+    void Drain(const void *pExtraData, unsigned extraDataSize)
+    {
+        struct iovec vectors[2];
+        int count = 0;
+        if (m_Size)
+        {
+            vectors[count].iov_base = m_pData;
+            vectors[count++].iov_len = m_Size;
+        }
+        if (extraDataSize)
+        {
+            vectors[count].iov_base = (void *)pExtraData;
+            vectors[count++].iov_len = extraDataSize;
+        }
+
+        g_Pipe.WriteTestOutputV(vectors, count);
+        m_Size = 0;
+    }
+
+    bool Grow(unsigned requiredSize)
+    {
+        unsigned newCapacity = m_Capacity * 2;
+        while (newCapacity < requiredSize)
+            newCapacity *= 2;
+
+        unsigned char *pNewData = (unsigned char *)malloc(newCapacity + kTimestampPacketSize);
+        if (!pNewData)
+            return false;
+
+        memcpy(pNewData, m_pData, m_Size);
+        ReleaseHeapData();
+        m_pData = pNewData;
+        m_Capacity = newCapacity;
+        return true;
+    }
+
+    void ReleaseHeapData()
+    {
+        if (m_pData != m_InlineData)
+            free(m_pData);
+        m_pData = m_InlineData;
+        m_Capacity = kBufferSize;
+    }
+
+    void WriteTimestamp(unsigned timestamp)
+    {
+        unsigned char hdr[kTimestampPacketSize] = { 5, strpTimestamp, (unsigned char)(timestamp), (unsigned char)(timestamp >> 8), (unsigned char)(timestamp >> 16), (unsigned char)(timestamp >> 24) };
+        memcpy(m_pData + m_Size, hdr, sizeof(hdr));
+        m_Size += sizeof(hdr);
+    }
+
+#ifndef _WIN32
+    void PublishToSharedMemory()
+    {
+        SharedMemoryReportRing &ring = g_Pipe.GetRing();
+        unsigned slotCount = ring.GetSlotCount(m_Size + kTimestampPacketSize);
+        uint64_t position = ring.Reserve(slotCount);
+        unsigned timestamp = (unsigned)(position + slotCount);
+
+        WriteTimestamp(timestamp);
+        struct iovec vector = { m_pData, m_Size };
+        ring.Fill(position, &vector, 1);
+        m_Size = 0;
+
+        unsigned previous = __atomic_load_n(&g_SysprogsTestReportTimestamp, __ATOMIC_RELAXED);
+        while ((int)(timestamp - previous) > 0 && !__atomic_compare_exchange_n(&g_SysprogsTestReportTimestamp, &previous, timestamp, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+        }
+    }
+#endif
+
 public:
-    TestOutputSynchronizer()
+    TestOutputBuffer()
+        : m_pData(m_InlineData)
+        , m_Size(0)
+        , m_Capacity(kBufferSize)
+        , m_PipeLocked(false)
+    {
+    }
+
+    ~TestOutputBuffer()
+    {
+        ReleaseHeapData();
+    }
+
+    //Returns NULL if the buffer could not be allocated
+    static TestOutputBuffer *GetForCurrentThread()
+    {
+        pthread_once(&s_KeyOnce, CreateKey);
+        TestOutputBuffer *pBuffer = (TestOutputBuffer *)pthread_getspecific(s_Key);
+        if (!pBuffer)
+        {
+            pBuffer = new (std::nothrow) TestOutputBuffer();
+            if (pBuffer)
+                pthread_setspecific(s_Key, pBuffer);
+        }
+        return pBuffer;
+    }
+
+    //Returns the buffer only if it was already created by this thread
+    static TestOutputBuffer *TryGetForCurrentThread()
+    {
+        pthread_once(&s_KeyOnce, CreateKey);
+        return (TestOutputBuffer *)pthread_getspecific(s_Key);
+    }
+
+    //Used if the per-thread buffer could not be allocated. The buffer is shared by all such threads, so the pipe is locked
+    //before touching it and stays locked until ReleaseSharedBuffer().
+    static TestOutputBuffer *AcquireSharedBuffer()
     {
+        pthread_once(&s_KeyOnce, CreateKey);
         g_Pipe.Lock();
+        s_SharedBuffer.m_PipeLocked = true;
+        pthread_setspecific(s_Key, &s_SharedBuffer);
+        return &s_SharedBuffer;
+    }
+
+    //Sends the report and unlocks the pipe locked by AcquireSharedBuffer()
+    static void ReleaseSharedBuffer()
+    {
+        pthread_setspecific(s_Key, 0);
+        s_SharedBuffer.EndReport(true);
+    }
+
+    void Append(const void *pData, unsigned size)
+    {
+        if (m_Size + size > m_Capacity && g_Pipe.IsSharedMemory() && !Grow(m_Size + size))
+        {
+            //Cannot split the report when using the shared memory, as other threads do not lock the pipe
+            fprintf(stderr, "Out of memory. Discarding a test report.\n");
+            return;
+        }
+
+        if (m_Size + size <= m_Capacity)
+        {
+            memcpy(m_pData + m_Size, pData, size);
+            m_Size += size;
+            return;
+        }
+
+        //Keep the pipe locked until the end of the report, so that other threads cannot interleave with its remaining part
+        LockPipe();
+        if (size <= m_Capacity)
+        {
+            Drain(0, 0);
+            memcpy(m_pData, pData, size);
+            m_Size = size;
+        }
+        else
+            Drain(pData, size);
+    }
+
+    void EndReport(bool flush)
+    {
+        if (!flush && !m_PipeLocked)
+            return;
+
+        if (!m_Size && !m_PipeLocked)
+            return;
+
+#ifndef _WIN32
+        if (g_Pipe.IsSharedMemory())
+        {
+            if (m_Size)
+                PublishToSharedMemory();
+            ReleaseHeapData();
+        }
+        else
+#endif
+        {
+            LockPipe();
+            WriteTimestamp(g_SysprogsTestReportTimestamp + 1);
+            Drain(0, 0);
+            g_SysprogsTestReportTimestamp++;
+        }
+
+        if (m_PipeLocked)
+        {
+            m_PipeLocked = false;
+            g_Pipe.Unlock();
+        }
+    }
+};
+
+pthread_key_t TestOutputBuffer::s_Key;
+pthread_once_t TestOutputBuffer::s_KeyOnce = PTHREAD_ONCE_INIT;
+TestOutputBuffer TestOutputBuffer::s_SharedBuffer;
+
+class TestOutputSynchronizer
+{
+private:
+    TestOutputBuffer *m_pBuffer;
+    bool m_Flush, m_Shared;
+
+public:
+    TestOutputSynchronizer(bool flush = false)
+        : m_pBuffer(TestOutputBuffer::GetForCurrentThread())
+        , m_Flush(flush)
+        , m_Shared(false)
+    {
+        if (!m_pBuffer)
+        {
+            m_pBuffer = TestOutputBuffer::AcquireSharedBuffer();
+            m_Shared = true;
+        }
     }
     
     ~TestOutputSynchronizer()
     {
-        unsigned timestamp = g_SysprogsTestReportTimestamp + 1;
-        unsigned char hdr[] = { 5, strpTimestamp, (unsigned char)(timestamp), (unsigned char)(timestamp >> 8), (unsigned char)(timestamp >> 16), (unsigned char)(timestamp >> 24) };
-        g_Pipe.WriteTestOutput(&hdr, sizeof(hdr));
-        g_SysprogsTestReportTimestamp = timestamp;
-        g_Pipe.Unlock();
+        if (m_Shared)
+            TestOutputBuffer::ReleaseSharedBuffer();
+        else
+            m_pBuffer->EndReport(m_Flush);
     }
 };
 
 static void WriteTestOutput(const void *pHeader, unsigned headerSize, const void *pPayload, unsigned payloadSize)
 {
-    g_Pipe.WriteTestOutput(pHeader, headerSize);
-    g_Pipe.WriteTestOutput(pPayload, payloadSize);
+    TestOutputBuffer *pBuffer = TestOutputBuffer::TryGetForCurrentThread();
+    if (pBuffer)
+    {
+        pBuffer->Append(pHeader, headerSize);
+        pBuffer->Append(pPayload, payloadSize);
+    }
+    else
+    {
+        g_Pipe.WriteTestOutput(pHeader, headerSize);
+        g_Pipe.WriteTestOutput(pPayload, payloadSize);
+    }
+}
+
+static void FlushTestOutput()
+{
+    TestOutputBuffer *pBuffer = TestOutputBuffer::TryGetForCurrentThread();
+    if (pBuffer)
+        pBuffer->EndReport(true);
 }
 
+//Per-thread buffers are flushed by the pthread key destructor, except for the main thread that calls exit() instead
+class MainThreadOutputFlusher
+{
+public:
+    ~MainThreadOutputFlusher()
+    {
+        FlushTestOutput();
+    }
+};
+
+static MainThreadOutputFlusher s_MainThreadOutputFlusher;
+
 
 #endif
 
@@ -198,6 +987,320 @@ static void WriteTestPacketSize(unsigned size, const void *pExtraData, unsigned
     }
 }
 
+//Records the current time, so that the host can compute per-test durations. The clock frequency is reported once before the first clock timestamp.
+static void WriteTestClockTimestamp()
+{
+#ifdef SYSPROGS_TEST_HAS_TIMESTAMPS
+    static bool s_FrequencyReported = false;
+    unsigned char hdr[10];
+    if (!s_FrequencyReported)
+    {
+        s_FrequencyReported = true;
+        unsigned frequency = GetTestTimestampFrequency();
+        if (frequency)
+        {
+            hdr[0] = 5;
+            hdr[1] = strpTimestampFrequency;
+            for (int i = 0; i < 4; i++)
+                hdr[2 + i] = (unsigned char)(frequency >> (i * 8));
+            WriteTestOutput(hdr, 6, 0, 0);
+        }
+    }
+
+    unsigned long long timestamp = ReadTestTimestamp();
+    hdr[0] = 9;
+    hdr[1] = strpClockTimestamp;
+    for (int i = 0; i < 8; i++)
+        hdr[2 + i] = (unsigned char)(timestamp >> (i * 8));
+    WriteTestOutput(hdr, sizeof(hdr), 0, 0);
+#endif
+}
+
+//Set to 1 to report the per-test performance counters via strpPerfCounters. When set to 0, no counters are collected.
+#ifndef SYSPROGS_TEST_REPORT_PERF_COUNTERS
+#define SYSPROGS_TEST_REPORT_PERF_COUNTERS 0
+#endif
+
+#if SYSPROGS_TEST_REPORT_PERF_COUNTERS
+
+/*
+    Embedded only: number of bytes below the stack pointer that are filled with a pattern when a test starts
+    and checked for modifications when it ends. The region must not overlap the heap or other data.
+*/
+#ifndef SYSPROGS_TEST_STACK_MEASURE_SIZE
+#define SYSPROGS_TEST_STACK_MEASURE_SIZE 0
+#endif
+
+#if defined(_NEWLIB_VERSION) || defined(__GLIBC__)
+#include <malloc.h>
+#define SYSPROGS_TEST_HAS_HEAP_STATISTICS
+#endif
+
+#if defined(__linux__) && !defined(SYSPROGS_TEST_PLATFORM_EMBEDDED)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#define SYSPROGS_TEST_HAS_PERF_EVENTS
+#endif
+
+/*
+    Collects the counters reported via strpPerfCounters. On Cortex-M, the cycles come from the DWT cycle counter
+    (the 8-bit DWT CPI/LSU/fold counters wrap too quickly to produce per-test totals). On Linux hosts, the cycles
+    and the retired instructions of the calling thread are counted via perf_event_open() if the kernel allows it.
+    The members are zero-initialized and the events are opened on first use, so no constructor is needed.
+*/
+class TestPerfCounters
+{
+private:
+    enum
+    {
+        kMaxCounters = 5,
+        kMaxPacketSize = 2 + kMaxCounters * 9,
+    };
+
+    bool m_HasCycles, m_HasInstructions;
+    unsigned long long m_StartCycles, m_StartInstructions;
+
+#ifdef SYSPROGS_TEST_HAS_PERF_EVENTS
+    bool m_EventsOpened;
+    int m_CyclesEvent, m_InstructionsEvent;
+
+    static pthread_key_t s_Key;
+    static pthread_once_t s_KeyOnce;
+
+    static int OpenPerfEvent(unsigned long long config)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    static bool ReadPerfEvent(int fd, unsigned long long &value)
+    {
+        return fd >= 0 && read(fd, &value, sizeof(value)) == sizeof(value);
+    }
+
+    static void DestroyCounters(void *pCounters)
+    {
+        TestPerfCounters *pThis = (TestPerfCounters *)pCounters;
+        if (pThis->m_CyclesEvent >= 0)
+            close(pThis->m_CyclesEvent);
+        if (pThis->m_InstructionsEvent >= 0)
+            close(pThis->m_InstructionsEvent);
+        delete pThis;
+    }
+
+    static void CreateKey()
+    {
+        pthread_key_create(&s_Key, DestroyCounters);
+    }
+#else
+    static TestPerfCounters s_Counters;
+#endif
+
+#if defined(SYSPROGS_TEST_PLATFORM_EMBEDDED) && SYSPROGS_TEST_STACK_MEASURE_SIZE > 0
+    static const unsigned kStackPattern = 0xA5A5A5A5;
+    volatile unsigned *m_pStackBottom, *m_pStackTop;
+
+    //The painted region starts slightly below the frame of this function, so that returning from the hooks does not modify it
+    void __attribute__((noinline)) PaintStack()
+    {
+        volatile unsigned marker = 0;
+        m_pStackTop = (volatile unsigned *)((unsigned long)&marker & ~3UL) - 16;
+        m_pStackBottom = m_pStackTop - SYSPROGS_TEST_STACK_MEASURE_SIZE / 4;
+        for (volatile unsigned *p = m_pStackBottom; p < m_pStackTop; p++)
+            *p = kStackPattern;
+    }
+
+    unsigned GetStackHighWater()
+    {
+        volatile unsigned *p = m_pStackBottom;
+        while (p < m_pStackTop && *p == kStackPattern)
+            p++;
+        return (unsigned)(m_pStackTop - p) * 4;
+    }
+#endif
+
+    bool ReadCycles(unsigned long long &value)
+    {
+#if defined(SYSPROGS_TEST_PLATFORM_EMBEDDED) && defined(SYSPROGS_TEST_HAS_TIMESTAMPS)
+        value = ReadTestTimestamp();
+        return true;
+#elif defined(SYSPROGS_TEST_HAS_PERF_EVENTS)
+        return ReadPerfEvent(m_CyclesEvent, value);
+#else
+        return false;
+#endif
+    }
+
+    bool ReadInstructions(unsigned long long &value)
+    {
+#ifdef SYSPROGS_TEST_HAS_PERF_EVENTS
+        return ReadPerfEvent(m_InstructionsEvent, value);
+#else
+        return false;
+#endif
+    }
+
+    static void AppendCounter(unsigned char *pPacket, unsigned &size, TestPerfCounterType type, unsigned long long value)
+    {
+        pPacket[size++] = (unsigned char)type;
+        for (int i = 0; i < 8; i++)
+            pPacket[size++] = (unsigned char)(value >> (i * 8));
+    }
+
+public:
+    //Returns NULL if the counters could not be allocated
+    static TestPerfCounters *GetForCurrentThread()
+    {
+#ifdef SYSPROGS_TEST_HAS_PERF_EVENTS
+        pthread_once(&s_KeyOnce, CreateKey);
+        TestPerfCounters *pCounters = (TestPerfCounters *)pthread_getspecific(s_Key);
+        if (!pCounters)
+        {
+            pCounters = new (std::nothrow) TestPerfCounters();
+            if (pCounters)
+                pthread_setspecific(s_Key, pCounters);
+        }
+        return pCounters;
+#else
+        return &s_Counters;
+#endif
+    }
+
+    void Start()
+    {
+#ifdef SYSPROGS_TEST_HAS_PERF_EVENTS
+        if (!m_EventsOpened)
+        {
+            m_EventsOpened = true;
+            m_CyclesEvent = OpenPerfEvent(PERF_COUNT_HW_CPU_CYCLES);
+            m_InstructionsEvent = OpenPerfEvent(PERF_COUNT_HW_INSTRUCTIONS);
+        }
+#endif
+#if defined(SYSPROGS_TEST_PLATFORM_EMBEDDED) && SYSPROGS_TEST_STACK_MEASURE_SIZE > 0
+        PaintStack();
+#endif
+        m_HasInstructions = ReadInstructions(m_StartInstructions);
+        m_HasCycles = ReadCycles(m_StartCycles);
+    }
+
+    //Must be called inside a TestOutputSynchronizer block
+    void Report()
+    {
+        unsigned long long cycles = 0, instructions = 0;
+        bool hasCycles = m_HasCycles && ReadCycles(cycles);
+        bool hasInstructions = m_HasInstructions && ReadInstructions(instructions);
+
+        unsigned char packet[kMaxPacketSize];
+        unsigned size = 2;
+        packet[1] = strpPerfCounters;
+
+        if (hasCycles)
+            AppendCounter(packet, size, tpcCycles, cycles - m_StartCycles);
+        if (hasInstructions)
+            AppendCounter(packet, size, tpcInstructions, instructions - m_StartInstructions);
+        m_HasCycles = m_HasInstructions = false;
+
+        //Checked before calling into the allocator, as its stack usage would be attributed to the test
+#if defined(SYSPROGS_TEST_PLATFORM_EMBEDDED) && SYSPROGS_TEST_STACK_MEASURE_SIZE > 0
+        if (m_pStackTop)
+            AppendCounter(packet, size, tpcStackHighWater, GetStackHighWater());
+#endif
+
+#ifdef SYSPROGS_TEST_HAS_HEAP_STATISTICS
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+        struct mallinfo2 info = mallinfo2();
+#else
+        struct mallinfo info = mallinfo();
+#endif
+        AppendCounter(packet, size, tpcHeapBytesInUse, (unsigned long)info.uordblks);
+        if (info.usmblks)
+            AppendCounter(packet, size, tpcHeapPeakBytes, (unsigned long)info.usmblks);
+#endif
+
+        if (size > 2)
+        {
+            packet[0] = (unsigned char)(size - 1);
+            WriteTestOutput(packet, size, 0, 0);
+        }
+    }
+};
+
+#ifdef SYSPROGS_TEST_HAS_PERF_EVENTS
+pthread_key_t TestPerfCounters::s_Key;
+pthread_once_t TestPerfCounters::s_KeyOnce = PTHREAD_ONCE_INIT;
+#else
+TestPerfCounters TestPerfCounters::s_Counters;
+#endif
+
+//Must be declared before the TestOutputSynchronizer, so that the counters only start once the report has been written
+class TestPerfCounterStarter
+{
+public:
+    ~TestPerfCounterStarter()
+    {
+        TestPerfCounters *pCounters = TestPerfCounters::GetForCurrentThread();
+        if (pCounters)
+            pCounters->Start();
+    }
+};
+
+static void WriteTestPerfCounters()
+{
+    TestPerfCounters *pCounters = TestPerfCounters::GetForCurrentThread();
+    if (pCounters)
+        pCounters->Report();
+}
+
+#else
+
+class TestPerfCounterStarter
+{
+public:
+    ~TestPerfCounterStarter()
+    {
+    }
+};
+
+static inline void WriteTestPerfCounters()
+{
+}
+
+#endif
+
+#ifdef SYSPROGS_TEST_HAS_STRING_INTERNING
+//Returns the ID of the interned string, defining it first if needed. Returns -1 if the string should be sent in full.
+static int InternTestString(const char *pString, unsigned length)
+{
+    if (length < 4)
+        return -1;  //Not worth a reference
+
+    unsigned long long hash = TestStringTable::ComputeHash(pString, length);
+    int id = TestStringTable::Find(hash);
+    if (id >= 0)
+        return id;
+
+    id = TestStringTable::Add(hash);
+    if (id < 0)
+        return -1;
+
+    unsigned char hdr[] = { strpDefineString, (unsigned char)id, (unsigned char)(id >> 8) };
+    WriteTestPacketSize(length + sizeof(hdr), &hdr, sizeof(hdr));
+    WriteTestOutput(pString, length, 0, 0);
+    return id;
+}
+#else
+static inline int InternTestString(const char *pString, unsigned length)
+{
+    return -1;
+}
+#endif
+
 void __attribute__((noinline)) SysprogsTestHook_SelectTests(int testCount, void **pTests)
 {
     asm("nop");
@@ -215,6 +1318,7 @@ extern "C" int main();
 void __attribute__((noinline)) SysprogsTestHook_TestStarting(void *pTest)
 {
 	static bool s_ReferenceAddressReported = false;
+    TestPerfCounterStarter perfCounters;
     TestOutputSynchronizer sync;
 #ifndef __ICCARM__
 	if (!s_ReferenceAddressReported)
@@ -227,33 +1331,51 @@ void __attribute__((noinline)) SysprogsTestHook_TestStarting(void *pTest)
 #endif
     unsigned char hdr[] = { 1 + sizeof(pTest), strpTestStartingByID };
     WriteTestOutput(&hdr, sizeof(hdr), &pTest, sizeof(pTest));
+    WriteTestClockTimestamp();
 }
 
 void __attribute__((noinline)) SysprogsTestHook_TestStartingEx(const char *pFullyQualifiedName)
 {
+    TestPerfCounterStarter perfCounters;
     TestOutputSynchronizer sync;
     int nameLength = strlen(pFullyQualifiedName);
     unsigned char type = strpTestStartingByName;
     WriteTestPacketSize(nameLength + 1, &type, 1);
     WriteTestOutput(pFullyQualifiedName, nameLength, 0, 0);
+    WriteTestClockTimestamp();
 }
 
 void __attribute__((noinline)) SysprogsTestHook_TestStartingEx2(const char *pGroupName, const char *pTestName)
 {
+    TestPerfCounterStarter perfCounters;
     TestOutputSynchronizer sync;
-	int nameLength = strlen(pGroupName) + 1 + strlen(pTestName);
-    unsigned char type = strpTestStartingByName;
-    WriteTestPacketSize(nameLength + 1, &type, 1);
-	WriteTestOutput(pGroupName, strlen(pGroupName), ".", 1);
-	WriteTestOutput(pTestName, strlen(pTestName), 0, 0);
+    int groupID = InternTestString(pGroupName, strlen(pGroupName));
+    if (groupID >= 0)
+    {
+        int testNameLength = strlen(pTestName);
+        unsigned char hdr[] = { strpTestStartingInGroup, (unsigned char)groupID, (unsigned char)(groupID >> 8) };
+        WriteTestPacketSize(testNameLength + sizeof(hdr), &hdr, sizeof(hdr));
+        WriteTestOutput(pTestName, testNameLength, 0, 0);
+    }
+    else
+    {
+        int nameLength = strlen(pGroupName) + 1 + strlen(pTestName);
+        unsigned char type = strpTestStartingByName;
+        WriteTestPacketSize(nameLength + 1, &type, 1);
+        WriteTestOutput(pGroupName, strlen(pGroupName), ".", 1);
+        WriteTestOutput(pTestName, strlen(pTestName), 0, 0);
+    }
+    WriteTestClockTimestamp();
 }
 
 void __attribute__((noinline)) SysprogsTestHook_TestEnded()
 {
-    TestOutputSynchronizer sync;
+    TestOutputSynchronizer sync(true);
+    WriteTestPerfCounters();
     
     const char hdr[] = { 1, strpTestEnded };
     WriteTestOutput(&hdr, sizeof(hdr), 0, 0);
+    WriteTestClockTimestamp();
 }
 
 void __attribute__((noinline)) SysprogsTestHook_OutputMessage(TestMessageSeverity severity, const char *pMessage)
@@ -273,20 +1395,38 @@ void __attribute__((noinline)) SysprogsTestHook_OutputMessageEx(TestMessageSever
 
 void __attribute__((noinline)) SysprogsTestHook_TestFailed(void *pTest, const char *pSummary, const char *pDetails)
 {
-    TestOutputSynchronizer sync;
+    TestOutputSynchronizer sync(true);
     
-    int summaryLen = pSummary ? strlen(pSummary) + 2 : 0;
-    int detailsLen = pDetails ? strlen(pDetails) + 2 : 0;
+    //The strings must be defined before the packet that references them
+    int summaryID = pSummary ? InternTestString(pSummary, strlen(pSummary)) : -1;
+    int detailsID = pDetails ? InternTestString(pDetails, strlen(pDetails)) : -1;
+    if (summaryID >= 0)
+        pSummary = 0;
+    if (detailsID >= 0)
+        pDetails = 0;
+
+    int summaryLen = pSummary ? strlen(pSummary) + 2 : (summaryID >= 0 ? 3 : 0);
+    int detailsLen = pDetails ? strlen(pDetails) + 2 : (detailsID >= 0 ? 3 : 0);
     const unsigned char hdr[] = { strpTestFailed };
     WriteTestPacketSize(sizeof(hdr) + summaryLen + detailsLen, &hdr, sizeof(hdr));
     unsigned char ch;
-    if (pSummary)
+    if (summaryID >= 0)
+    {
+        unsigned char obj[] = { totInternedErrorSummary, (unsigned char)summaryID, (unsigned char)(summaryID >> 8) };
+        WriteTestOutput(&obj, sizeof(obj), 0, 0);
+    }
+    else if (pSummary)
     {
         ch = totErrorSummary;   
         WriteTestOutput(&ch, 1, 0, 0);
         WriteTestOutput(pSummary, summaryLen - 2, "", 1);
     }
-    if (pDetails)
+    if (detailsID >= 0)
+    {
+        unsigned char obj[] = { totInternedErrorDetails, (unsigned char)detailsID, (unsigned char)(detailsID >> 8) };
+        WriteTestOutput(&obj, sizeof(obj), 0, 0);
+    }
+    else if (pDetails)
     {
         ch = totErrorDetails;   
         WriteTestOutput(&ch, 1, 0, 0);
@@ -294,8 +1434,66 @@ void __attribute__((noinline)) SysprogsTestHook_TestFailed(void *pTest, const ch
     }
 }
 
+//The format string is not sent. The host reads it from the ELF file and formats the message using the raw arguments.
+void __attribute__((noinline)) SysprogsTestHook_TestFailedDeferred(void *pTest, const char *pFormat, const void *pArguments, int argumentsSize)
+{
+    TestOutputSynchronizer sync(true);
+
+    const unsigned char hdr[] = { strpTestFailed, totDeferredErrorSummary };
+    WriteTestPacketSize(sizeof(hdr) + sizeof(pFormat) + argumentsSize, &hdr, sizeof(hdr));
+    WriteTestOutput(&pFormat, sizeof(pFormat), pArguments, argumentsSize);
+}
+
+void __attribute__((noinline)) SysprogsTestHook_TestFailedWithValues(void *pTest, const char *pSummary, const char *pFile, int line, const TestReportedValue *pValues, int valueCount)
+{
+    TestOutputSynchronizer sync(true);
+
+    int summaryID = pSummary ? InternTestString(pSummary, strlen(pSummary)) : -1;
+    if (summaryID >= 0)
+        pSummary = 0;
+
+    int summaryLen = pSummary ? strlen(pSummary) + 2 : (summaryID >= 0 ? 3 : 0);
+    int locationLen = pFile ? strlen(pFile) + 2 + sizeof(int) : 0;
+    int valuesLen = valueCount ? 2 : 0;
+    for (int i = 0; i < valueCount; i++)
+        valuesLen += 1 + sizeof(unsigned) + pValues[i].Size;
+
+    const unsigned char hdr[] = { strpTestFailed };
+    WriteTestPacketSize(sizeof(hdr) + summaryLen + locationLen + valuesLen, &hdr, sizeof(hdr));
+    unsigned char ch;
+    if (summaryID >= 0)
+    {
+        unsigned char obj[] = { totInternedErrorSummary, (unsigned char)summaryID, (unsigned char)(summaryID >> 8) };
+        WriteTestOutput(&obj, sizeof(obj), 0, 0);
+    }
+    else if (pSummary)
+    {
+        ch = totErrorSummary;
+        WriteTestOutput(&ch, 1, 0, 0);
+        WriteTestOutput(pSummary, summaryLen - 2, "", 1);
+    }
+    if (pFile)
+    {
+        ch = totCodeLocation;
+        WriteTestOutput(&ch, 1, pFile, locationLen - 1 - sizeof(int));
+        WriteTestOutput(&line, sizeof(int), 0, 0);
+    }
+    if (valueCount)
+    {
+        unsigned char obj[] = { totComparedValues, (unsigned char)valueCount };
+        WriteTestOutput(&obj, sizeof(obj), 0, 0);
+        for (int i = 0; i < valueCount; i++)
+        {
+            unsigned char valueHdr[1 + sizeof(unsigned)] = { (unsigned char)pValues[i].Type };
+            memcpy(valueHdr + 1, &pValues[i].Size, sizeof(unsigned));
+            WriteTestOutput(&valueHdr, sizeof(valueHdr), pValues[i].pData, pValues[i].Size);
+        }
+    }
+}
+
 void __attribute__((noinline)) SysprogsTestHook_TestsCompleted()
 {
+    FlushTestOutput();
     asm("nop");
 }
 
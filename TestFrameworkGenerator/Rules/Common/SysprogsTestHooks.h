@@ -22,6 +22,12 @@ enum TestPacketType
     strpTestFailed,                 //Arguments: a sequence of test objects prefixed by 1-byte TestObjectType
     strpTimestamp,                  //Arguments: 32-bit or 64-bit timestamp
 	strpReferenceAddressReport,		//Arguments: 32-bit or 64-bit reference address (used to support relocatable executables)
+    strpDroppedBytes,               //Arguments: 32-bit number of report bytes discarded because the embedded report buffer was full
+    strpTimestampFrequency,         //Arguments: 32-bit number of strpClockTimestamp ticks per second (reported once)
+    strpClockTimestamp,             //Arguments: 64-bit time in strpTimestampFrequency units (sent when a test starts and when it ends)
+    strpPerfCounters,               //Arguments: a sequence of 64-bit counter values prefixed by 1-byte TestPerfCounterType (sent before strpTestEnded)
+    strpDefineString,               //Arguments: 16-bit string ID, string (not null-terminated). Defines an interned string referenced by the later packets.
+    strpTestStartingInGroup,        //Arguments: 16-bit interned group name ID, test name
 };
 
 enum TestObjectType
@@ -29,7 +35,41 @@ enum TestObjectType
     totErrorSummary,    //null-terminated message
     totErrorDetails,    //same
     totCodeLocation,    //<null-terminated file><line:32 bits>
-    totCallStack        //<frame count: 8 bits> <array of file/line pairs>
+    totCallStack,       //<frame count: 8 bits> <array of file/line pairs>
+    totInternedErrorSummary,    //<16-bit interned string ID>
+    totInternedErrorDetails,    //same
+    totDeferredErrorSummary,    //<format string address: pointer-sized> <arguments until the end of the packet: integers and pointers
+                                //in their promoted size, floating-point values as 64-bit doubles, strings null-terminated>
+    totComparedValues,          //<value count: 8 bits> <array of [TestValueType: 8 bits] [size: 32 bits] [data]>: expected, actual, optional extra values
+};
+
+//Values are reported in the target's byte order
+enum TestValueType
+{
+    tvtSignedInteger,   //1, 2, 4 or 8 bytes
+    tvtUnsignedInteger, //same
+    tvtBoolean,         //1 byte
+    tvtFloat,           //IEEE 754, 4 or 8 bytes
+    tvtPointer,         //4 or 8 bytes
+    tvtString,          //text without the null terminator (may be truncated)
+    tvtMemoryBlock,     //raw bytes. Block comparisons report the expected and actual windows followed by the window offset and the compared size.
+};
+
+struct TestReportedValue
+{
+    TestValueType Type;
+    const void *pData;
+    unsigned Size;
+};
+
+//Only the counters supported by the current platform are reported
+enum TestPerfCounterType
+{
+    tpcCycles,              //CPU cycles spent in the test
+    tpcInstructions,        //Instructions retired during the test
+    tpcHeapBytesInUse,      //Heap bytes allocated when the test ended
+    tpcHeapPeakBytes,       //Maximum heap size reported by the allocator since the program start
+    tpcStackHighWater,      //Maximum stack depth reached by the test (relative to the stack pointer when it started)
 };
 
 extern "C"
@@ -42,6 +82,8 @@ extern "C"
 	void __attribute__((noinline)) SysprogsTestHook_OutputMessage(TestMessageSeverity severity, const char *pMessage);
 	void __attribute__((noinline)) SysprogsTestHook_OutputMessageEx(TestMessageSeverity severity, const char *pMessage, int size);
     void __attribute__((noinline)) SysprogsTestHook_TestFailed(void *pTest, const char *pSummary, const char *pDetails);
+    void __attribute__((noinline)) SysprogsTestHook_TestFailedDeferred(void *pTest, const char *pFormat, const void *pArguments, int argumentsSize);
+    void __attribute__((noinline)) SysprogsTestHook_TestFailedWithValues(void *pTest, const char *pSummary, const char *pFile, int line, const TestReportedValue *pValues, int valueCount);
     void __attribute__((noinline)) SysprogsTestHook_TestsCompleted();
 	
 	int IsRunningUnitTests();
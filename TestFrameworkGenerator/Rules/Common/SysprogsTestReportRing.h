@@ -0,0 +1,246 @@
+#pragma once
+
+/*
+    Shared-memory transport for the test reports (host/Linux only).
+
+    The reader creates a file (e.g. in /dev/shm) or a memfd with SysprogsTestReportRingReader::Create() and passes it
+    to the test process via SYSPROGS_TEST_REPORTING_SHM=<path> or SYSPROGS_TEST_REPORTING_SHM=fd:<inherited fd>.
+
+    The mapping starts with SysprogsTestReportRingHeader followed by SlotCount slots of SlotSize bytes. Each slot starts
+    with SysprogsTestReportSlotHeader. Test threads reserve consecutive slot positions by atomically incrementing
+    ReservedSlots, fill them and publish each one by setting its Sequence to (position + 1). The reader consumes the slots
+    in order and returns them to the producers by setting Sequence to (position + SlotCount).
+    Concatenating the slot payloads in order yields the same TestPacketType stream as the pipe transport.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SysprogsTestHooks.h"
+
+enum
+{
+    kSysprogsTestReportRingSignature = 0x52525453,   //'STRR'
+    kSysprogsTestReportRingVersion = 1,
+};
+
+enum SysprogsTestReportRingState
+{
+    trrsInitializing = 0,
+    trrsReaderActive,
+    trrsReaderClosed,   //Producers will discard the reports instead of waiting for free slots
+};
+
+struct SysprogsTestReportRingHeader
+{
+    uint32_t Signature;     //Written last by the reader
+    uint32_t Version;
+    uint32_t SlotSize;      //Including SysprogsTestReportSlotHeader, multiple of 8
+    uint32_t SlotCount;     //Power of 2
+    uint64_t ReservedSlots;
+    uint32_t ReaderState;
+    uint32_t Reserved[9];
+};
+
+struct SysprogsTestReportSlotHeader
+{
+    uint64_t Sequence;
+    uint32_t Size;
+    uint32_t Reserved;
+};
+
+static inline unsigned SysprogsTestReportRing_GetMappingSize(unsigned slotSize, unsigned slotCount)
+{
+    return sizeof(SysprogsTestReportRingHeader) + slotSize * slotCount;
+}
+
+static inline SysprogsTestReportSlotHeader *SysprogsTestReportRing_GetSlot(SysprogsTestReportRingHeader *pHeader, uint64_t position)
+{
+    unsigned index = (unsigned)(position & (pHeader->SlotCount - 1));
+    return (SysprogsTestReportSlotHeader *)((char *)(pHeader + 1) + index * pHeader->SlotSize);
+}
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+//Splits a byte stream into individual test packets (see the packet format in SysprogsTestHooks.h)
+class SysprogsTestPacketDecoder
+{
+private:
+    unsigned char *m_pBuffer;
+    unsigned m_Size, m_Capacity;
+
+public:
+    SysprogsTestPacketDecoder()
+        : m_pBuffer(0)
+        , m_Size(0)
+        , m_Capacity(0)
+    {
+    }
+
+    virtual ~SysprogsTestPacketDecoder()
+    {
+        free(m_pBuffer);
+    }
+
+    //pBody points to the packet-specific arguments (after the type byte)
+    virtual void OnPacket(TestPacketType type, const unsigned char *pBody, unsigned size) = 0;
+
+    //Returns false if the allocation of the reassembly buffer failed
+    bool ProcessData(const void *pData, unsigned size)
+    {
+        if (m_Size + size > m_Capacity)
+        {
+            unsigned newCapacity = m_Capacity ? m_Capacity : 4096;
+            while (newCapacity < m_Size + size)
+                newCapacity *= 2;
+
+            unsigned char *pNewBuffer = (unsigned char *)realloc(m_pBuffer, newCapacity);
+            if (!pNewBuffer)
+                return false;
+            m_pBuffer = pNewBuffer;
+            m_Capacity = newCapacity;
+        }
+
+        memcpy(m_pBuffer + m_Size, pData, size);
+        m_Size += size;
+
+        unsigned offset = 0;
+        for (;;)
+        {
+            unsigned headerSize = 1, packetSize;
+            if (offset + headerSize > m_Size)
+                break;
+
+            packetSize = m_pBuffer[offset];
+            if (packetSize == 0xFF)
+            {
+                headerSize = 5;
+                if (offset + headerSize > m_Size)
+                    break;
+                packetSize = m_pBuffer[offset + 1] | (m_pBuffer[offset + 2] << 8) | (m_pBuffer[offset + 3] << 16) | ((unsigned)m_pBuffer[offset + 4] << 24);
+            }
+
+            if (offset + headerSize + packetSize > m_Size)
+                break;
+
+            if (packetSize > 0)
+                OnPacket((TestPacketType)m_pBuffer[offset + headerSize], m_pBuffer + offset + headerSize + 1, packetSize - 1);
+
+            offset += headerSize + packetSize;
+        }
+
+        memmove(m_pBuffer, m_pBuffer + offset, m_Size - offset);
+        m_Size -= offset;
+        return true;
+    }
+};
+
+class SysprogsTestReportRingReader
+{
+private:
+    SysprogsTestReportRingHeader *m_pHeader;
+    unsigned m_MappingSize;
+    uint64_t m_Position;
+
+public:
+    SysprogsTestReportRingReader()
+        : m_pHeader(0)
+        , m_MappingSize(0)
+        , m_Position(0)
+    {
+    }
+
+    ~SysprogsTestReportRingReader()
+    {
+        Close();
+    }
+
+    //slotSize must be a multiple of 8 and slotCount must be a power of 2. The file descriptor can be closed afterwards.
+    bool Create(int fd, unsigned slotSize = 4096, unsigned slotCount = 1024)
+    {
+        if ((slotSize % 8) || slotSize <= sizeof(SysprogsTestReportSlotHeader) || !slotCount || (slotCount & (slotCount - 1)))
+            return false;
+
+        unsigned mappingSize = SysprogsTestReportRing_GetMappingSize(slotSize, slotCount);
+        if (ftruncate(fd, mappingSize))
+            return false;
+
+        void *pMapping = mmap(0, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (pMapping == MAP_FAILED)
+            return false;
+
+        Close();
+        m_pHeader = (SysprogsTestReportRingHeader *)pMapping;
+        m_MappingSize = mappingSize;
+        m_Position = 0;
+
+        memset(m_pHeader, 0, sizeof(*m_pHeader));
+        m_pHeader->Version = kSysprogsTestReportRingVersion;
+        m_pHeader->SlotSize = slotSize;
+        m_pHeader->SlotCount = slotCount;
+        m_pHeader->ReaderState = trrsReaderActive;
+        for (unsigned i = 0; i < slotCount; i++)
+        {
+            SysprogsTestReportSlotHeader *pSlot = SysprogsTestReportRing_GetSlot(m_pHeader, i);
+            pSlot->Sequence = i;
+            pSlot->Size = 0;
+        }
+
+        __atomic_store_n(&m_pHeader->Signature, (uint32_t)kSysprogsTestReportRingSignature, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    bool Create(const char *pPath, unsigned slotSize = 4096, unsigned slotCount = 1024)
+    {
+        int fd = open(pPath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+            return false;
+
+        bool result = Create(fd, slotSize, slotCount);
+        close(fd);
+        return result;
+    }
+
+    //Tells the producers to stop waiting for free slots and unmaps the ring
+    void Close()
+    {
+        if (!m_pHeader)
+            return;
+
+        __atomic_store_n(&m_pHeader->ReaderState, (uint32_t)trrsReaderClosed, __ATOMIC_RELEASE);
+        munmap(m_pHeader, m_MappingSize);
+        m_pHeader = 0;
+    }
+
+    //Passes all published slots to the decoder without waiting. Returns the number of consumed bytes.
+    unsigned Poll(SysprogsTestPacketDecoder &decoder)
+    {
+        unsigned done = 0;
+        if (!m_pHeader)
+            return 0;
+
+        for (;;)
+        {
+            SysprogsTestReportSlotHeader *pSlot = SysprogsTestReportRing_GetSlot(m_pHeader, m_Position);
+            if (__atomic_load_n(&pSlot->Sequence, __ATOMIC_ACQUIRE) != m_Position + 1)
+                break;
+
+            unsigned size = pSlot->Size;
+            if (size > m_pHeader->SlotSize - sizeof(SysprogsTestReportSlotHeader))
+                size = 0;
+
+            decoder.ProcessData(pSlot + 1, size);
+            done += size;
+
+            __atomic_store_n(&pSlot->Sequence, m_Position + m_pHeader->SlotCount, __ATOMIC_RELEASE);
+            m_Position++;
+        }
+
+        return done;
+    }
+};
+
+#endif
@@ -10,36 +10,37 @@
 
 namespace TinyEmbeddedTest
 {
-	void InitializeSimulation(int testCount, TestInstance **pTests)
+	void InitializeSimulation(int testCount, const TestInstance **pTests)
 	{
 		LPSTR pCommandLine = GetCommandLine();
 		if (strstr(pCommandLine, "/listtests"))
 		{
 			printf("Available tests:\n");
-			for (TestGroup *pGroup = TestGroup::s_pFirstTestGroup; pGroup; pGroup = pGroup->m_pNextGroup)
+			for (const TestInstance *const *p = GetFirstTestEntry(); p < GetEndOfTestEntries(); p++)
 			{
-				for (TestInstance *pTest = pGroup->m_pFirstTest; pTest; pTest = pTest->m_pNextTestInGroup)
-				{
-					printf("group = '%s', test = '%s', file = '', line = '', address = '%08x', attributes = '", pGroup->GetName(), pTest->GetName(), pTest);
+				const TestInstance *pTest = *p;
+				if (!pTest)
+					continue;
+
+				printf("group = '%s', test = '%s', file = '', line = '', address = '%08x', attributes = '", pTest->GetGroupName(), pTest->GetName(), pTest);
 
-					const char *pTag = pTest->GetTag();
-					size_t tagLength = 0;
+				const char *pTag = pTest->GetTag();
+				size_t tagLength = 0;
+				if (pTag)
+				{
+					const char marker[] = "attachAttributes(TestAttributeCollection<";
+					pTag = strstr(pTag, marker);
 					if (pTag)
-					{
-						const char marker[] = "attachAttributes(TestAttributeCollection<";
-						pTag = strstr(pTag, marker);
-						if (pTag)
-							pTag += sizeof(marker) - 1;
-						char *p2 = strchr(pTag, '>');
-						if (p2)
-							tagLength = p2 - pTag;
-					}
+						pTag += sizeof(marker) - 1;
+					char *p2 = strchr(pTag, '>');
+					if (p2)
+						tagLength = p2 - pTag;
+				}
 
-					if (pTag && tagLength)
-						fwrite(pTag, tagLength, 1, stdout);
+				if (pTag && tagLength)
+					fwrite(pTag, tagLength, 1, stdout);
 
-					printf("'\n");
-				}
+				printf("'\n");
 			}
 
 			fflush(stdout);
@@ -69,7 +70,7 @@ namespace TinyEmbeddedTest
 			{
 				for (int i = 0; i < testCount; i++)
 				{
-					std::string name = std::string(pTests[i]->m_pGroup->GetName()) + "." + pTests[i]->GetName();
+					std::string name = std::string(pTests[i]->GetGroupName()) + "." + pTests[i]->GetName();
 					if (selectedTests.find(name) == selectedTests.end())
 					{
 						deleted++;
@@ -11,45 +11,181 @@
 #define TINY_EMBEDDED_TEST_CONTEXT_RESTORE_MODE 0
 #endif
 
-TestGroup *TestGroup::s_pFirstTestGroup = 0;
-
 #if TINY_EMBEDDED_TEST_CONTEXT_RESTORE_MODE == 1
 static jmp_buf s_TinyEmbeddedTestJumpBuffer;
 #elif TINY_EMBEDDED_TEST_CONTEXT_RESTORE_MODE == 2
 #include <exception>
 #endif
 
+#if defined(_WIN32)
+//The linker sorts the .tinytest$* sections by the suffix and may insert zero padding between them
+static const TestInstance *const s_TestSectionStart __attribute__((section(".tinytest$a"), used)) = NULL;
+static const TestInstance *const s_TestSectionEnd __attribute__((section(".tinytest$z"), used)) = NULL;
+
+const TestInstance *const *TinyEmbeddedTest::GetFirstTestEntry()
+{
+	return &s_TestSectionStart + 1;
+}
+
+const TestInstance *const *TinyEmbeddedTest::GetEndOfTestEntries()
+{
+	return &s_TestSectionEnd;
+}
+#elif defined(__ICCARM__)
+#pragma section = "tinytest_tests" const
+
+const TestInstance *const *TinyEmbeddedTest::GetFirstTestEntry()
+{
+	return (const TestInstance *const *)__section_begin("tinytest_tests");
+}
+
+const TestInstance *const *TinyEmbeddedTest::GetEndOfTestEntries()
+{
+	return (const TestInstance *const *)__section_end("tinytest_tests");
+}
+#else
+//Weak, so that a program without any tests (and hence without the section) still links
+extern "C" const TestInstance *const __start_tinytest_tests[] __attribute__((weak));
+extern "C" const TestInstance *const __stop_tinytest_tests[] __attribute__((weak));
+
+const TestInstance *const *TinyEmbeddedTest::GetFirstTestEntry()
+{
+	return __start_tinytest_tests;
+}
+
+const TestInstance *const *TinyEmbeddedTest::GetEndOfTestEntries()
+{
+	return __stop_tinytest_tests;
+}
+#endif
+
+//Indices of the selected test section entries. 16 bits are enough for any realistic test count and halve the RAM used on 32-bit targets.
+typedef unsigned short TestEntryIndex;
+
+/*
+	The debugger selects the tests by clearing or reordering the pointers in the array passed to SysprogsTestHook_SelectTests().
+	The array only exists inside this function. The selection is converted to a list of section entry indices in the order
+	returned by the debugger, so the pointers do not take stack space while the tests are running. Returns the number of selected tests.
+*/
+static int __attribute__((noinline)) SelectTests(const TestInstance *const *pFirstEntry, int entryCount, int testCount, TestEntryIndex *pSelection)
+{
+#ifdef __ICCARM__
+	const TestInstance **pTests = (const TestInstance **)malloc(testCount * sizeof(TestInstance *));
+#else
+	const TestInstance **pTests = (const TestInstance **)alloca(testCount * sizeof(TestInstance *));
+#endif
+	int index = 0;
+	for (int i = 0; i < entryCount; i++)
+		if (pFirstEntry[i])
+			pTests[index++] = pFirstEntry[i];
+
+#ifdef SIMULATION
+	TinyEmbeddedTest::InitializeSimulation(testCount, pTests);
+#endif
+
+	SysprogsTestHook_SelectTests(testCount, (void **)pTests);
+
+	//Each search starts after the previous match, so the unchanged section order is converted in a single pass
+	int selected = 0, entry = 0;
+	for (int i = 0; i < testCount; i++)
+	{
+		if (!pTests[i])
+			continue;
+
+		for (int scanned = 0; scanned < entryCount; scanned++, entry = (entry + 1) % entryCount)
+		{
+			if (pFirstEntry[entry] == pTests[i])
+			{
+				pSelection[selected++] = (TestEntryIndex)entry;
+				break;
+			}
+		}
+	}
+
+#ifdef __ICCARM__
+	free(pTests);
+#endif
+	return selected;
+}
+
+#ifndef TINY_EMBEDDED_TEST_GROUP_SELECTED_TESTS
+#define TINY_EMBEDDED_TEST_GROUP_SELECTED_TESTS 1
+#endif
+
+#if TINY_EMBEDDED_TEST_GROUP_SELECTED_TESTS
+static int CountGroupSetups(const TestInstance *const *pFirstEntry, const TestEntryIndex *pSelection, int count)
+{
+	int setups = 0;
+	for (int i = 0; i < count; i++)
+		if (!i || pFirstEntry[pSelection[i]]->m_pGroup != pFirstEntry[pSelection[i - 1]]->m_pGroup)
+			setups++;
+	return setups;
+}
+
+//Moves the selected tests from the same group together, keeping the relative order of the tests otherwise.
+//Groups run in the order of their first selected test. Each group's setup() and teardown() will then be called once.
+static void GroupSelectedTests(const TestInstance *const *pFirstEntry, TestEntryIndex *pSelection, int count)
+{
+	int setupsBefore = CountGroupSetups(pFirstEntry, pSelection, count);
+
+	for (int i = 0; i < count;)
+	{
+		TestGroup *pGroup = pFirstEntry[pSelection[i]]->m_pGroup;
+		int end = i + 1;
+		for (int j = end; j < count; j++)
+		{
+			if (pFirstEntry[pSelection[j]]->m_pGroup != pGroup)
+				continue;
+
+			TestEntryIndex entry = pSelection[j];
+			memmove(pSelection + end + 1, pSelection + end, (j - end) * sizeof(*pSelection));
+			pSelection[end++] = entry;
+		}
+
+		i = end;
+	}
+
+	int avoided = setupsBefore - CountGroupSetups(pFirstEntry, pSelection, count);
+	if (avoided > 0)
+	{
+		//Formatted manually, so that this does not pull in printf() when TINY_EMBEDDED_TEST_DEFERRED_FORMATTING is used
+		char message[80] = "Grouped the selected tests by test group, avoiding ", digits[12];
+		char *p = message + strlen(message);
+		int digitCount = 0;
+		for (unsigned value = avoided; value; value /= 10)
+			digits[digitCount++] = '0' + value % 10;
+		while (digitCount)
+			*p++ = digits[--digitCount];
+		strcpy(p, avoided == 1 ? " group setup call" : " group setup calls");
+		SysprogsTestHook_OutputMessage(tmsInfo, message);
+	}
+}
+#endif
+
 void RunAllTests()
 {
+	const TestInstance *const *pFirstEntry = TinyEmbeddedTest::GetFirstTestEntry();
+	int entryCount = TinyEmbeddedTest::GetEndOfTestEntries() - pFirstEntry;
     int testCount = 0;
-    for (TestGroup *pGroup = TestGroup::s_pFirstTestGroup; pGroup; pGroup = pGroup->m_pNextGroup)
-        for (TestInstance *pTest = pGroup->m_pFirstTest; pTest; pTest = pTest->m_pNextTestInGroup)
-            testCount++;
+	for (int i = 0; i < entryCount; i++)
+		if (pFirstEntry[i])
+			testCount++;
 
 #ifdef __ICCARM__
-	TestInstance **pAllInstances = (TestInstance **)malloc(testCount * sizeof(TestInstance *));	//WARNING: this will cause a one-time memory leak
+	TestEntryIndex *pSelection = (TestEntryIndex *)malloc(testCount * sizeof(TestEntryIndex));
 #else
-	TestInstance **pAllInstances = (TestInstance **)alloca(testCount * sizeof(TestInstance *));
+	TestEntryIndex *pSelection = (TestEntryIndex *)alloca(testCount * sizeof(TestEntryIndex));
 #endif
-    int index = 0;
-    
-    for (TestGroup *pGroup = TestGroup::s_pFirstTestGroup; pGroup; pGroup = pGroup->m_pNextGroup)
-        for (TestInstance *pTest = pGroup->m_pFirstTest; pTest; pTest = pTest->m_pNextTestInGroup)
-            pAllInstances[index++] = pTest;
-    
-#ifdef SIMULATION
-	TinyEmbeddedTest::InitializeSimulation(testCount, pAllInstances);
+	int selected = SelectTests(pFirstEntry, entryCount, testCount, pSelection);
+#if TINY_EMBEDDED_TEST_GROUP_SELECTED_TESTS
+	GroupSelectedTests(pFirstEntry, pSelection, selected);
 #endif
-	
-    SysprogsTestHook_SelectTests(testCount, (void **)pAllInstances);
     
     TestGroup *pGroup = 0;
 
-	for (index = testCount - 1; index >= 0; index--)
+	for (int index = 0; index < selected; index++)
     {
-        TestInstance *pInstance = pAllInstances[index];
-        if (!pInstance)
-            continue;
+        const TestInstance *pInstance = pFirstEntry[pSelection[index]];
         if (pInstance->m_pGroup != pGroup)
         {
             if (pGroup)
@@ -60,12 +196,12 @@ void RunAllTests()
         }
         
 #ifdef STORE_TEST_NAMES
-		SysprogsTestHook_TestStartingEx2(pInstance->m_pGroup->GetName(), pInstance->GetName());
+		SysprogsTestHook_TestStartingEx2(pInstance->GetGroupName(), pInstance->GetName());
 #else
-	    SysprogsTestHook_TestStarting(pInstance);
+	    SysprogsTestHook_TestStarting((void *)pInstance);
 #endif
 	    
-	    pGroup->TestSetup(pInstance);
+	    pGroup->TestSetup(const_cast<TestInstance *>(pInstance));
 	    
 #if TINY_EMBEDDED_TEST_CONTEXT_RESTORE_MODE == 1
 	    if (!setjmp(s_TinyEmbeddedTestJumpBuffer))
@@ -84,7 +220,7 @@ void RunAllTests()
 	    pInstance->run();
 #endif
 	    
-	    pGroup->TestTeardown(pInstance);
+	    pGroup->TestTeardown(const_cast<TestInstance *>(pInstance));
 	    
         SysprogsTestHook_TestEnded();
     }
@@ -92,14 +228,197 @@ void RunAllTests()
     if (pGroup)
         pGroup->teardown();
     
+#ifdef __ICCARM__
+	free(pSelection);
+#endif
     SysprogsTestHook_TestsCompleted();
 }
 
 
+//Ends the current test after a failure according to TINY_EMBEDDED_TEST_CONTEXT_RESTORE_MODE
+static void EndFailedTest()
+{
+#if TINY_EMBEDDED_TEST_CONTEXT_RESTORE_MODE == 1
+	longjmp(s_TinyEmbeddedTestJumpBuffer, 1);
+#elif TINY_EMBEDDED_TEST_CONTEXT_RESTORE_MODE == 2
+	throw std::exception();
+#endif
+}
+
+#ifndef TINY_EMBEDDED_TEST_DEFERRED_FORMATTING
+#define TINY_EMBEDDED_TEST_DEFERRED_FORMATTING 0
+#endif
+
+#if TINY_EMBEDDED_TEST_DEFERRED_FORMATTING
+
+#ifndef TINY_EMBEDDED_TEST_DEFERRED_ARGUMENTS_SIZE
+#define TINY_EMBEDDED_TEST_DEFERRED_ARGUMENTS_SIZE 128
+#endif
+
+/*
+	In the deferred formatting mode, the failure messages are not formatted on the target. Instead, the address of the
+	format string is reported together with the raw argument values (see totDeferredErrorSummary) and the host formats
+	the message using the format string from the ELF file. This avoids linking the printf()-family functions.
+	If the arguments do not fit into the buffer, the strings are truncated and the remaining arguments are omitted.
+*/
+struct DeferredArgumentBuffer
+{
+	unsigned char Data[TINY_EMBEDDED_TEST_DEFERRED_ARGUMENTS_SIZE];
+	int Size;
+	bool Full;
+
+	void Append(const void *pData, int size)
+	{
+		if (Full || Size + size > (int)sizeof(Data))
+		{
+			Full = true;
+			return;
+		}
+
+		memcpy(Data + Size, pData, size);
+		Size += size;
+	}
+
+	void AppendString(const char *pString)
+	{
+		if (!pString)
+			pString = "(null)";
+
+		int length = strlen(pString), available = (int)sizeof(Data) - Size - 1;
+		if (Full || available < 0)
+		{
+			Full = true;
+			return;
+		}
+
+		if (length > available)
+			length = available;
+
+		memcpy(Data + Size, pString, length);
+		Data[Size + length] = 0;
+		Size += length + 1;
+	}
+};
+
+//Fetches the arguments in the same way as printf() would, so that the host can decode them using the same format string
+static void PackDeferredArguments(DeferredArgumentBuffer &buffer, const char *pFormat, va_list ap)
+{
+	for (const char *p = pFormat; *p; p++)
+	{
+		if (*p != '%')
+			continue;
+		if (*++p == '%')
+			continue;
+
+		while (*p && strchr("-+ #0", *p))
+			p++;
+
+		for (;;)
+		{
+			if (*p == '*')
+			{
+				int value = va_arg(ap, int);
+				buffer.Append(&value, sizeof(value));
+				p++;
+			}
+			else
+				while (*p >= '0' && *p <= '9')
+					p++;
+
+			if (*p != '.')
+				break;
+			p++;
+		}
+
+		int longCount = 0;
+		bool isSize = false, isLongDouble = false;
+		for (; *p && strchr("hlLjzt", *p); p++)
+		{
+			if (*p == 'l')
+				longCount++;
+			else if (*p == 'j')
+				longCount = 2;
+			else if (*p == 'z' || *p == 't')
+				isSize = true;
+			else if (*p == 'L')
+				isLongDouble = true;
+		}
+
+		switch (*p)
+		{
+		case 'd':
+		case 'i':
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+		case 'c':
+			if (longCount >= 2)
+			{
+				long long value = va_arg(ap, long long);
+				buffer.Append(&value, sizeof(value));
+			}
+			else if (longCount == 1)
+			{
+				long value = va_arg(ap, long);
+				buffer.Append(&value, sizeof(value));
+			}
+			else if (isSize)
+			{
+				size_t value = va_arg(ap, size_t);
+				buffer.Append(&value, sizeof(value));
+			}
+			else
+			{
+				int value = va_arg(ap, int);
+				buffer.Append(&value, sizeof(value));
+			}
+			break;
+		case 'p':
+		{
+			void *value = va_arg(ap, void *);
+			buffer.Append(&value, sizeof(value));
+			break;
+		}
+		case 's':
+			buffer.AppendString(va_arg(ap, const char *));
+			break;
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+		{
+			double value = isLongDouble ? (double)va_arg(ap, long double) : va_arg(ap, double);
+			buffer.Append(&value, sizeof(value));
+			break;
+		}
+		case 'n':
+			va_arg(ap, void *);
+			break;
+		default:
+			return;	//Unsupported or truncated format specifier. The host will not be able to decode the remaining arguments either.
+		}
+	}
+}
+
+#endif
+
 void ReportTestFailure(const char *pFormat, ...)
 {
     va_list ap;
     va_start(ap, pFormat);
+#if TINY_EMBEDDED_TEST_DEFERRED_FORMATTING
+	DeferredArgumentBuffer arguments;
+	arguments.Size = 0;
+	arguments.Full = false;
+	PackDeferredArguments(arguments, pFormat, ap);
+	va_end(ap);
+	SysprogsTestHook_TestFailedDeferred(0, pFormat, arguments.Data, arguments.Size);
+#else
     int requiredLength = vsnprintf(0, 0, pFormat, ap);
 	
 #ifdef __ICCARM__
@@ -114,15 +433,70 @@ void ReportTestFailure(const char *pFormat, ...)
 
 #ifdef __ICCARM__
 	free(pBuffer);
+#endif
 #endif
 
-#if TINY_EMBEDDED_TEST_CONTEXT_RESTORE_MODE == 1
-	longjmp(s_TinyEmbeddedTestJumpBuffer, 1);
-#elif TINY_EMBEDDED_TEST_CONTEXT_RESTORE_MODE == 2
-	throw std::exception();
+	EndFailedTest();
+}
+
+#if TINY_EMBEDDED_TEST_BINARY_VALUES
+
+#ifndef TINY_EMBEDDED_TEST_MAX_REPORTED_BLOCK_SIZE
+#define TINY_EMBEDDED_TEST_MAX_REPORTED_BLOCK_SIZE 64
 #endif
+
+namespace TinyEmbeddedTest
+{
+	void ReportValueMismatch(const char *pSummary, const char *pFile, int line, const TestReportedValue *pValues, int valueCount)
+	{
+		SysprogsTestHook_TestFailedWithValues(0, pSummary, pFile, line, pValues, valueCount);
+		EndFailedTest();
+	}
+
+	bool ReportStringMismatch(const char *pSummary, const char *pFile, int line, const char *pExpected, const char *pActual)
+	{
+		TestReportedValue values[2] = { { tvtString, pExpected, 0 }, { tvtString, pActual, 0 } };
+		for (int i = 0; i < 2; i++)
+		{
+			if (!values[i].pData)
+				values[i].pData = "(null)";
+			values[i].Size = strlen((const char *)values[i].pData);
+			if (values[i].Size > TINY_EMBEDDED_TEST_MAX_REPORTED_BLOCK_SIZE)
+				values[i].Size = TINY_EMBEDDED_TEST_MAX_REPORTED_BLOCK_SIZE;
+		}
+
+		SysprogsTestHook_TestFailedWithValues(0, pSummary, pFile, line, values, 2);
+		EndFailedTest();
+		return false;
+	}
+
+	//Reports the window around the first difference, so that the host can show a diff without receiving the entire block
+	bool ReportMemoryMismatch(const char *pFile, int line, const void *pExpected, const void *pActual, unsigned size)
+	{
+		unsigned offset = 0;
+		while (offset < size && ((const unsigned char *)pExpected)[offset] == ((const unsigned char *)pActual)[offset])
+			offset++;
+
+		offset &= ~15U;
+		unsigned windowSize = size - offset;
+		if (windowSize > TINY_EMBEDDED_TEST_MAX_REPORTED_BLOCK_SIZE)
+			windowSize = TINY_EMBEDDED_TEST_MAX_REPORTED_BLOCK_SIZE;
+
+		TestReportedValue values[] = {
+			{ tvtMemoryBlock, (const char *)pExpected + offset, windowSize },
+			{ tvtMemoryBlock, (const char *)pActual + offset, windowSize },
+			{ tvtUnsignedInteger, &offset, sizeof(offset) },
+			{ tvtUnsignedInteger, &size, sizeof(size) },
+		};
+
+		SysprogsTestHook_TestFailedWithValues(0, "Unexpected memory block contents", pFile, line, values, 4);
+		EndFailedTest();
+		return false;
+	}
 }
 
+#endif
+
 
 void OutputTestMessage(const char *pMessage)
 {
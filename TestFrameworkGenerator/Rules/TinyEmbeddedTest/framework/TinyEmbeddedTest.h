@@ -14,94 +14,73 @@ class TestGroup;
 #define STORE_TEST_NAMES
 #endif
 
-class NamedTestObject
-{
-#ifdef STORE_TEST_NAMES
-  private:
-	const char *m_pName = NULL;
-	const char *m_pTag = NULL;
-
-  public:
-	void AttachTag(const char *pTag) { m_pTag = pTag; }
-	void AttachName(const char *pName) { m_pName = pName; }
-	const char *GetName() { return m_pName; }
-	const char *GetTag() { return m_pTag; }
+/*
+	Each TEST() defines a constant TestInstance object (placed in the read-only memory) and puts a pointer to it into
+	a dedicated linker section. RunAllTests() enumerates the tests by walking that section, so registering the tests
+	requires neither RAM nor startup constructors. The TestInstance objects keep the testInstance_<group>_<test>
+	names, as the debugger uses them to discover and select the tests.
+*/
+#ifdef _WIN32
+#define TINY_EMBEDDED_TEST_SECTION ".tinytest$t"	//Sorted between the .tinytest$a and .tinytest$z markers by the linker
 #else
-  public:
-	void AttachName(const char *)
-	{
-	}
-
-	const char *GetName() { return NULL; }
-	const char *GetTag() { return NULL; }
+#define TINY_EMBEDDED_TEST_SECTION "tinytest_tests"	//The linker defines __start_tinytest_tests and __stop_tinytest_tests
+#endif
 
+#ifdef __ICCARM__
+#define TINY_EMBEDDED_TEST_SECTION_ENTRY _Pragma("location=\"tinytest_tests\"") __root static
+#else
+#define TINY_EMBEDDED_TEST_SECTION_ENTRY static __attribute__((section(TINY_EMBEDDED_TEST_SECTION), used))
 #endif
-};
 
-class TestInstance : public NamedTestObject
+class TestInstance
 {
 public:
-    TestInstance *m_pNextTestInGroup;
-    TestGroup *m_pGroup;
-    
-    virtual void run() = 0;
+	void (*m_pRun)();
+	TestGroup *m_pGroup;
+	const char *(*m_pGetTag)();	//Only set for tests with attributes
+#ifdef STORE_TEST_NAMES
+	const char *m_pGroupName;
+	const char *m_pName;
+
+	const char *GetGroupName() const { return m_pGroupName; }
+	const char *GetName() const { return m_pName; }
+#else
+	const char *GetGroupName() const { return NULL; }
+	const char *GetName() const { return NULL; }
+#endif
+
+	const char *GetTag() const { return m_pGetTag ? m_pGetTag() : NULL; }
+	void run() const { m_pRun(); }
 };
 
 namespace TinyEmbeddedTest
 {
-	void InitializeSimulation(int testCount, TestInstance **pTests);
+	void InitializeSimulation(int testCount, const TestInstance **pTests);
+
+	//Returns the contents of the test section. May contain NULL entries (e.g. alignment padding on Windows).
+	const TestInstance *const *GetFirstTestEntry();
+	const TestInstance *const *GetEndOfTestEntries();
 }
 
-class TestGroup : public NamedTestObject
+class TestGroup
 {
   public:
-    static TestGroup *s_pFirstTestGroup;
-    TestGroup *m_pNextGroup;
-    TestInstance *m_pFirstTest;
-        
+	constexpr TestGroup() {}
+
     virtual void setup() {}
     virtual void teardown() {}
 	
 	virtual void TestSetup(TestInstance *) {}
 	virtual void TestTeardown(TestInstance *) {}
-    
-    void Register()
-    {
-        m_pNextGroup = s_pFirstTestGroup;
-        s_pFirstTestGroup = this;
-    }
-    
-    void RegisterTest(class TestInstance *pTest)
-    {
-        if (pTest->m_pGroup)
-            return; //Already registered
-        pTest->m_pNextTestInGroup = m_pFirstTest;
-        m_pFirstTest = pTest;
-        pTest->m_pGroup = this;
-    }
-
-	//This is used in simulation environment where we need to report test names and select them by name.
-	void RegisterTest(class TestInstance *pTest, const char *pGroupName, const char *pTestName)
-	{
-		RegisterTest(pTest);
-		this->AttachName(pGroupName);
-		pTest->AttachName(pTestName);
-	}
-
-	friend void TinyEmbeddedTest::InitializeSimulation(int testCount, TestInstance **pTests);
 };
 
-template <typename _TestGroup> static inline TestGroup *GetTestGroup()
+//The group objects are statically allocated, so that the test descriptors can refer to them at compile time
+template <typename _TestGroup> struct TestGroupInstance
 {
-    static _TestGroup testGroup;
-    static bool registered = false;
-    if (!registered)
-    {
-        registered = true;
-        testGroup.Register();
-    }
-    return &testGroup;
-}
+	static _TestGroup Instance;
+};
+
+template <typename _TestGroup> _TestGroup TestGroupInstance<_TestGroup>::Instance;
 
 #define TEST_GROUP(groupName) struct TestGroup_ ## groupName; \
     struct TestGroup_ ## groupName : public TestGroup
@@ -112,43 +91,133 @@ class TestAttributeCollection
 };
 
 #ifdef STORE_TEST_NAMES
-#define REGISTER_TEST_WRAPPER(method, groupName, testName) RegisterTest(method, groupName, testName)
-#define DO_ATTACH_TEST_TAG(tag) AttachTag(tag)
+#define STORED_TEST_NAMES(groupName, testName) , #groupName, #testName
+#define DO_ATTACH_TEST_TAG(tag) return tag
 #else
-#define REGISTER_TEST_WRAPPER(method, groupName, testName) RegisterTest(method)
-#define DO_ATTACH_TEST_TAG(tag)
+#define STORED_TEST_NAMES(groupName, testName)
+#define DO_ATTACH_TEST_TAG(tag) return NULL
 #endif
 
-#define TEST(groupName, testName) class TestInstance_ ## groupName ## _ ## testName : public TestInstance \
+#define DEFINE_TEST_INSTANCE(groupName, testName, getTag) \
+extern const TestInstance testInstance_ ## groupName ## _ ## testName; \
+const TestInstance testInstance_ ## groupName ## _ ## testName = { &TestInstance_ ## groupName ## _ ## testName::run, &TestGroupInstance<TestGroup_ ## groupName>::Instance, getTag STORED_TEST_NAMES(groupName, testName) }; \
+TINY_EMBEDDED_TEST_SECTION_ENTRY const TestInstance *const pTestInstance_ ## groupName ## _ ## testName = &testInstance_ ## groupName ## _ ## testName;
+
+#define TEST(groupName, testName) class TestInstance_ ## groupName ## _ ## testName \
 { \
 public: \
-    void run(); \
+    static void run(); \
 }; \
-TestInstance_ ## groupName ## _ ## testName testInstance_ ## groupName ## _ ## testName; \
-void __attribute__((constructor)) RegisterTest_ ## groupName ## _ ## testName () \
-{ \
-    GetTestGroup<TestGroup_ ## groupName>()->REGISTER_TEST_WRAPPER(&testInstance_ ## groupName ## _ ## testName, #groupName, #testName); \
-} \
+DEFINE_TEST_INSTANCE(groupName, testName, NULL) \
 void TestInstance_ ## groupName ## _ ## testName::run()
         
-//The attachAttributes() method is intentionally blank and is only used during ELF symbol enumeration
-#define TEST_WITH_ATTRIBUTES(groupName, testName, ...) class TestInstance_ ## groupName ## _ ## testName : public TestInstance \
+//The attachAttributes() method is only used during ELF symbol enumeration (and to list the attributes in simulation mode)
+#define TEST_WITH_ATTRIBUTES(groupName, testName, ...) class TestInstance_ ## groupName ## _ ## testName \
 { \
 public: \
-	void __attribute__ ((noinline)) attachAttributes(TestAttributeCollection<__VA_ARGS__> * = nullptr) { DO_ATTACH_TEST_TAG(__PRETTY_FUNCTION__); } \
-    void run(); \
-	TestInstance_ ## groupName ## _ ## testName () { attachAttributes(); } \
+	static const char * __attribute__ ((noinline)) attachAttributes(TestAttributeCollection<__VA_ARGS__> * = nullptr) { DO_ATTACH_TEST_TAG(__PRETTY_FUNCTION__); } \
+	static const char *GetTag() { return attachAttributes(); } \
+    static void run(); \
 }; \
-TestInstance_ ## groupName ## _ ## testName testInstance_ ## groupName ## _ ## testName; \
-void __attribute__((constructor)) RegisterTest_ ## groupName ## _ ## testName () \
-{ \
-    GetTestGroup<TestGroup_ ## groupName>()->REGISTER_TEST_WRAPPER(&testInstance_ ## groupName ## _ ## testName, #groupName, #testName); \
-} \
+DEFINE_TEST_INSTANCE(groupName, testName, &TestInstance_ ## groupName ## _ ## testName::GetTag) \
 void TestInstance_ ## groupName ## _ ## testName::run()
         
 void RunAllTests();
 void ReportTestFailure(const char *pFormat, ...);
 
+#ifndef TINY_EMBEDDED_TEST_BINARY_VALUES
+#define TINY_EMBEDDED_TEST_BINARY_VALUES 0
+#endif
+
+#if TINY_EMBEDDED_TEST_BINARY_VALUES
+/*
+	In this mode, the assertion macros do not format the compared values on the target. Instead, they report them in
+	the binary form (see totComparedValues) together with the code location, and the host renders them (including
+	the memory block diffs). Strings and memory blocks are truncated to TINY_EMBEDDED_TEST_MAX_REPORTED_BLOCK_SIZE bytes.
+*/
+#include <SysprogsTestHooks.h>
+
+namespace TinyEmbeddedTest
+{
+	void ReportValueMismatch(const char *pSummary, const char *pFile, int line, const TestReportedValue *pValues, int valueCount);
+	bool ReportStringMismatch(const char *pSummary, const char *pFile, int line, const char *pExpected, const char *pActual);
+	bool ReportMemoryMismatch(const char *pFile, int line, const void *pExpected, const void *pActual, unsigned size);
+
+	enum { kUnsupportedValueType = -1 };
+
+	//Values of other types (e.g. structures) are not reported
+	template <typename _Type> struct ValueTypeOf { enum { Value = kUnsupportedValueType }; };
+	template <typename _Type> struct ValueTypeOf<_Type *> { enum { Value = tvtPointer }; };
+	template <> struct ValueTypeOf<bool> { enum { Value = tvtBoolean }; };
+	template <> struct ValueTypeOf<char> { enum { Value = ((char)-1 < 0) ? tvtSignedInteger : tvtUnsignedInteger }; };
+	template <> struct ValueTypeOf<signed char> { enum { Value = tvtSignedInteger }; };
+	template <> struct ValueTypeOf<short> { enum { Value = tvtSignedInteger }; };
+	template <> struct ValueTypeOf<int> { enum { Value = tvtSignedInteger }; };
+	template <> struct ValueTypeOf<long> { enum { Value = tvtSignedInteger }; };
+	template <> struct ValueTypeOf<long long> { enum { Value = tvtSignedInteger }; };
+	template <> struct ValueTypeOf<unsigned char> { enum { Value = tvtUnsignedInteger }; };
+	template <> struct ValueTypeOf<unsigned short> { enum { Value = tvtUnsignedInteger }; };
+	template <> struct ValueTypeOf<unsigned int> { enum { Value = tvtUnsignedInteger }; };
+	template <> struct ValueTypeOf<unsigned long> { enum { Value = tvtUnsignedInteger }; };
+	template <> struct ValueTypeOf<unsigned long long> { enum { Value = tvtUnsignedInteger }; };
+	template <> struct ValueTypeOf<float> { enum { Value = tvtFloat }; };
+	template <> struct ValueTypeOf<double> { enum { Value = tvtFloat }; };
+
+	template <typename _Type> static inline TestReportedValue MakeReportedValue(const _Type &value)
+	{
+		TestReportedValue result = { (TestValueType)ValueTypeOf<_Type>::Value, &value, sizeof(value) };
+		return result;
+	}
+
+	//Always inlined, so that the failure hooks see the same number of frames between them and the test
+	template <typename _Expected, typename _Actual>
+	static inline __attribute__((always_inline)) bool ReportMismatch(const char *pSummary, const char *pFile, int line, const _Expected &expected, const _Actual &actual)
+	{
+		TestReportedValue values[] = { MakeReportedValue(expected), MakeReportedValue(actual) };
+		bool supported = (int)ValueTypeOf<_Expected>::Value != kUnsupportedValueType && (int)ValueTypeOf<_Actual>::Value != kUnsupportedValueType;
+		ReportValueMismatch(pSummary, pFile, line, values, supported ? 2 : 0);
+		return false;
+	}
+
+	template <typename _Type>
+	static inline __attribute__((always_inline)) bool ReportMismatch(const char *pSummary, const char *pFile, int line, const _Type &expected, const _Type &actual, const _Type &extra)
+	{
+		TestReportedValue values[] = { MakeReportedValue(expected), MakeReportedValue(actual), MakeReportedValue(extra) };
+		ReportValueMismatch(pSummary, pFile, line, values, 3);
+		return false;
+	}
+}
+
+#define TINY_EMBEDDED_TEST_REPORT_MISMATCH(summary, ...) TinyEmbeddedTest::ReportMismatch(summary, __FILE__, __LINE__, __VA_ARGS__)
+
+#define CHECK(condition) ((condition) || (TinyEmbeddedTest::ReportValueMismatch("Unexpected boolean value: expected true, found false", __FILE__, __LINE__, 0, 0), 0))
+#define CHECK_FALSE(condition) ((!condition) || (TinyEmbeddedTest::ReportValueMismatch("Unexpected boolean value: expected false, found true", __FILE__, __LINE__, 0, 0), 0))
+#define CHECK_EQUAL(expected, actual) ((expected == actual) || TINY_EMBEDDED_TEST_REPORT_MISMATCH("Unexpected value in CHECK_EQUAL()", (expected), (actual)))
+
+#define STRCMP_EQUAL(expected, actual) ((!strcmp((expected), (actual))) || TinyEmbeddedTest::ReportStringMismatch("Unexpected string value", __FILE__, __LINE__, (expected), (actual)))
+#define STRNCMP_EQUAL(expected, actual, length) ((!strncmp((expected), (actual), (length))) || TinyEmbeddedTest::ReportStringMismatch("Unexpected string value", __FILE__, __LINE__, (expected), (actual)))
+
+#define STRCMP_NOCASE_EQUAL(expected, actual) ((!strcasecmp((expected), (actual))) || TinyEmbeddedTest::ReportStringMismatch("Unexpected string value (case-insensitive)", __FILE__, __LINE__, (expected), (actual)))
+#define STRCMP_CONTAINS(expected, actual) ((strstr((actual), (expected))) || TinyEmbeddedTest::ReportStringMismatch("Unexpected string value: expected a string containing the expected value", __FILE__, __LINE__, (expected), (actual)))
+
+#define LONGS_EQUAL(expected, actual) (((long)(expected) == (long)(actual)) || TINY_EMBEDDED_TEST_REPORT_MISMATCH("Unexpected long value", (long)(expected), (long)(actual)))
+#define UNSIGNED_LONGS_EQUAL(expected, actual) (((unsigned long)(expected) == (unsigned long)(actual)) || TINY_EMBEDDED_TEST_REPORT_MISMATCH("Unexpected unsigned long value", (unsigned long)(expected), (unsigned long)(actual)))
+#define UNSIGNED_LONGS_EQUAL_WITHIN(expected, actual, tolerance) (( (((unsigned long)(expected) < (unsigned long)(actual)) ? ((unsigned long)(actual) - (unsigned long)(expected)) : ((unsigned long)(expected) - (unsigned long)(actual))) <= (unsigned long)(tolerance)) || TINY_EMBEDDED_TEST_REPORT_MISMATCH("Unexpected unsigned long value (outside tolerance)", (unsigned long)(expected), (unsigned long)(actual), (unsigned long)(tolerance)))
+
+#define BYTES_EQUAL(expected, actual) (((unsigned char)(expected) == (unsigned char)(actual)) || TINY_EMBEDDED_TEST_REPORT_MISMATCH("Unexpected byte value", (unsigned char)(expected), (unsigned char)(actual)))
+#define POINTERS_EQUAL(expected, actual) (((void *)(expected) == (void *)(actual)) || TINY_EMBEDDED_TEST_REPORT_MISMATCH("Unexpected pointer value", (void *)(expected), (void *)(actual)))
+
+#define DOUBLES_EQUAL(expected, actual, tolerance) ((fabs((actual)-(expected)) <= (tolerance)) || TINY_EMBEDDED_TEST_REPORT_MISMATCH("Unexpected double value (outside tolerance)", (double)(expected), (double)(actual), (double)(tolerance)))
+#define DOUBLES_NOT_EQUAL(expected, actual, tolerance) ((fabs((double)(actual)-(double)(expected)) > (double)(tolerance)) || TINY_EMBEDDED_TEST_REPORT_MISMATCH("Unexpected double value: expected a value outside tolerance", (double)(expected), (double)(actual), (double)(tolerance)))
+#define MEMCMP_EQUAL(expected, actual, size) ((!memcmp((expected), (actual), (size))) || TinyEmbeddedTest::ReportMemoryMismatch(__FILE__, __LINE__, (expected), (actual), (size)))
+
+#define FLOATS_EQUAL(expected, actual, tolerance) ((fabsf((float)(actual)-(float)(expected)) <= (float)(tolerance)) || TINY_EMBEDDED_TEST_REPORT_MISMATCH("Unexpected float value (outside tolerance)", (float)(expected), (float)(actual), (float)(tolerance)))
+#define FLOATS_NOT_EQUAL(expected, actual, tolerance) ((fabsf((float)(actual)-(float)(expected)) > (float)(tolerance)) || TINY_EMBEDDED_TEST_REPORT_MISMATCH("Unexpected float value: expected a value outside tolerance", (float)(expected), (float)(actual), (float)(tolerance)))
+
+#define BITS_EQUAL(expected, actual, mask) ((((expected) & (mask)) == ((actual) & (mask))) || TINY_EMBEDDED_TEST_REPORT_MISMATCH("Unexpected value of the masked bits", (unsigned long)((expected) & (mask)), (unsigned long)((actual) & (mask)), (unsigned long)(mask)))
+
+#else
+
 #define CHECK(condition) ((condition) || (ReportTestFailure("Unexpected boolean value: expected true, found false"), 0))
 #define CHECK_FALSE(condition) ((!condition) || (ReportTestFailure("Unexpected boolean value: expected false, found true"), 0))
 #define CHECK_EQUAL(expected, actual) ((expected == actual) || (ReportTestFailure("Unexpected value in CHECK_EQUAL()"), 0))
@@ -174,6 +243,14 @@ void ReportTestFailure(const char *pFormat, ...);
 #define FLOATS_NOT_EQUAL(expected, actual, tolerance) ((fabsf((float)(actual)-(float)(expected)) > (float)(tolerance)) || (ReportTestFailure("Unexpected float value: expected not equal to %f, found %f", (float)(expected), (float)(actual)), 0))
 
 #define BITS_EQUAL(expected, actual, mask) ((((expected) & (mask)) == ((actual) & (mask))) || (ReportTestFailure("Unexpected value: expected %x, found %x", (expected) & (mask), (actual) & (mask)), 0))
+
+#endif
+
+#if defined(TINY_EMBEDDED_TEST_DEFERRED_FORMATTING) && TINY_EMBEDDED_TEST_DEFERRED_FORMATTING
+//The deferred formatting requires the format string to be a literal in the FLASH memory, so the text is sent as an argument
+#define FAIL(text) ReportTestFailure("%s", (text))
+#else
 #define FAIL(text) ReportTestFailure(text)
+#endif
 
 void OutputTestMessage(const char *pMessage);
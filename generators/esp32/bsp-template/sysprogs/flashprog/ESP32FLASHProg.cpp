@@ -13,6 +13,12 @@ enum FLASHCommandType
     Reset,
 };
 
+enum
+{
+    EraseSectorSize = 4096,
+    EraseBlockSize = 65536,
+};
+
 struct Header
 {
     int Signature;
@@ -181,6 +187,33 @@ extern "C" void rtc_printf()
 {
 }
 
+//Covers the range with the fewest erase operations: 64KB blocks where the alignment allows it and 4KB sectors elsewhere.
+static int EraseRange(unsigned address, unsigned size)
+{
+    unsigned end = (address + size + EraseSectorSize - 1) & ~(EraseSectorSize - 1);
+    address &= ~(EraseSectorSize - 1);
+    
+    while (address < end)
+    {
+        int result;
+        if (!(address & (EraseBlockSize - 1)) && (end - address) >= EraseBlockSize)
+        {
+            result = SPIEraseBlock(address / EraseBlockSize);
+            address += EraseBlockSize;
+        }
+        else
+        {
+            result = SPIEraseSector(address / EraseSectorSize);
+            address += EraseSectorSize;
+        }
+        
+        if (result)
+            return result;
+    }
+    
+    return 0;
+}
+
 extern "C" void FLASHHelperEntry(int command, int Arg1, int Arg2)
 {
     int Result = -1;
@@ -209,7 +242,7 @@ extern "C" void FLASHHelperEntry(int command, int Arg1, int Arg2)
         case Erase:
             Result = SPIUnlock();
             if (Result == SPI_FLASH_RESULT_OK)
-                Result = SPIEraseArea(Arg1, Arg2);
+                Result = EraseRange(Arg1, Arg2);
             break;
         case Program:
             for (i = 0; i < Arg2; i += s_SectorSize)
@@ -16,6 +16,18 @@ enum FLASHCommandType
 	Initialize,
 	Erase,
 	Program,
+	ComputeSectorHashes,
+	EraseChip,
+	RunBatch,
+	Verify,
+};
+
+enum
+{
+	HashBufferTooSmall = -3,
+	VerificationFailed = -4,
+	NotExecuted = -5,
+	InvalidBatch = -6,
 };
 
 struct ParameterArea
@@ -34,13 +46,30 @@ struct Header
 	void *ParameterArea;
 	void *DataBuffer;
 	unsigned DataBufferSize;
+	int BatchSignature;
+	void *BatchEntries;
+	unsigned MaxBatchEntries;
+};
+
+//An entry of the command list executed by RunBatch. Arg1/Arg2 have the same meaning as in s_ParameterArea,
+//BufferOffset specifies the location of the data for Program/Verify inside s_DataBuffer.
+struct BatchEntry
+{
+	int Command;
+	unsigned Arg1;
+	unsigned Arg2;
+	unsigned BufferOffset;
+	int Result;
 };
 
 static int s_SectorSize = 4096, s_EraseBlockSize = 4096;
+static const unsigned s_LargeEraseBlockSize = 65536;
 
 extern "C" void FLASHHelperEntry();
 
 char s_DataBuffer[65536];
+uint32_t s_HashReadBuffer[1024];
+BatchEntry s_BatchEntries[32];
 
 Header s_Header __attribute__((section(".headers"))) = { 
 	'HSLF',
@@ -48,7 +77,10 @@ Header s_Header __attribute__((section(".headers"))) = {
 	(void *)&FLASHHelperEntry,
 	&s_ParameterArea,
 	s_DataBuffer,
-	sizeof(s_DataBuffer)
+	sizeof(s_DataBuffer),
+	'HCTB',
+	s_BatchEntries,
+	sizeof(s_BatchEntries) / sizeof(s_BatchEntries[0])
 };
 
 extern "C" 
@@ -58,11 +90,166 @@ extern "C"
 	void Cache_Read_Disable(void);
 	int SPIWrite(unsigned dst, const void *src, unsigned size);
 	int SPIEraseSector(uint16_t sector);
+	int SPIEraseBlock(unsigned block);
+	int SPIEraseChip();
+	int SPIRead(unsigned src, void *dst, unsigned size);
+}
+
+//The ESP8266 ROM does not provide a CRC32 function, so we use a compact 4-bit table instead.
+static uint32_t UpdateCRC32(uint32_t crc, const uint8_t *pData, unsigned size)
+{
+	static const uint32_t s_CRC32Table[16] = {
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+	};
+	
+	crc = ~crc;
+	for (unsigned i = 0; i < size; i++)
+	{
+		crc = s_CRC32Table[(crc ^ pData[i]) & 0x0F] ^ (crc >> 4);
+		crc = s_CRC32Table[(crc ^ (pData[i] >> 4)) & 0x0F] ^ (crc >> 4);
+	}
+	return ~crc;
+}
+
+//Covers the range with the fewest erase operations: 64KB blocks where the alignment allows it and s_EraseBlockSize sectors elsewhere.
+static int EraseRange(unsigned address, unsigned size)
+{
+	unsigned end = address + size;
+	end = ((end + s_EraseBlockSize - 1) / s_EraseBlockSize) * s_EraseBlockSize;
+	address = (address / s_EraseBlockSize) * s_EraseBlockSize;
+	
+	while (address < end)
+	{
+		int result;
+		if (!(address % s_LargeEraseBlockSize) && (end - address) >= s_LargeEraseBlockSize)
+		{
+			result = SPIEraseBlock(address / s_LargeEraseBlockSize);
+			address += s_LargeEraseBlockSize;
+		}
+		else
+		{
+			result = SPIEraseSector(address / s_EraseBlockSize);
+			address += s_EraseBlockSize;
+		}
+		
+		if (result)
+			return result;
+	}
+	
+	return 0;
+}
+
+//Computes CRC32 of each erase block in the specified range and stores them in s_DataBuffer, so that the host can skip blocks that already contain the right data.
+static int ComputeSectorHashesForRange(unsigned address, unsigned size)
+{
+	uint32_t *pHashes = (uint32_t *)s_DataBuffer;
+	unsigned sectorCount = (size + s_EraseBlockSize - 1) / s_EraseBlockSize;
+	if (sectorCount > sizeof(s_DataBuffer) / sizeof(pHashes[0]) || s_EraseBlockSize > sizeof(s_HashReadBuffer))
+		return HashBufferTooSmall;
+	
+	for (unsigned i = 0; i < sectorCount; i++)
+	{
+		unsigned todo = size - i * s_EraseBlockSize;
+		if (todo > s_EraseBlockSize)
+			todo = s_EraseBlockSize;
+		
+		int result = SPIRead(address + i * s_EraseBlockSize, s_HashReadBuffer, (todo + 3) & ~3);
+		if (result)
+			return result;
+		
+		pHashes[i] = UpdateCRC32(0, (const uint8_t *)s_HashReadBuffer, todo);
+	}
+	
+	return 0;
+}
+
+static int ProgramRange(unsigned address, unsigned size, const char *pData)
+{
+	for (unsigned i = 0; i < size; i += s_SectorSize)
+	{
+		int todo = size - i;
+		if (todo > s_SectorSize)
+			todo = s_SectorSize;
+		
+		int result = SPIWrite(address + i, pData + i, todo);
+		if (result)
+			return result;
+	}
+	
+	return 0;
+}
+
+static int VerifyRange(unsigned address, unsigned size, const char *pData)
+{
+	for (unsigned i = 0; i < size; i += sizeof(s_HashReadBuffer))
+	{
+		unsigned todo = size - i;
+		if (todo > sizeof(s_HashReadBuffer))
+			todo = sizeof(s_HashReadBuffer);
+		
+		int result = SPIRead(address + i, s_HashReadBuffer, (todo + 3) & ~3);
+		if (result)
+			return result;
+		
+		const char *pFLASHData = (const char *)s_HashReadBuffer;
+		for (unsigned j = 0; j < todo; j++)
+			if (pFLASHData[j] != pData[i + j])
+				return VerificationFailed;
+	}
+	
+	return 0;
+}
+
+//Executes a single FLASH command. The caller is responsible for disabling the FLASH cache.
+static int ExecuteFLASHCommand(int command, unsigned arg1, unsigned arg2, unsigned bufferOffset)
+{
+	if ((command == Program || command == Verify) && (bufferOffset > sizeof(s_DataBuffer) || arg2 > sizeof(s_DataBuffer) - bufferOffset))
+		return InvalidBatch;
+	
+	switch (command)
+	{
+		case Erase:
+			return EraseRange(arg1, arg2);
+		case EraseChip:
+			return SPIEraseChip();
+		case Program:
+			return ProgramRange(arg1, arg2, s_DataBuffer + bufferOffset);
+		case Verify:
+			return VerifyRange(arg1, arg2, s_DataBuffer + bufferOffset);
+		case ComputeSectorHashes:
+			return ComputeSectorHashesForRange(arg1, arg2);
+		default:
+			return -2;
+	}
+}
+
+//Runs the first 'count' entries of s_BatchEntries with the cache disabled only once, stopping at the first failed entry.
+static int RunBatchEntries(unsigned count)
+{
+	if (count > sizeof(s_BatchEntries) / sizeof(s_BatchEntries[0]))
+		return InvalidBatch;
+	
+	for (unsigned i = 0; i < count; i++)
+		s_BatchEntries[i].Result = NotExecuted;
+	
+	for (unsigned i = 0; i < count; i++)
+	{
+		BatchEntry *pEntry = &s_BatchEntries[i];
+		if (pEntry->Command == Initialize || pEntry->Command == RunBatch)
+			pEntry->Result = InvalidBatch;
+		else
+			pEntry->Result = ExecuteFLASHCommand(pEntry->Command, pEntry->Arg1, pEntry->Arg2, pEntry->BufferOffset);
+		
+		if (pEntry->Result)
+			return pEntry->Result;
+	}
+	
+	return 0;
 }
 
 void FLASHHelperEntry()
 {
-	int i;
 	switch (s_ParameterArea.Command)
 	{
 		case Initialize:
@@ -72,33 +259,16 @@ void FLASHHelperEntry()
 			s_EraseBlockSize = s_ParameterArea.Arg2;
 			s_ParameterArea.Result = spi_flash_attach();
 			break;
-		case Erase:
+		case RunBatch:
 			Cache_Read_Disable();
-			for (i = 0; i < s_ParameterArea.Arg2; i += s_EraseBlockSize)
-			{
-				s_ParameterArea.Result = SPIEraseSector((s_ParameterArea.Arg1 + i) / s_EraseBlockSize);
-				if (s_ParameterArea.Result)
-					break;
-			}
+			s_ParameterArea.Result = RunBatchEntries(s_ParameterArea.Arg1);
 			Cache_Read_Enable(0, 0, 1);
 			break;
-		case Program:
+		default:
 			Cache_Read_Disable();
-			for (i = 0; i < s_ParameterArea.Arg2; i += s_SectorSize)
-			{
-				int todo = s_ParameterArea.Arg2 - i;
-				if (todo > s_SectorSize)
-					todo = s_SectorSize;
-					
-				s_ParameterArea.Result = SPIWrite(s_ParameterArea.Arg1 + i, s_DataBuffer + i, todo);
-				if (s_ParameterArea.Result)
-					break;
-			}
+			s_ParameterArea.Result = ExecuteFLASHCommand(s_ParameterArea.Command, s_ParameterArea.Arg1, s_ParameterArea.Arg2, 0);
 			Cache_Read_Enable(0, 0, 1);
 			break;
-		default:
-			s_ParameterArea.Result = -2;
-			break;
 	}
 	
 	asm("break 1, 1");